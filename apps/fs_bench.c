@@ -0,0 +1,542 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+#define BLOCK_SIZE 4096
+
+/* Largest image the 16-bit FAT can describe */
+#define DATA_BLOCKS_MAX 8192
+
+/* Transfer sizes of the read and write cases */
+static const size_t io_sizes[] = { 512, 4096, 65536, 1048576 };
+
+/* Directory sizes of the churn cases */
+static const int churn_counts[] = { 16, 64, FS_FILE_MAX_COUNT };
+
+/* Benchmark settings, see usage() */
+struct config {
+	const char *diskname;
+	const char *json;
+	size_t data_blocks;
+	size_t file_size;
+	int ops;
+	int rounds;
+	unsigned int seed;
+	int keep;
+	int prealloc;
+	struct fs_options opts;
+};
+
+/* Outcome of one case of the matrix */
+struct result {
+	char name[32];
+	size_t io_size;
+	int ops;
+	size_t bytes;
+	double seconds;
+	double p50, p99, p999;
+};
+
+static struct result results[64];
+static int nresults;
+
+/* Latency of every operation of the current case, in nanoseconds */
+static uint64_t *lat;
+static int nlat;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of the sorted latencies, in microseconds */
+static double percentile(double p)
+{
+	int rank;
+
+	if (!nlat)
+		return 0;
+	rank = (int)(p * nlat + 0.999999) - 1;
+	if (rank < 0)
+		rank = 0;
+	if (rank >= nlat)
+		rank = nlat - 1;
+	return lat[rank] / 1000.0;
+}
+
+/* Record the case whose operations are in lat[] */
+static void report(const char *name, size_t io_size, size_t bytes,
+		   uint64_t elapsed)
+{
+	struct result *r;
+
+	if (nresults == ARRAY_SIZE(results))
+		die("too many cases");
+	r = &results[nresults++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->io_size = io_size;
+	r->ops = nlat;
+	r->bytes = bytes;
+	r->seconds = elapsed / 1e9;
+	qsort(lat, nlat, sizeof(*lat), cmp_u64);
+	r->p50 = percentile(0.50);
+	r->p99 = percentile(0.99);
+	r->p999 = percentile(0.999);
+	nlat = 0;
+}
+
+/* Write an empty ECS150FS image, the same layout fs_make.x produces */
+static void make_image(const char *diskname, size_t data_blocks)
+{
+	size_t fat_blocks = (data_blocks * 2 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t total = 1 + fat_blocks + 1 + data_blocks;
+	static uint8_t block[BLOCK_SIZE];
+	int fd;
+
+	fd = open(diskname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die_perror("open");
+
+	memset(block, 0, sizeof(block));
+	memcpy(block, "ECS150FS", 8);
+	block[8] = total & 0xFF;
+	block[9] = total >> 8;
+	block[10] = (1 + fat_blocks) & 0xFF;
+	block[11] = (1 + fat_blocks) >> 8;
+	block[12] = (2 + fat_blocks) & 0xFF;
+	block[13] = (2 + fat_blocks) >> 8;
+	block[14] = data_blocks & 0xFF;
+	block[15] = data_blocks >> 8;
+	block[16] = fat_blocks;
+	if (write(fd, block, BLOCK_SIZE) != BLOCK_SIZE)
+		die_perror("write");
+
+	/* FAT entry 0 is never allocated */
+	memset(block, 0, sizeof(block));
+	block[0] = block[1] = 0xFF;
+	if (write(fd, block, BLOCK_SIZE) != BLOCK_SIZE)
+		die_perror("write");
+
+	if (ftruncate(fd, total * BLOCK_SIZE))
+		die_perror("ftruncate");
+	close(fd);
+}
+
+static void mount_image(struct config *cfg)
+{
+	if (fs_mount_opts(cfg->diskname, &cfg->opts))
+		die("Cannot mount %s", cfg->diskname);
+}
+
+static void umount_image(void)
+{
+	if (fs_umount())
+		die("Cannot unmount");
+}
+
+static int open_file(const char *name, int create)
+{
+	int fd;
+
+	if (create && fs_create(name))
+		die("Cannot create %s", name);
+	fd = fs_open(name);
+	if (fd < 0)
+		die("Cannot open %s", name);
+	return fd;
+}
+
+static void bench_seq_write(struct config *cfg, char *buf, size_t io_size)
+{
+	uint64_t start, t;
+	size_t done = 0;
+	int fd;
+
+	fd = open_file("seq", 1);
+	start = now_ns();
+	if (cfg->prealloc && fs_fallocate(fd, cfg->file_size))
+		die("Cannot preallocate %zu bytes", cfg->file_size);
+	while (done < cfg->file_size) {
+		t = now_ns();
+		if (fs_write(fd, buf, io_size) != (int)io_size)
+			die("Short write at %zu", done);
+		lat[nlat++] = now_ns() - t;
+		done += io_size;
+	}
+	/* Throughput includes getting the data to the disk */
+	fs_sync();
+	report("seq_write", io_size, done, now_ns() - start);
+	fs_close(fd);
+}
+
+static void bench_seq_read(struct config *cfg, char *buf, size_t io_size)
+{
+	uint64_t start, t;
+	size_t done = 0;
+	int fd;
+
+	fd = open_file("seq", 0);
+	start = now_ns();
+	while (done < cfg->file_size) {
+		t = now_ns();
+		if (fs_read(fd, buf, io_size) != (int)io_size)
+			die("Short read at %zu", done);
+		lat[nlat++] = now_ns() - t;
+		done += io_size;
+	}
+	report("seq_read", io_size, done, now_ns() - start);
+	fs_close(fd);
+}
+
+static void bench_random(struct config *cfg, char *buf, size_t io_size,
+			 int write)
+{
+	size_t slots = cfg->file_size / io_size;
+	uint64_t start, t;
+	int fd, i, ret;
+
+	fd = open_file("seq", 0);
+	start = now_ns();
+	for (i = 0; i < cfg->ops; i++) {
+		size_t offset = (size_t)(rand() % slots) * io_size;
+
+		t = now_ns();
+		if (fs_lseek(fd, offset))
+			die("Cannot seek to %zu", offset);
+		ret = write ? fs_write(fd, buf, io_size) :
+			fs_read(fd, buf, io_size);
+		if (ret != (int)io_size)
+			die("Short transfer at %zu", offset);
+		lat[nlat++] = now_ns() - t;
+	}
+	if (write)
+		fs_sync();
+	report(write ? "rand_write" : "rand_read", io_size,
+	       (size_t)cfg->ops * io_size, now_ns() - start);
+	fs_close(fd);
+}
+
+/* Log-style appends: open, seek to the end, write and close every time */
+static void bench_append(struct config *cfg, char *buf, size_t io_size)
+{
+	size_t limit = cfg->file_size;
+	uint64_t start, t;
+	int fd, i;
+
+	fs_close(open_file("append", 1));
+	start = now_ns();
+	for (i = 0; i < cfg->ops && (size_t)(i + 1) * io_size <= limit; i++) {
+		t = now_ns();
+		fd = open_file("append", 0);
+		if (fs_lseek(fd, fs_stat(fd)) ||
+		    fs_write(fd, buf, io_size) != (int)io_size)
+			die("Cannot append");
+		fs_close(fd);
+		lat[nlat++] = now_ns() - t;
+	}
+	fs_sync();
+	report("append", io_size, (size_t)nlat * io_size, now_ns() - start);
+	if (fs_delete("append"))
+		die("Cannot delete append");
+}
+
+/* Fill the directory with @count files, open them all, then empty it again */
+static void bench_churn(struct config *cfg, char *buf, int count)
+{
+	static const char *names[] = { "churn_create", "churn_open",
+				       "churn_delete" };
+	uint64_t elapsed[ARRAY_SIZE(names)] = { 0 };
+	uint64_t *step_lat, t;
+	int nops = cfg->rounds * count, n = 0, round, i, fd;
+	char name[FS_FILENAME_LEN];
+	size_t step;
+
+	step_lat = malloc(ARRAY_SIZE(names) * nops * sizeof(*step_lat));
+	if (!step_lat)
+		die_perror("malloc");
+
+	for (round = 0; round < cfg->rounds; round++) {
+		for (step = 0; step < ARRAY_SIZE(names); step++) {
+			for (i = 0; i < count; i++) {
+				snprintf(name, sizeof(name), "churn%d", i);
+				t = now_ns();
+				if (step == 0) {
+					fd = open_file(name, 1);
+					if (fs_write(fd, buf, 100) != 100)
+						die("Cannot fill %s", name);
+					fs_close(fd);
+				} else if (step == 1) {
+					fs_close(open_file(name, 0));
+				} else if (fs_delete(name)) {
+					die("Cannot delete %s", name);
+				}
+				t = now_ns() - t;
+				step_lat[step * nops + n + i] = t;
+				elapsed[step] += t;
+			}
+		}
+		n += count;
+	}
+
+	for (step = 0; step < ARRAY_SIZE(names); step++) {
+		memcpy(lat, step_lat + step * nops, nops * sizeof(*lat));
+		nlat = nops;
+		report(names[step], count, 0, elapsed[step]);
+	}
+	free(step_lat);
+}
+
+static void print_text(struct config *cfg)
+{
+	int i;
+
+	printf("fs_bench: %zu data blocks, %zu byte file, %d random ops, "
+	       "cache %zu, readahead %zu, journal %zu, dedup %zu\n",
+	       cfg->data_blocks, cfg->file_size, cfg->ops,
+	       cfg->opts.cache_blocks, cfg->opts.readahead_blocks,
+	       cfg->opts.journal_blocks, cfg->opts.dedup_entries);
+	printf("%-14s %8s %7s %10s %10s %10s %10s %10s\n", "case", "size",
+	       "ops", "MB/s", "ops/s", "p50(us)", "p99(us)", "p999(us)");
+	for (i = 0; i < nresults; i++) {
+		struct result *r = &results[i];
+
+		printf("%-14s %8zu %7d %10.1f %10.0f %10.1f %10.1f %10.1f\n",
+		       r->name, r->io_size, r->ops,
+		       r->bytes / r->seconds / 1e6, r->ops / r->seconds,
+		       r->p50, r->p99, r->p999);
+	}
+}
+
+static void print_json(struct config *cfg, FILE *out)
+{
+	int i;
+
+	fprintf(out, "{\n  \"config\": {\"data_blocks\": %zu, "
+		"\"file_size\": %zu, \"ops\": %d, \"rounds\": %d, "
+		"\"seed\": %u, \"cache_blocks\": %zu, \"backend\": %d, "
+		"\"queue_depth\": %u, \"readahead_blocks\": %zu, "
+		"\"journal_blocks\": %zu, \"dedup_entries\": %zu},\n"
+		"  \"results\": [\n",
+		cfg->data_blocks, cfg->file_size, cfg->ops, cfg->rounds,
+		cfg->seed, cfg->opts.cache_blocks, cfg->opts.backend,
+		cfg->opts.queue_depth, cfg->opts.readahead_blocks,
+		cfg->opts.journal_blocks, cfg->opts.dedup_entries);
+	for (i = 0; i < nresults; i++) {
+		struct result *r = &results[i];
+
+		fprintf(out, "    {\"case\": \"%s\", \"size\": %zu, "
+			"\"ops\": %d, \"bytes\": %zu, \"seconds\": %.6f, "
+			"\"mb_per_s\": %.3f, \"ops_per_s\": %.1f, "
+			"\"p50_us\": %.2f, \"p99_us\": %.2f, "
+			"\"p999_us\": %.2f}%s\n",
+			r->name, r->io_size, r->ops, r->bytes, r->seconds,
+			r->bytes / r->seconds / 1e6, r->ops / r->seconds,
+			r->p50, r->p99, r->p999,
+			i + 1 < nresults ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+
+	if (ret < 0 || ret == LONG_MAX)
+		die("Invalid number '%s'", argv);
+	return (size_t)ret;
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [options] <diskname>\n", program);
+	fprintf(stderr, "Creates <diskname> and runs the benchmark matrix on it.\n");
+	fprintf(stderr, "\t-b <blocks>\tdata blocks of the image (default 8192)\n");
+	fprintf(stderr, "\t-f <bytes>\tsize of the test file (default 8 MiB)\n");
+	fprintf(stderr, "\t-n <ops>\trandom and append operations per case (default 2000)\n");
+	fprintf(stderr, "\t-r <rounds>\tfill/empty rounds of the churn cases (default 20)\n");
+	fprintf(stderr, "\t-s <seed>\tseed of the random offsets (default 1)\n");
+	fprintf(stderr, "\t-c <blocks>\tblock cache size\n");
+	fprintf(stderr, "\t-m fd|mmap|uring\tdisk backend\n");
+	fprintf(stderr, "\t-q <depth>\tqueue depth\n");
+	fprintf(stderr, "\t-a <blocks>\treadahead limit\n");
+	fprintf(stderr, "\t-J <blocks>\tadd a metadata journal\n");
+	fprintf(stderr, "\t-D <entries>\tdeduplicate written blocks with an index this large\n");
+	fprintf(stderr, "\t-j <file>\talso write the results as JSON (- for stdout)\n");
+	fprintf(stderr, "\t-p\t\tpreallocate the sequential write file with fs_fallocate()\n");
+	fprintf(stderr, "\t-k\t\tkeep the image afterwards\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct config cfg = {
+		.data_blocks = DATA_BLOCKS_MAX,
+		.file_size = 8 << 20,
+		.ops = 2000,
+		.rounds = 20,
+		.seed = 1,
+		.opts = {
+			.cache_blocks = FS_CACHE_DEFAULT_BLOCKS,
+			.backend = FS_BACKEND_FD,
+			.readahead_blocks = FS_READAHEAD_DEFAULT_BLOCKS,
+		},
+	};
+	size_t i, max_ops;
+	char *buf;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:f:n:r:s:c:m:q:a:J:D:j:kp")) != -1) {
+		switch (opt) {
+		case 'b':
+			cfg.data_blocks = get_argv(optarg);
+			break;
+		case 'f':
+			cfg.file_size = get_argv(optarg);
+			break;
+		case 'n':
+			cfg.ops = get_argv(optarg);
+			break;
+		case 'r':
+			cfg.rounds = get_argv(optarg);
+			break;
+		case 's':
+			cfg.seed = get_argv(optarg);
+			break;
+		case 'c':
+			cfg.opts.cache_blocks = get_argv(optarg);
+			break;
+		case 'q':
+			cfg.opts.queue_depth = get_argv(optarg);
+			break;
+		case 'a':
+			cfg.opts.readahead_blocks = get_argv(optarg);
+			break;
+		case 'J':
+			cfg.opts.journal_blocks = get_argv(optarg);
+			break;
+		case 'D':
+			cfg.opts.dedup_entries = get_argv(optarg);
+			break;
+		case 'j':
+			cfg.json = optarg;
+			break;
+		case 'k':
+			cfg.keep = 1;
+			break;
+		case 'p':
+			cfg.prealloc = 1;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "fd"))
+				cfg.opts.backend = FS_BACKEND_FD;
+			else if (!strcmp(optarg, "mmap"))
+				cfg.opts.backend = FS_BACKEND_MMAP;
+			else if (!strcmp(optarg, "uring"))
+				cfg.opts.backend = FS_BACKEND_URING;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || cfg.ops <= 0 || cfg.rounds <= 0)
+		usage(argv[0]);
+	cfg.diskname = argv[optind];
+
+	if (cfg.data_blocks < 16 || cfg.data_blocks > DATA_BLOCKS_MAX)
+		die("Data blocks must be between 16 and %d", DATA_BLOCKS_MAX);
+	/* Leave room for the journal and the other cases next to the file */
+	if (cfg.file_size > cfg.data_blocks * BLOCK_SIZE / 2)
+		cfg.file_size = cfg.data_blocks * BLOCK_SIZE / 2;
+	cfg.file_size -= cfg.file_size % io_sizes[ARRAY_SIZE(io_sizes) - 1];
+	if (!cfg.file_size)
+		die("Image too small for %zu byte transfers",
+		    io_sizes[ARRAY_SIZE(io_sizes) - 1]);
+
+	max_ops = cfg.file_size / io_sizes[0];
+	if (max_ops < (size_t)cfg.ops)
+		max_ops = cfg.ops;
+	if (max_ops < (size_t)cfg.rounds * FS_FILE_MAX_COUNT)
+		max_ops = (size_t)cfg.rounds * FS_FILE_MAX_COUNT;
+	lat = malloc(max_ops * sizeof(*lat));
+	buf = malloc(io_sizes[ARRAY_SIZE(io_sizes) - 1]);
+	if (!lat || !buf)
+		die_perror("malloc");
+	for (i = 0; i < io_sizes[ARRAY_SIZE(io_sizes) - 1]; i++)
+		buf[i] = i * 31 + 7;
+	srand(cfg.seed);
+
+	make_image(cfg.diskname, cfg.data_blocks);
+	mount_image(&cfg);
+
+	for (i = 0; i < ARRAY_SIZE(io_sizes); i++) {
+		bench_seq_write(&cfg, buf, io_sizes[i]);
+		/* Read back from a cold mount */
+		umount_image();
+		mount_image(&cfg);
+		bench_seq_read(&cfg, buf, io_sizes[i]);
+		bench_random(&cfg, buf, io_sizes[i], 0);
+		bench_random(&cfg, buf, io_sizes[i], 1);
+		if (fs_delete("seq"))
+			die("Cannot delete seq");
+	}
+	bench_append(&cfg, buf, 256);
+	bench_append(&cfg, buf, BLOCK_SIZE);
+	for (i = 0; i < ARRAY_SIZE(churn_counts); i++)
+		bench_churn(&cfg, buf, churn_counts[i]);
+
+	umount_image();
+	if (!cfg.keep)
+		unlink(cfg.diskname);
+
+	print_text(&cfg);
+	if (cfg.json) {
+		FILE *out = strcmp(cfg.json, "-") ? fopen(cfg.json, "w") : stdout;
+
+		if (!out)
+			die_perror("fopen");
+		print_json(&cfg, out);
+		if (out != stdout)
+			fclose(out);
+	}
+
+	free(buf);
+	free(lat);
+	return 0;
+}
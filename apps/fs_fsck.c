@@ -0,0 +1,94 @@
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <fs.h>
+
+/* Exit codes, as with fsck(8) */
+#define EXIT_CLEAN	0
+#define EXIT_REPAIRED	1
+#define EXIT_PROBLEMS	4
+#define EXIT_FAILED	8
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t problems(const struct fs_fsck_report *r)
+{
+	return r->bad_entries + r->bad_chains + r->cross_links + r->bad_sizes +
+		r->bad_hole_maps + r->orphans + r->bad_names;
+}
+
+static void print_report(const char *diskname,
+			 const struct fs_fsck_report *r, uint64_t elapsed)
+{
+	printf("%s: %zu files, %zu blocks in chains, %zu free blocks, "
+	       "checked in %.3f ms\n", diskname, r->files, r->file_blocks,
+	       r->free_blocks, elapsed / 1e6);
+	if (r->journal_pending)
+		printf("journal holds transactions not replayed yet, "
+		       "the problems below may go away once mounted\n");
+	if (!problems(r))
+		return;
+	printf("bad_entries=%zu\n", r->bad_entries);
+	printf("bad_chains=%zu\n", r->bad_chains);
+	printf("cross_links=%zu\n", r->cross_links);
+	printf("bad_sizes=%zu\n", r->bad_sizes);
+	printf("bad_hole_maps=%zu\n", r->bad_hole_maps);
+	printf("orphans=%zu\n", r->orphans);
+	printf("bad_names=%zu\n", r->bad_names);
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [options] <diskname>\n", program);
+	fprintf(stderr, "Checks the FAT chains, file sizes and hole maps of the "
+		"unmounted image <diskname>.\n");
+	fprintf(stderr, "\t-r\t\trepair what can be repaired\n");
+	fprintf(stderr, "\t-v\t\tprint every problem found\n");
+	fprintf(stderr, "Exits with 0 if the image is consistent, 1 if every "
+		"problem was repaired,\n4 if problems are left and 8 if the "
+		"image cannot be checked.\n");
+	exit(EXIT_FAILED);
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_fsck_report report;
+	int flags = 0, left, opt;
+	uint64_t start;
+
+	while ((opt = getopt(argc, argv, "rv")) != -1) {
+		switch (opt) {
+		case 'r':
+			flags |= FS_FSCK_REPAIR;
+			break;
+		case 'v':
+			flags |= FS_FSCK_VERBOSE;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	start = now_ns();
+	left = fs_fsck(argv[optind], flags, &report);
+	if (left < 0) {
+		fprintf(stderr, "%s: cannot check %s\n", argv[0], argv[optind]);
+		return EXIT_FAILED;
+	}
+	print_report(argv[optind], &report, now_ns() - start);
+
+	if (left)
+		return EXIT_PROBLEMS;
+	return problems(&report) ? EXIT_REPAIRED : EXIT_CLEAN;
+}
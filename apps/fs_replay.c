@@ -0,0 +1,484 @@
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	replay_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Names of the recorded calls, indexed by enum fs_trace_op */
+static const char *op_names[FS_TRACE_OPS] = {
+	"mount", "umount", "sync", "info", "ls", "create", "delete", "open",
+	"close", "stat", "lseek", "write", "read", "truncate", "fallocate",
+	"defrag", "clone", "compress",
+};
+
+/* Replay settings, see usage() */
+struct config {
+	const char *trace;
+	const char *diskname;
+	const char *json;
+	unsigned int ctx;
+	int paced;
+	int verbose;
+	struct fs_options opts;
+};
+
+/* One call of the trace, with its name argument NULL-terminated */
+struct call {
+	struct fs_trace_record rec;
+	char name[256];
+	/* Position in the trace, keeps the sort stable */
+	size_t seq;
+};
+
+static struct call *calls;
+static size_t ncalls;
+
+/* Latencies of every kind of call, in nanoseconds */
+struct op_stats {
+	uint64_t *replayed;
+	size_t count;
+	uint64_t recorded;
+	/* Mean replayed latency, in microseconds */
+	double avg;
+	/* Calls whose outcome differs from the recorded one */
+	size_t diverged;
+};
+
+static struct op_stats ops[FS_TRACE_OPS];
+
+/* File descriptors of the trace mapped to the ones of the replay */
+static int fd_map[FS_OPEN_MAX_COUNT];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Replay calls in the order they started, not the order they returned */
+static int cmp_call(const void *a, const void *b)
+{
+	const struct call *x = a, *y = b;
+
+	if (x->rec.start != y->rec.start)
+		return (x->rec.start > y->rec.start) -
+			(x->rec.start < y->rec.start);
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* Load the calls of context @ctx from the trace file */
+static void load_trace(const char *path, unsigned int ctx)
+{
+	struct fs_trace_header header;
+	struct fs_trace_record rec;
+	size_t seq = 0, capacity = 0;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		die_perror("fopen");
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.signature, FS_TRACE_SIGNATURE,
+		   sizeof(header.signature)))
+		die("%s is not a trace", path);
+	if (header.version != FS_TRACE_VERSION ||
+	    header.record_size != sizeof(rec))
+		die("%s has unsupported trace version %u", path,
+		    header.version);
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		struct call *c;
+
+		if (ncalls == capacity) {
+			capacity = capacity ? capacity * 2 : 1024;
+			calls = realloc(calls, capacity * sizeof(*calls));
+			if (!calls)
+				die_perror("realloc");
+		}
+		c = &calls[ncalls];
+		c->rec = rec;
+		c->seq = seq++;
+		if (rec.name_len &&
+		    fread(c->name, rec.name_len, 1, f) != 1)
+			die("%s is truncated", path);
+		c->name[rec.name_len] = '\0';
+		if (rec.op >= FS_TRACE_OPS)
+			die("%s has unknown call %u", path, rec.op);
+		if (rec.ctx == ctx)
+			ncalls++;
+	}
+	if (ferror(f))
+		die_perror("fread");
+	fclose(f);
+
+	qsort(calls, ncalls, sizeof(*calls), cmp_call);
+}
+
+/* Wait until @offset nanoseconds after @base */
+static void pace(uint64_t base, uint64_t offset)
+{
+	uint64_t target = base + offset;
+	struct timespec ts = {
+		.tv_sec = target / 1000000000,
+		.tv_nsec = target % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+/* Replay file descriptor of a recorded one, -1 if it was never opened */
+static int map_fd(int fd)
+{
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT)
+		return -1;
+	return fd_map[fd];
+}
+
+/* Perform one call, return what it returned */
+static int replay_call(struct config *cfg, struct call *c, char *buf)
+{
+	struct fs_trace_record *rec = &c->rec;
+	struct fs_defrag_budget budget = { 0 };
+	struct fs_defrag_report defrag;
+	int ret, fd = map_fd(rec->fd);
+
+	switch (rec->op) {
+	case FS_TRACE_MOUNT:
+		/* Recorded disknames are irrelevant, the image is ours */
+		return fs_mount_opts(cfg->diskname, &cfg->opts);
+	case FS_TRACE_UMOUNT:
+		return fs_umount();
+	case FS_TRACE_SYNC:
+		return fs_sync();
+	case FS_TRACE_INFO:
+		return fs_info();
+	case FS_TRACE_LS:
+		return fs_ls();
+	case FS_TRACE_CREATE:
+		return fs_create(c->name);
+	case FS_TRACE_DELETE:
+		return fs_delete(c->name);
+	case FS_TRACE_OPEN:
+		ret = fs_open(c->name);
+		if (rec->ret >= 0 && rec->ret < FS_OPEN_MAX_COUNT)
+			fd_map[rec->ret] = ret;
+		return ret;
+	case FS_TRACE_CLOSE:
+		ret = fs_close(fd);
+		if (rec->fd >= 0 && rec->fd < FS_OPEN_MAX_COUNT)
+			fd_map[rec->fd] = -1;
+		return ret;
+	case FS_TRACE_STAT:
+		return fs_stat(fd);
+	case FS_TRACE_LSEEK:
+		return fs_lseek(fd, rec->arg);
+	case FS_TRACE_WRITE:
+		return fs_write(fd, buf, rec->arg);
+	case FS_TRACE_READ:
+		return fs_read(fd, buf, rec->arg);
+	case FS_TRACE_TRUNCATE:
+		return fs_truncate(fd, rec->arg);
+	case FS_TRACE_FALLOCATE:
+		return fs_fallocate(fd, rec->arg);
+	case FS_TRACE_DEFRAG:
+		budget.max_blocks = rec->arg;
+		return fs_defrag(&budget, &defrag);
+	case FS_TRACE_CLONE:
+		/* The new name follows the NULL character ending the first */
+		return fs_clone(c->name, c->name + strlen(c->name) + 1);
+	case FS_TRACE_COMPRESS:
+		return fs_compress(c->name);
+	}
+	return -1;
+}
+
+/* Same outcome: both failed, or both succeeded with the same result */
+static int same_outcome(struct call *c, int ret)
+{
+	switch (c->rec.op) {
+	case FS_TRACE_OPEN:
+		/* The replay may hand out other descriptors */
+		return (ret < 0) == (c->rec.ret < 0);
+	default:
+		return ret == c->rec.ret;
+	}
+}
+
+static void replay(struct config *cfg)
+{
+	uint64_t base, t, elapsed;
+	size_t i, max_io = 1;
+	int mounted = 0, ret;
+	char *buf;
+
+	for (i = 0; i < ncalls; i++) {
+		struct fs_trace_record *rec = &calls[i].rec;
+
+		if ((rec->op == FS_TRACE_READ || rec->op == FS_TRACE_WRITE) &&
+		    rec->arg > max_io)
+			max_io = rec->arg;
+		if (!ops[rec->op].replayed) {
+			ops[rec->op].replayed = malloc(ncalls *
+						       sizeof(uint64_t));
+			if (!ops[rec->op].replayed)
+				die_perror("malloc");
+		}
+	}
+	buf = malloc(max_io);
+	if (!buf)
+		die_perror("malloc");
+	for (i = 0; i < max_io; i++)
+		buf[i] = i * 31 + 7;
+	for (i = 0; i < ARRAY_SIZE(fd_map); i++)
+		fd_map[i] = -1;
+
+	/* A trace that started after mounting needs the image mounted */
+	if (ncalls && calls[0].rec.op != FS_TRACE_MOUNT) {
+		if (fs_mount_opts(cfg->diskname, &cfg->opts))
+			die("Cannot mount %s", cfg->diskname);
+		mounted = 1;
+	}
+
+	base = now_ns();
+	for (i = 0; i < ncalls; i++) {
+		struct call *c = &calls[i];
+		struct op_stats *s = &ops[c->rec.op];
+
+		if (cfg->paced)
+			pace(base, c->rec.start - calls[0].rec.start);
+		t = now_ns();
+		ret = replay_call(cfg, c, buf);
+		s->replayed[s->count++] = now_ns() - t;
+		s->recorded += c->rec.duration;
+		if (!same_outcome(c, ret)) {
+			s->diverged++;
+			if (cfg->verbose)
+				fprintf(stderr, "%s(%s%d, %lu) returned %d "
+					"instead of %d\n",
+					op_names[c->rec.op], c->name,
+					c->rec.fd, (unsigned long)c->rec.arg,
+					ret, c->rec.ret);
+		}
+		if (c->rec.op == FS_TRACE_MOUNT)
+			mounted = ret == 0 || mounted;
+		else if (c->rec.op == FS_TRACE_UMOUNT && ret == 0)
+			mounted = 0;
+	}
+	elapsed = now_ns() - base;
+
+	/* Leave the image consistent even if the trace did not unmount */
+	if (mounted) {
+		for (i = 0; i < ARRAY_SIZE(fd_map); i++)
+			if (fd_map[i] >= 0)
+				fs_close(fd_map[i]);
+		fs_umount();
+	}
+
+	printf("fs_replay: %zu calls in %.3f s (%.0f calls/s)%s\n", ncalls,
+	       elapsed / 1e9, elapsed ? ncalls / (elapsed / 1e9) : 0,
+	       cfg->paced ? ", paced" : "");
+	free(buf);
+}
+
+/* Nearest-rank percentile of sorted latencies, in microseconds */
+static double percentile(uint64_t *lat, size_t n, double p)
+{
+	size_t rank;
+
+	if (!n)
+		return 0;
+	rank = (size_t)(p * n + 0.999999);
+	if (rank)
+		rank--;
+	if (rank >= n)
+		rank = n - 1;
+	return lat[rank] / 1000.0;
+}
+
+static void print_json(struct config *cfg, FILE *out)
+{
+	int op, first = 1;
+
+	fprintf(out, "{\n  \"trace\": \"%s\", \"calls\": %zu, "
+		"\"paced\": %d,\n  \"ops\": [\n", cfg->trace, ncalls,
+		cfg->paced);
+	for (op = 0; op < FS_TRACE_OPS; op++) {
+		struct op_stats *s = &ops[op];
+
+		if (!s->count)
+			continue;
+		fprintf(out, "%s    {\"call\": \"%s\", \"count\": %zu, "
+			"\"recorded_avg_us\": %.3f, \"avg_us\": %.3f, "
+			"\"p50_us\": %.3f, \"p99_us\": %.3f, "
+			"\"max_us\": %.3f, \"diverged\": %zu}",
+			first ? "" : ",\n", op_names[op], s->count,
+			s->recorded / 1000.0 / s->count, s->avg,
+			percentile(s->replayed, s->count, 0.50),
+			percentile(s->replayed, s->count, 0.99),
+			s->replayed[s->count - 1] / 1000.0, s->diverged);
+		first = 0;
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
+
+static void report(struct config *cfg)
+{
+	int op;
+
+	printf("%-8s %8s %12s %12s %10s %10s %10s %9s\n", "call", "count",
+	       "rec avg(us)", "avg(us)", "p50(us)", "p99(us)", "max(us)",
+	       "diverged");
+	for (op = 0; op < FS_TRACE_OPS; op++) {
+		struct op_stats *s = &ops[op];
+		uint64_t total = 0;
+		size_t i;
+
+		if (!s->count)
+			continue;
+		qsort(s->replayed, s->count, sizeof(uint64_t), cmp_u64);
+		for (i = 0; i < s->count; i++)
+			total += s->replayed[i];
+		s->avg = total / 1000.0 / s->count;
+		printf("%-8s %8zu %12.2f %12.2f %10.2f %10.2f %10.2f %9zu\n",
+		       op_names[op], s->count, s->recorded / 1000.0 / s->count,
+		       s->avg, percentile(s->replayed, s->count, 0.50),
+		       percentile(s->replayed, s->count, 0.99),
+		       s->replayed[s->count - 1] / 1000.0, s->diverged);
+	}
+
+	if (cfg->json) {
+		FILE *out = strcmp(cfg->json, "-") ? fopen(cfg->json, "w") : stdout;
+
+		if (!out)
+			die_perror("fopen");
+		print_json(cfg, out);
+		if (out != stdout)
+			fclose(out);
+	}
+
+	for (op = 0; op < FS_TRACE_OPS; op++)
+		free(ops[op].replayed);
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+
+	if (ret < 0 || ret == LONG_MAX)
+		die("Invalid number '%s'", argv);
+	return (size_t)ret;
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [options] <trace> <diskname>\n", program);
+	fprintf(stderr, "Replays the calls of <trace> against <diskname>, "
+		"one after the other in the order they started.\n");
+	fprintf(stderr, "\t-p\t\treplay at the recorded pace instead of as fast as possible\n");
+	fprintf(stderr, "\t-x <ctx>\tcontext of the trace to replay (default 0)\n");
+	fprintf(stderr, "\t-c <blocks>\tblock cache size\n");
+	fprintf(stderr, "\t-m fd|mmap|uring\tdisk backend\n");
+	fprintf(stderr, "\t-q <depth>\tqueue depth\n");
+	fprintf(stderr, "\t-a <blocks>\treadahead limit\n");
+	fprintf(stderr, "\t-J <blocks>\tadd a metadata journal\n");
+	fprintf(stderr, "\t-j <file>\talso write the results as JSON (- for stdout)\n");
+	fprintf(stderr, "\t-v\t\treport every call that diverges from the trace\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct config cfg = {
+		.opts = {
+			.cache_blocks = FS_CACHE_DEFAULT_BLOCKS,
+			.backend = FS_BACKEND_FD,
+			.readahead_blocks = FS_READAHEAD_DEFAULT_BLOCKS,
+		},
+	};
+	int opt;
+
+	while ((opt = getopt(argc, argv, "px:c:m:q:a:J:j:v")) != -1) {
+		switch (opt) {
+		case 'p':
+			cfg.paced = 1;
+			break;
+		case 'x':
+			cfg.ctx = get_argv(optarg);
+			break;
+		case 'c':
+			cfg.opts.cache_blocks = get_argv(optarg);
+			break;
+		case 'q':
+			cfg.opts.queue_depth = get_argv(optarg);
+			break;
+		case 'a':
+			cfg.opts.readahead_blocks = get_argv(optarg);
+			break;
+		case 'J':
+			cfg.opts.journal_blocks = get_argv(optarg);
+			break;
+		case 'j':
+			cfg.json = optarg;
+			break;
+		case 'v':
+			cfg.verbose = 1;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "fd"))
+				cfg.opts.backend = FS_BACKEND_FD;
+			else if (!strcmp(optarg, "mmap"))
+				cfg.opts.backend = FS_BACKEND_MMAP;
+			else if (!strcmp(optarg, "uring"))
+				cfg.opts.backend = FS_BACKEND_URING;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 2)
+		usage(argv[0]);
+	cfg.trace = argv[optind];
+	cfg.diskname = argv[optind + 1];
+
+	load_trace(cfg.trace, cfg.ctx);
+	replay(&cfg);
+	report(&cfg);
+
+	free(calls);
+	return 0;
+}
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Run every script of this directory on a fresh virtual disk, then check the
+# disk it leaves behind with fs_fsck.x, and have fs_fsck.x repair a damaged
+# disk. Stops at the first failure.
+
+apps=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+# Host files the scripts write from and compare against
+dd if=/dev/urandom of=test_file bs=4096 count=1 2> /dev/null
+head -c 4096 /dev/zero | tr '\0' x > x_block
+
+fail() {
+	echo "FAIL	$1: $2"
+	exit 1
+}
+
+for script in "$apps"/scripts/*.script; do
+	name=$(basename "$script" .script)
+	rm -f disk.fs
+	"$apps"/fs_make.x disk.fs 200 > /dev/null || fail "$name" "cannot make disk"
+	"$apps"/test_fs.x script disk.fs "$script" > out.txt 2>&1 ||
+		fail "$name" "$(tail -n 1 out.txt)"
+	grep -q unexpected out.txt &&
+		fail "$name" "$(grep unexpected out.txt | head -n 1)"
+	# problems are printed first, as they are found
+	"$apps"/fs_fsck.x -v disk.fs > fsck.txt 2>&1 ||
+		fail "$name" "$(head -n 1 fsck.txt)"
+	echo "PASS	$name"
+done
+
+# Two files, the first one laid out from data block 1 on
+printf 'MOUNT\nCREATE\tfirst\nOPEN\tfirst\nWRITE\tFILE\ttest_file\n' > damage.script
+printf 'WRITE\tFILE\tx_block\nWRITE\tFILE\ttest_file\nCLOSE\n' >> damage.script
+printf 'CREATE\tsecond\nOPEN\tsecond\nWRITE\tFILE\tx_block\nCLOSE\nUMOUNT\n' >> damage.script
+# What is left once repaired: the chain of the first file was cut after two
+# blocks, so its size comes down to 8192, and the second file is untouched
+printf 'MOUNT\nOPEN\tfirst\nSIZE\t8192\nREAD\t4096\tFILE\ttest_file\n' > repaired.script
+printf 'READ\t4096\tFILE\tx_block\nCLOSE\nOPEN\tsecond\n' >> repaired.script
+printf 'READ\t4096\tFILE\tx_block\nCLOSE\nUMOUNT\n' >> repaired.script
+
+rm -f disk.fs
+"$apps"/fs_make.x disk.fs 200 > /dev/null || fail repair "cannot make disk"
+"$apps"/test_fs.x script disk.fs damage.script > out.txt 2>&1 ||
+	fail repair "$(tail -n 1 out.txt)"
+# The FAT starts at block 1: end the first chain at its second block, which
+# orphans the third one, and mark a free block in use
+printf '\377\377' | dd of=disk.fs bs=1 seek=$((4096 + 2 * 2)) conv=notrunc 2> /dev/null
+printf '\377\377' | dd of=disk.fs bs=1 seek=$((4096 + 2 * 150)) conv=notrunc 2> /dev/null
+"$apps"/fs_fsck.x disk.fs > fsck.txt 2>&1
+[ $? -eq 4 ] || fail repair "damage not found"
+grep -q "bad_sizes=1" fsck.txt && grep -q "orphans=2" fsck.txt ||
+	fail repair "$(tr '\n' ' ' < fsck.txt)"
+"$apps"/fs_fsck.x -r disk.fs > fsck.txt 2>&1
+[ $? -eq 1 ] || fail repair "not repaired: $(tail -n 1 fsck.txt)"
+"$apps"/fs_fsck.x disk.fs > fsck.txt 2>&1 ||
+	fail repair "$(tail -n 1 fsck.txt)"
+"$apps"/test_fs.x script disk.fs repaired.script > out.txt 2>&1 ||
+	fail repair "$(tail -n 1 out.txt)"
+grep -q unexpected out.txt &&
+	fail repair "$(grep unexpected out.txt | head -n 1)"
+echo "PASS	repair"
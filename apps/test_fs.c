@@ -34,6 +34,32 @@ struct thread_arg {
 	char **argv;
 };
 
+void print_stats(void)
+{
+	struct fs_stats st;
+
+	if (fs_stats(&st))
+		die("Cannot get stats");
+
+	printf("block_reads=%zu\n", st.block_reads);
+	printf("block_writes=%zu\n", st.block_writes);
+	printf("fat_hops=%zu\n", st.fat_hops);
+	printf("alloc_searches=%zu\n", st.alloc_searches);
+	printf("alloc_scanned=%zu\n", st.alloc_scanned);
+	printf("rmw_cycles=%zu\n", st.rmw_cycles);
+	printf("read_ops=%zu\n", st.read_ops);
+	printf("read_bytes=%zu\n", st.read_bytes);
+	printf("bytes_per_read=%zu\n",
+	       st.read_ops ? st.read_bytes / st.read_ops : 0);
+	printf("write_ops=%zu\n", st.write_ops);
+	printf("write_bytes=%zu\n", st.write_bytes);
+	printf("bytes_per_write=%zu\n",
+	       st.write_ops ? st.write_bytes / st.write_ops : 0);
+	printf("cow_blocks=%zu\n", st.cow_blocks);
+	printf("dedup_blocks=%zu\n", st.dedup_blocks);
+	printf("unpacked_blocks=%zu\n", st.unpacked_blocks);
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -45,6 +71,7 @@ void thread_fs_script(void *arg)
 	char *command_args[total_command_parts];
 	int offset;
 	char mounted = 0;
+	char zeros_loaded = 0;
 
 	char line_buffer[1024];
 	int command_index = 1;
@@ -87,7 +114,15 @@ void thread_fs_script(void *arg)
 			break;
 
 		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
+			struct fs_options opts = {
+				.cache_blocks = FS_CACHE_DEFAULT_BLOCKS,
+				.backend = FS_BACKEND_FD,
+				.readahead_blocks = FS_READAHEAD_DEFAULT_BLOCKS,
+			};
+
+			if (command_args[1] && strcmp(command_args[1], "DEDUP") == 0)
+				opts.dedup_entries = atoi(command_args[2]);
+			if (fs_mount_opts(diskname, &opts))
 				die("Cannot mount disk");
 			else {
 				printf("MOUNT successful.\n");
@@ -122,6 +157,22 @@ void thread_fs_script(void *arg)
 
 			printf("DELETE successful.\n");
 
+		} else if (strcmp(command, "CLONE") == 0) {
+			if (fs_clone(command_args[1], command_args[2])) {
+				fs_umount();
+				die("Cannot clone file");
+			}
+
+			printf("CLONE successful.\n");
+
+		} else if (strcmp(command, "COMPRESS") == 0) {
+			if (fs_compress(command_args[1])) {
+				fs_umount();
+				die("Cannot compress file");
+			}
+
+			printf("COMPRESS successful.\n");
+
 		} else if (strcmp(command, "OPEN") == 0) {
 			fs_filename = command_args[1];
 
@@ -175,6 +226,10 @@ void thread_fs_script(void *arg)
 				}
 				data_size = st.st_size;
 				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
+			} else if (strcmp(data_source, "ZERO") == 0) {
+				data_size = atoi(data_description);
+				data = calloc(data_size + 1, sizeof(char));
+				zeros_loaded = 1;
 			} else {
 				data = NULL;
 				data_size = 0;
@@ -186,12 +241,44 @@ void thread_fs_script(void *arg)
 			}
 
 			count = fs_write(fs_fd, data, data_size);
+			if (zeros_loaded) {
+				free(data);
+				zeros_loaded = 0;
+			}
 			if (count < 0) {
 				fs_umount();
 				die("write error");
 			}
 			printf("Wrote %d bytes to file.\n", count);
 
+		} else if (strcmp(command, "TRUNCATE") == 0) {
+			if (fs_truncate(fs_fd, atoi(command_args[1]))) {
+				fs_umount();
+				die("Cannot truncate file");
+			}
+
+			printf("TRUNCATE successful.\n");
+
+		} else if (strcmp(command, "FALLOCATE") == 0) {
+			if (fs_fallocate(fs_fd, atoi(command_args[1]))) {
+				fs_umount();
+				die("Cannot allocate file blocks");
+			}
+
+			printf("FALLOCATE successful.\n");
+
+		} else if (strcmp(command, "SIZE") == 0) {
+			int size = atoi(command_args[1]);
+
+			count = fs_stat(fs_fd);
+			if (count == size)
+				printf("SIZE successful.\n");
+			else
+				printf("Stat unexpected size! %d vs given %d\n", count, size);
+
+		} else if (strcmp(command, "STATS") == 0) {
+			print_stats();
+
 		} else if (strcmp(command, "READ") == 0) {
 			int read_req_length = atoi(command_args[1]);
 			data_source = command_args[2];
@@ -224,6 +311,10 @@ void thread_fs_script(void *arg)
 				assert(n == sizeof(char) * data_size);
 				fclose(data_file);
 				file_loaded = 1;
+			} else if (strcmp(data_source, "ZERO") == 0) {
+				data_size = read_req_length;
+				data = calloc(data_size + 1, sizeof(char));
+				file_loaded = 1;
 			} else {
 				fs_umount();
 				die("Invalid data description");
@@ -249,7 +340,8 @@ void thread_fs_script(void *arg)
 
 			// both data and read_buf were allocated with an extra zero byte
 			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
+			// holes read back as zeros, so a short read of zeros must not pass
+			if (count == data_size && memcmp(data, read_buf, data_size+1) == 0)
 				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
 			else
 				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
@@ -398,6 +490,57 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <new filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' as '%s'\n", src, dst);
+}
+
+void thread_fs_compress(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_compress(filename)) {
+		fs_umount();
+		die("Cannot compress file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Compressed file '%s'\n", filename);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -461,6 +604,47 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *buf;
+	int i, fs_fd, stat;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<filename>...]");
+
+	diskname = t_arg->argv[0];
+
+	/* Count everything from mounting to unmounting */
+	fs_stats_reset();
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* Read each given file in full */
+	for (i = 1; i < t_arg->argc; i++) {
+		fs_fd = fs_open(t_arg->argv[i]);
+		if (fs_fd < 0) {
+			fs_umount();
+			die("Cannot open file");
+		}
+		stat = fs_stat(fs_fd);
+		buf = malloc(stat + 1);
+		if (!buf) {
+			fs_umount();
+			die_perror("malloc");
+		}
+		fs_read(fs_fd, buf, stat);
+		free(buf);
+		fs_close(fs_fd);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("FS Stats:\n");
+	print_stats();
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -507,6 +691,45 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_defrag_budget budget = { 0 };
+	struct fs_defrag_report report;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<max_blocks> [<max_ms>]]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		budget.max_blocks = get_argv(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		budget.max_ms = get_argv(t_arg->argv[2]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_defrag(&budget, &report)) {
+		fs_umount();
+		die("Cannot defragment");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("FS Defrag:\n");
+	printf("files_checked=%zu\n", report.files_checked);
+	printf("files_moved=%zu\n", report.files_moved);
+	printf("files_skipped=%zu\n", report.files_skipped);
+	printf("blocks_moved=%zu\n", report.blocks_moved);
+	printf("extents_before=%zu\n", report.extents_before);
+	printf("extents_after=%zu\n", report.extents_after);
+	printf("pass_done=%d\n", report.pass_done);
+}
+
+void thread_fs_trace(void *arg);
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -515,11 +738,47 @@ static struct {
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
+	{ "clone",	thread_fs_clone },
+	{ "compress",	thread_fs_compress },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "stats",	thread_fs_stats },
+	{ "defrag",	thread_fs_defrag },
+	{ "trace",	thread_fs_trace }
 };
 
+/* Write out whatever was recorded, even when the command dies */
+void trace_exit(void)
+{
+	if (fs_trace_stop())
+		test_fs_error("Cannot write the trace");
+}
+
+void thread_fs_trace(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg cmd_arg;
+	size_t i;
+
+	if (t_arg->argc < 2)
+		die("Usage: <tracefile> <command> [<arg>...]");
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		if (!strcmp(t_arg->argv[1], commands[i].name))
+			break;
+	if (i == ARRAY_SIZE(commands) || commands[i].func == thread_fs_trace)
+		die("invalid command '%s'", t_arg->argv[1]);
+
+	if (fs_trace_start(t_arg->argv[0]))
+		die("Cannot record trace '%s'", t_arg->argv[0]);
+	atexit(trace_exit);
+
+	cmd_arg.argc = t_arg->argc - 2;
+	cmd_arg.argv = &t_arg->argv[2];
+	commands[i].func(&cmd_arg);
+}
+
 void usage(char *program)
 {
 	size_t i;
@@ -0,0 +1,410 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* End of a list of entries */
+#define NO_ENTRY -1
+
+/* Cached copy of one disk block */
+struct cache_entry {
+	/* Disk block held by this entry */
+	size_t block;
+	/* Entry holds a block */
+	int valid;
+	/* Entry differs from the disk */
+	int dirty;
+	/* Neighbours in the LRU list (head is most recently used) */
+	int prev, next;
+	/* Next entry in the same hash bucket */
+	int hnext;
+};
+
+struct cache {
+	/* Disk the cached blocks belong to */
+	struct block_dev *dev;
+	/* Protects everything below; never held across a disk read */
+	pthread_mutex_t lock;
+	/* Number of entries */
+	size_t nblocks;
+	/* Entry descriptions and their block data */
+	struct cache_entry *entries;
+	char *data;
+	/* Hash buckets (power of two) mapping blocks to entries */
+	int *buckets;
+	size_t nbuckets;
+	/* LRU list ends */
+	int head, tail;
+	/* Counters */
+	struct cache_stats stats;
+};
+
+static size_t cache_hash(struct cache *c, size_t block)
+{
+	return (block * 2654435761u) & (c->nbuckets - 1);
+}
+
+static void *entry_data(struct cache *c, int e)
+{
+	return c->data + (size_t)e * BLOCK_SIZE;
+}
+
+static void lru_unlink(struct cache *c, int e)
+{
+	struct cache_entry *ent = &c->entries[e];
+
+	if (ent->prev != NO_ENTRY)
+		c->entries[ent->prev].next = ent->next;
+	else
+		c->head = ent->next;
+	if (ent->next != NO_ENTRY)
+		c->entries[ent->next].prev = ent->prev;
+	else
+		c->tail = ent->prev;
+}
+
+static void lru_push_head(struct cache *c, int e)
+{
+	struct cache_entry *ent = &c->entries[e];
+
+	ent->prev = NO_ENTRY;
+	ent->next = c->head;
+	if (c->head != NO_ENTRY)
+		c->entries[c->head].prev = e;
+	c->head = e;
+	if (c->tail == NO_ENTRY)
+		c->tail = e;
+}
+
+static void lru_touch(struct cache *c, int e)
+{
+	if (c->head == e)
+		return;
+	lru_unlink(c, e);
+	lru_push_head(c, e);
+}
+
+static int hash_lookup(struct cache *c, size_t block)
+{
+	int e = c->buckets[cache_hash(c, block)];
+
+	while (e != NO_ENTRY && c->entries[e].block != block)
+		e = c->entries[e].hnext;
+	return e;
+}
+
+static void hash_insert(struct cache *c, int e)
+{
+	size_t h = cache_hash(c, c->entries[e].block);
+
+	c->entries[e].hnext = c->buckets[h];
+	c->buckets[h] = e;
+}
+
+static void hash_remove(struct cache *c, int e)
+{
+	int *link = &c->buckets[cache_hash(c, c->entries[e].block)];
+
+	while (*link != e)
+		link = &c->entries[*link].hnext;
+	*link = c->entries[e].hnext;
+}
+
+static int entry_writeback(struct cache *c, int e)
+{
+	struct cache_entry *ent = &c->entries[e];
+
+	if (!ent->valid || !ent->dirty)
+		return 0;
+	if (block_dev_write(c->dev, ent->block, entry_data(c, e)))
+		return -1;
+	ent->dirty = 0;
+	c->stats.writebacks++;
+	return 0;
+}
+
+/* Take the least recently used entry and rebind it to @block */
+static int entry_claim(struct cache *c, size_t block)
+{
+	int e = c->tail;
+	struct cache_entry *ent = &c->entries[e];
+
+	if (ent->valid) {
+		if (entry_writeback(c, e))
+			return NO_ENTRY;
+		hash_remove(c, e);
+		c->stats.evictions++;
+	}
+	ent->block = block;
+	ent->valid = 1;
+	ent->dirty = 0;
+	hash_insert(c, e);
+	lru_touch(c, e);
+	return e;
+}
+
+struct cache *cache_create(struct block_dev *dev, size_t nblocks)
+{
+	struct cache *c;
+	size_t i;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	pthread_mutex_init(&c->lock, NULL);
+	c->dev = dev;
+	c->nblocks = nblocks;
+	c->head = c->tail = NO_ENTRY;
+	if (!nblocks)
+		return c;
+
+	c->nbuckets = 1;
+	while (c->nbuckets < 2 * nblocks)
+		c->nbuckets <<= 1;
+
+	c->entries = calloc(nblocks, sizeof(*c->entries));
+	c->data = malloc(nblocks * BLOCK_SIZE);
+	c->buckets = malloc(c->nbuckets * sizeof(*c->buckets));
+	if (!c->entries || !c->data || !c->buckets) {
+		cache_error("cannot allocate %zu blocks", nblocks);
+		cache_destroy(c);
+		return NULL;
+	}
+
+	for (i = 0; i < c->nbuckets; i++)
+		c->buckets[i] = NO_ENTRY;
+	for (i = 0; i < nblocks; i++)
+		lru_push_head(c, i);
+
+	return c;
+}
+
+void cache_destroy(struct cache *c)
+{
+	if (!c)
+		return;
+	pthread_mutex_destroy(&c->lock);
+	free(c->entries);
+	free(c->data);
+	free(c->buckets);
+	free(c);
+}
+
+/* Copy @block into @buf if cached. Called with the lock held */
+static int cache_hit(struct cache *c, size_t block, void *buf)
+{
+	int e = c->nblocks ? hash_lookup(c, block) : NO_ENTRY;
+
+	if (e == NO_ENTRY)
+		return 0;
+	c->stats.hits++;
+	lru_touch(c, e);
+	memcpy(buf, entry_data(c, e), BLOCK_SIZE);
+	return 1;
+}
+
+int cache_read(struct cache *c, size_t block, void *buf)
+{
+	int e;
+
+	pthread_mutex_lock(&c->lock);
+	if (cache_hit(c, block, buf)) {
+		pthread_mutex_unlock(&c->lock);
+		return 0;
+	}
+	c->stats.misses++;
+	pthread_mutex_unlock(&c->lock);
+
+	/* Other threads keep using the cache while this block is read */
+	if (block_dev_read(c->dev, block, buf))
+		return -1;
+	if (!c->nblocks)
+		return 0;
+
+	pthread_mutex_lock(&c->lock);
+	if (hash_lookup(c, block) == NO_ENTRY) {
+		e = entry_claim(c, block);
+		if (e != NO_ENTRY)
+			memcpy(entry_data(c, e), buf, BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+int cache_write(struct cache *c, size_t block, const void *buf)
+{
+	int e, ret = 0;
+
+	if (!c->nblocks)
+		return block_dev_write(c->dev, block, buf);
+
+	pthread_mutex_lock(&c->lock);
+	e = hash_lookup(c, block);
+	if (e != NO_ENTRY) {
+		c->stats.hits++;
+		lru_touch(c, e);
+	} else {
+		c->stats.misses++;
+		e = entry_claim(c, block);
+	}
+	if (e != NO_ENTRY) {
+		memcpy(entry_data(c, e), buf, BLOCK_SIZE);
+		c->entries[e].dirty = 1;
+	} else {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return ret;
+}
+
+int cache_read_multi(struct cache *c, size_t block, size_t count,
+		     void *bufs[])
+{
+	size_t i = 0;
+
+	if (count == 1)
+		return cache_read(c, block, bufs[0]);
+
+	while (i < count) {
+		size_t run;
+
+		pthread_mutex_lock(&c->lock);
+		if (cache_hit(c, block + i, bufs[i])) {
+			pthread_mutex_unlock(&c->lock);
+			i++;
+			continue;
+		}
+
+		/* Gather the whole run of blocks missing from the cache */
+		for (run = 1; i + run < count; run++)
+			if (c->nblocks &&
+			    hash_lookup(c, block + i + run) != NO_ENTRY)
+				break;
+		c->stats.misses += run;
+		pthread_mutex_unlock(&c->lock);
+
+		if (block_dev_read_multi(c->dev, block + i, run, &bufs[i]))
+			return -1;
+		i += run;
+	}
+	return 0;
+}
+
+/*
+ * Bring cached copies in line with blocks about to be written straight to the
+ * disk. Doing it first keeps a concurrent eviction from writing an older dirty
+ * copy back over the new data.
+ */
+static void cache_refresh(struct cache *c, size_t block, size_t count,
+			  void *bufs[])
+{
+	size_t i;
+	int e;
+
+	if (!c->nblocks)
+		return;
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < count; i++) {
+		e = hash_lookup(c, block + i);
+		if (e == NO_ENTRY)
+			continue;
+		memcpy(entry_data(c, e), bufs[i], BLOCK_SIZE);
+		c->entries[e].dirty = 0;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Whether any block of the range is held by the cache */
+static int cache_holds_any(struct cache *c, size_t block, size_t count)
+{
+	size_t i;
+	int found = 0;
+
+	if (!c->nblocks)
+		return 0;
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < count && !found; i++)
+		found = hash_lookup(c, block + i) != NO_ENTRY;
+	pthread_mutex_unlock(&c->lock);
+	return found;
+}
+
+int cache_write_multi(struct cache *c, size_t block, size_t count,
+		      void *bufs[])
+{
+	if (count == 1)
+		return cache_write(c, block, bufs[0]);
+
+	cache_refresh(c, block, count, bufs);
+	return block_dev_write_multi(c->dev, block, count, bufs);
+}
+
+int cache_submit(struct cache *c, struct block_req *reqs, size_t nreqs)
+{
+	size_t i, n = 0, missed = 0;
+
+	for (i = 0; i < nreqs; i++) {
+		struct block_req *r = &reqs[i];
+
+		if (r->count == 1 ||
+		    (!r->write && cache_holds_any(c, r->block, r->count))) {
+			if (r->write ?
+			    cache_write_multi(c, r->block, r->count, r->bufs) :
+			    cache_read_multi(c, r->block, r->count, r->bufs))
+				return -1;
+			continue;
+		}
+		if (!r->write)
+			missed += r->count;
+		reqs[n++] = *r;
+	}
+
+	if (missed) {
+		pthread_mutex_lock(&c->lock);
+		c->stats.misses += missed;
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	for (i = 0; i < n; i++)
+		if (reqs[i].write)
+			cache_refresh(c, reqs[i].block, reqs[i].count,
+				      reqs[i].bufs);
+
+	return n ? block_dev_submit(c->dev, reqs, n) : 0;
+}
+
+const void *cache_direct(struct cache *c, size_t block, size_t count)
+{
+	const void *p = block_dev_ptr(c->dev, block);
+
+	if (!p || cache_holds_any(c, block, count))
+		return NULL;
+	return p;
+}
+
+int cache_flush(struct cache *c)
+{
+	size_t i;
+	int ret = 0;
+
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < c->nblocks; i++)
+		if (entry_writeback(c, i))
+			ret = -1;
+	pthread_mutex_unlock(&c->lock);
+	return ret;
+}
+
+void cache_get_stats(struct cache *c, struct cache_stats *stats)
+{
+	pthread_mutex_lock(&c->lock);
+	*stats = c->stats;
+	pthread_mutex_unlock(&c->lock);
+}
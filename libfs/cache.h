@@ -0,0 +1,147 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+#include "disk.h"
+
+/** Opaque block cache instance */
+struct cache;
+
+/** Block cache counters */
+struct cache_stats {
+	/* Lookups satisfied from the cache */
+	size_t hits;
+	/* Lookups that had to go to the disk */
+	size_t misses;
+	/* Blocks pushed out to make room for another one */
+	size_t evictions;
+	/* Dirty blocks written back to the disk */
+	size_t writebacks;
+};
+
+/**
+ * cache_create - Create a block cache
+ * @dev: Disk to cache
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Create a write-back cache of @nblocks blocks sitting in front of virtual
+ * disk @dev. Least recently used blocks are evicted first,
+ * and dirty blocks are written back when evicted or when the cache is
+ * flushed. A cache of 0 blocks passes every request straight to the disk.
+ *
+ * Return: NULL if memory cannot be allocated. The new cache otherwise.
+ */
+struct cache *cache_create(struct block_dev *dev, size_t nblocks);
+
+/**
+ * cache_destroy - Release a block cache
+ * @c: Cache to release
+ *
+ * Free @c without writing anything back: call cache_flush() first if dirty
+ * blocks must reach the disk.
+ */
+void cache_destroy(struct cache *c);
+
+/**
+ * cache_read - Read a block through the cache
+ * @c: Cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if the block cannot be read from the disk. 0 otherwise.
+ */
+int cache_read(struct cache *c, size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @c: Cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * The block is only marked dirty: it reaches the disk when it is evicted or
+ * when cache_flush() is called.
+ *
+ * Return: -1 if a dirty block could not be written back to make room. 0
+ * otherwise.
+ */
+int cache_write(struct cache *c, size_t block, const void *buf);
+
+/**
+ * cache_read_multi - Read consecutive blocks through the cache
+ * @c: Cache
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @bufs: Array of @count data buffers, one per block
+ *
+ * Blocks found in the cache are copied from it, and every run of missing
+ * blocks is fetched with a single block_dev_read_multi() call. Runs longer
+ * than one block are streamed past the cache instead of evicting its content.
+ *
+ * Return: -1 if the blocks cannot be read from the disk. 0 otherwise.
+ */
+int cache_read_multi(struct cache *c, size_t block, size_t count,
+		     void *bufs[]);
+
+/**
+ * cache_write_multi - Write consecutive blocks through the cache
+ * @c: Cache
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @bufs: Array of @count data buffers, one per block
+ *
+ * A single block is handled like cache_write(). Longer runs are written
+ * through to the disk with one block_dev_write_multi() call, and the cached
+ * copies of those blocks, if any, are refreshed.
+ *
+ * Return: -1 if the blocks cannot be written. 0 otherwise.
+ */
+int cache_write_multi(struct cache *c, size_t block, size_t count,
+		      void *bufs[]);
+
+/**
+ * cache_submit - Perform a batch of multi-block requests through the cache
+ * @c: Cache
+ * @reqs: Array of requests, reordered by the call
+ * @nreqs: Number of requests
+ *
+ * Single-block requests and reads of partly cached ranges are served like
+ * cache_read_multi() and cache_write_multi(). Every other request is handed
+ * to block_dev_submit() in a single batch, and the cached copies of written
+ * blocks, if any, are refreshed.
+ *
+ * Return: -1 if any of the requests fails. 0 otherwise.
+ */
+int cache_submit(struct cache *c, struct block_req *reqs, size_t nreqs);
+
+/**
+ * cache_direct - Get direct access to consecutive blocks
+ * @c: Cache
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * When the disk is memory-mapped (see block_dev_ptr()) and none of the blocks
+ * is held by the cache, the mapping is the up-to-date copy of the blocks and
+ * can be read from directly.
+ *
+ * Return: NULL if the blocks must be read with cache_read_multi(). A pointer
+ * to the @count contiguous blocks otherwise.
+ */
+const void *cache_direct(struct cache *c, size_t block, size_t count);
+
+/**
+ * cache_flush - Write back every dirty block
+ * @c: Cache
+ *
+ * Return: -1 if any block could not be written back. 0 otherwise.
+ */
+int cache_flush(struct cache *c);
+
+/**
+ * cache_get_stats - Get cache counters
+ * @c: Cache
+ * @stats: Filled with the counters of @c
+ */
+void cache_get_stats(struct cache *c, struct cache_stats *stats);
+
+#endif /* _CACHE_H */
@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "dedup.h"
+#include "disk.h"
+
+/* Multipliers of the fingerprint lanes, odd 64-bit constants */
+#define HASH_MUL1 0x9e3779b97f4a7c15ULL
+#define HASH_MUL2 0xc2b2ae3d27d4eb4fULL
+
+/* Independent lanes, so that the multiplications overlap */
+#define HASH_LANES 4
+
+struct dedup_entry {
+	uint64_t hash;
+	/* Block plus one, 0 for an empty entry */
+	uint32_t block;
+};
+
+struct dedup {
+	size_t mask;
+	struct dedup_entry *entries;
+	size_t nblocks;
+	/* Entry plus one of each block, 0 if the block is not indexed */
+	uint32_t *slots;
+};
+
+struct dedup *dedup_create(size_t nentries, size_t nblocks)
+{
+	struct dedup *dd;
+	size_t size = 1;
+
+	if (!nentries)
+		return NULL;
+	while (size * 2 <= nentries && size * 2 <= UINT32_MAX)
+		size *= 2;
+
+	dd = calloc(1, sizeof(*dd));
+	if (!dd)
+		return NULL;
+	dd->mask = size - 1;
+	dd->nblocks = nblocks;
+	dd->entries = calloc(size, sizeof(*dd->entries));
+	dd->slots = calloc(nblocks, sizeof(*dd->slots));
+	if (!dd->entries || !dd->slots) {
+		dedup_destroy(dd);
+		return NULL;
+	}
+	return dd;
+}
+
+void dedup_destroy(struct dedup *dd)
+{
+	if (!dd)
+		return;
+	free(dd->entries);
+	free(dd->slots);
+	free(dd);
+}
+
+static uint64_t mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= HASH_MUL2;
+	h ^= h >> 29;
+	return h;
+}
+
+uint64_t dedup_hash(const void *buf)
+{
+	const uint64_t *words = buf;
+	uint64_t lanes[HASH_LANES] = { 1, 2, 3, 4 };
+	uint64_t h = 0;
+	size_t i, j;
+
+	for (i = 0; i < BLOCK_SIZE / sizeof(*words); i += HASH_LANES) {
+		for (j = 0; j < HASH_LANES; j++) {
+			lanes[j] = (lanes[j] ^ words[i + j]) * HASH_MUL1;
+			lanes[j] ^= lanes[j] >> 31;
+		}
+	}
+	for (j = 0; j < HASH_LANES; j++)
+		h = mix(h ^ lanes[j]);
+	return h ? h : 1;
+}
+
+long dedup_lookup(struct dedup *dd, uint64_t hash)
+{
+	struct dedup_entry *e = &dd->entries[hash & dd->mask];
+
+	if (!e->block || e->hash != hash)
+		return -1;
+	return e->block - 1;
+}
+
+void dedup_insert(struct dedup *dd, uint64_t hash, size_t block)
+{
+	size_t slot = hash & dd->mask;
+	struct dedup_entry *e = &dd->entries[slot];
+
+	if (block >= dd->nblocks)
+		return;
+	dedup_forget(dd, block);
+	if (e->block)
+		dd->slots[e->block - 1] = 0;
+	e->hash = hash;
+	e->block = block + 1;
+	dd->slots[block] = slot + 1;
+}
+
+void dedup_forget(struct dedup *dd, size_t block)
+{
+	if (block >= dd->nblocks || !dd->slots[block])
+		return;
+	dd->entries[dd->slots[block] - 1].block = 0;
+	dd->slots[block] = 0;
+}
@@ -0,0 +1,72 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/** Opaque fingerprint index instance */
+struct dedup;
+
+/**
+ * dedup_create - Create a fingerprint index
+ * @nentries: Number of fingerprints the index can hold
+ * @nblocks: Number of blocks fingerprints can point at
+ *
+ * The index takes 16 bytes per entry, with @nentries rounded down to a power
+ * of two, plus 4 bytes per block to find the entry of a block again.
+ *
+ * Return: NULL if @nentries is 0 or memory cannot be allocated. The new index
+ * otherwise.
+ */
+struct dedup *dedup_create(size_t nentries, size_t nblocks);
+
+/**
+ * dedup_destroy - Release a fingerprint index
+ * @dd: Index to release
+ */
+void dedup_destroy(struct dedup *dd);
+
+/**
+ * dedup_hash - Fingerprint the content of a block
+ * @buf: Data buffer of %BLOCK_SIZE bytes
+ *
+ * The fingerprint is fast to compute but not collision resistant: blocks
+ * with the same fingerprint must still be compared.
+ *
+ * Return: The fingerprint of @buf, never 0 so that callers can use 0 for no
+ * fingerprint.
+ */
+uint64_t dedup_hash(const void *buf);
+
+/**
+ * dedup_lookup - Find a block by fingerprint
+ * @dd: Index
+ * @hash: Fingerprint, from dedup_hash()
+ *
+ * Return: -1 if no block with fingerprint @hash is indexed. The index of the
+ * block otherwise.
+ */
+long dedup_lookup(struct dedup *dd, uint64_t hash);
+
+/**
+ * dedup_insert - Index a block by fingerprint
+ * @dd: Index
+ * @hash: Fingerprint of the content of the block
+ * @block: Index of the block
+ *
+ * The index is direct-mapped: the block that held the entry of @hash before
+ * is forgotten, as is the previous fingerprint of @block.
+ */
+void dedup_insert(struct dedup *dd, uint64_t hash, size_t block);
+
+/**
+ * dedup_forget - Drop a block from the index
+ * @dd: Index
+ * @block: Index of the block
+ *
+ * To be called before the content of @block changes or @block is freed.
+ * Nothing happens if @block is not indexed.
+ */
+void dedup_forget(struct dedup *dd, size_t block);
+
+#endif /* _DEDUP_H */
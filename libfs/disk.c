@@ -1,144 +1,535 @@
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "stats.h"
+#include "uring.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Number of blocks handed to a single preadv()/pwritev() */
+#define MULTI_IOV_MAX 256
+
+/* Request of a batch currently in flight in the io_uring queue */
+struct ring_slot {
+	size_t block;
+	size_t count;
+	void **bufs;
+	int write;
+	int busy;
+	/* I/O vectors handed to the kernel, MULTI_IOV_MAX of them */
+	struct iovec *iov;
+};
 
 /* Disk instance description */
-struct disk {
+struct block_dev {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Whole image mapped in memory (BLOCK_DISK_MMAP mode only) */
+	char *map;
+	/* Submission queue and its slots (BLOCK_DISK_URING mode only) */
+	struct uring *ring;
+	struct ring_slot *slots;
+	unsigned depth;
+	/* Serializes the users of the ring */
+	pthread_mutex_t lock;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Disk behind the block_disk_*() and block_*() calls (none by default) */
+static struct block_dev *disk;
 
-int block_disk_open(const char *diskname)
+static void ring_release(struct block_dev *dev)
 {
-	int fd;
-	struct stat st;
+	unsigned i;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
+	for (i = 0; dev->slots && i < dev->depth; i++)
+		free(dev->slots[i].iov);
+	free(dev->slots);
+	uring_destroy(dev->ring);
+	dev->slots = NULL;
+	dev->ring = NULL;
+	dev->depth = 0;
+}
+
+static int ring_setup(struct block_dev *dev, unsigned queue_depth)
+{
+	unsigned i;
+
+	dev->ring = uring_create(queue_depth);
+	if (!dev->ring) {
+		perror("io_uring_setup");
 		return -1;
 	}
-
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
+	dev->depth = queue_depth;
+	dev->slots = calloc(queue_depth, sizeof(*dev->slots));
+	if (!dev->slots)
 		return -1;
+	for (i = 0; i < queue_depth; i++) {
+		dev->slots[i].iov = malloc(MULTI_IOV_MAX *
+					   sizeof(struct iovec));
+		if (!dev->slots[i].iov)
+			return -1;
+	}
+
+	return 0;
+}
+
+struct block_dev *block_dev_open(const char *diskname,
+				 enum block_disk_mode mode,
+				 unsigned queue_depth)
+{
+	struct block_dev *dev;
+	struct stat st;
+	int fd;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return NULL;
 	}
 
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
-		return -1;
+		close(fd);
+		return NULL;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		close(fd);
+		return NULL;
 	}
+	dev->fd = fd;
+	dev->bcount = st.st_size / BLOCK_SIZE;
+	pthread_mutex_init(&dev->lock, NULL);
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	if (mode == BLOCK_DISK_MMAP && st.st_size) {
+		dev->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+		if (dev->map == MAP_FAILED) {
+			perror("mmap");
+			dev->map = NULL;
+			block_dev_close(dev);
+			return NULL;
+		}
+	}
 
-	return 0;
+	if (mode == BLOCK_DISK_URING &&
+	    ring_setup(dev, queue_depth ? queue_depth :
+		       BLOCK_QUEUE_DEPTH_DEFAULT)) {
+		block_dev_close(dev);
+		return NULL;
+	}
+
+	return dev;
 }
 
-int block_disk_close(void)
+int block_dev_close(struct block_dev *dev)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!dev) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	if (dev->map)
+		munmap(dev->map, dev->bcount * BLOCK_SIZE);
 
-	disk.fd = INVALID_FD;
+	ring_release(dev);
+	close(dev->fd);
+	pthread_mutex_destroy(&dev->lock);
+	free(dev);
 
 	return 0;
 }
 
-int block_disk_count(void)
+int block_dev_count(struct block_dev *dev)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!dev) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	return dev->bcount;
 }
 
-int block_write(size_t block, const void *buf)
+/*
+ * Transfer the single block @block at its position, leaving the file offset
+ * alone, and resuming short transfers like block_rw_multi() does.
+ */
+static int block_rw_one(struct block_dev *dev, size_t block, void *buf,
+			int write)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < BLOCK_SIZE) {
+		off_t off = block * BLOCK_SIZE + done;
+
+		if (write)
+			ret = pwrite(dev->fd, (char *)buf + done,
+				     BLOCK_SIZE - done, off);
+		else
+			ret = pread(dev->fd, (char *)buf + done,
+				    BLOCK_SIZE - done, off);
+		if (ret < 0) {
+			perror(write ? "pwrite" : "pread");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk at block %zu",
+				    block);
+			return -1;
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+int block_dev_write(struct block_dev *dev, size_t block, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!dev) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (block >= dev->bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block, dev->bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	stats_add(STATS_BLOCK_WRITES, 1);
+	if (dev->map) {
+		memcpy(dev->map + block * BLOCK_SIZE, buf, BLOCK_SIZE);
+		return 0;
+	}
+
+	return block_rw_one(dev, block, (void *)buf, 1);
+}
+
+int block_dev_read(struct block_dev *dev, size_t block, void *buf)
+{
+	if (!dev) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (block >= dev->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, dev->bcount);
 		return -1;
 	}
 
-	return 0;
+	stats_add(STATS_BLOCK_READS, 1);
+	if (dev->map) {
+		memcpy(buf, dev->map + block * BLOCK_SIZE, BLOCK_SIZE);
+		return 0;
+	}
+
+	return block_rw_one(dev, block, buf, 0);
 }
 
-int block_read(size_t block, void *buf)
+/*
+ * Perform a vectored transfer of @count consecutive blocks starting at @block,
+ * splitting it into chunks of at most MULTI_IOV_MAX blocks and resuming short
+ * transfers.
+ */
+static int block_rw_multi(struct block_dev *dev, size_t block, size_t count,
+			  void *bufs[], int write)
 {
-	if (disk.fd == INVALID_FD) {
+	struct iovec iov[MULTI_IOV_MAX];
+
+	if (!dev) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (block >= dev->bcount || count > dev->bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, dev->bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (dev->map) {
+		char *p = dev->map + block * BLOCK_SIZE;
+		size_t i;
+
+		for (i = 0; i < count; i++, p += BLOCK_SIZE) {
+			if (write)
+				memcpy(p, bufs[i], BLOCK_SIZE);
+			else
+				memcpy(bufs[i], p, BLOCK_SIZE);
+		}
+		return 0;
+	}
+
+	while (count) {
+		size_t n = count < MULTI_IOV_MAX ? count : MULTI_IOV_MAX;
+		size_t i, done = 0, total = n * BLOCK_SIZE;
+		ssize_t ret;
+
+		for (i = 0; i < n; i++) {
+			iov[i].iov_base = bufs[i];
+			iov[i].iov_len = BLOCK_SIZE;
+		}
+
+		while (done < total) {
+			/* Skip the iovecs that were already fully transferred */
+			struct iovec *cur = &iov[done / BLOCK_SIZE];
+			size_t partial = done % BLOCK_SIZE;
+			int iovcnt = n - done / BLOCK_SIZE;
+			off_t off = block * BLOCK_SIZE + done;
+
+			cur->iov_base = (char *)bufs[done / BLOCK_SIZE] + partial;
+			cur->iov_len = BLOCK_SIZE - partial;
+
+			if (write)
+				ret = pwritev(dev->fd, cur, iovcnt, off);
+			else
+				ret = preadv(dev->fd, cur, iovcnt, off);
+			if (ret < 0) {
+				perror(write ? "pwritev" : "preadv");
+				return -1;
+			}
+			if (ret == 0) {
+				block_error("unexpected end of disk at block %zu",
+					    block + done / BLOCK_SIZE);
+				return -1;
+			}
+			done += ret;
+		}
+
+		block += n;
+		bufs += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+int block_dev_write_multi(struct block_dev *dev, size_t block, size_t count,
+			  void *bufs[])
+{
+	stats_add(STATS_BLOCK_WRITES, count);
+	return block_rw_multi(dev, block, count, bufs, 1);
+}
+
+int block_dev_read_multi(struct block_dev *dev, size_t block, size_t count,
+			 void *bufs[])
+{
+	stats_add(STATS_BLOCK_READS, count);
+	return block_rw_multi(dev, block, count, bufs, 0);
+}
+
+/* Hand a chunk of at most MULTI_IOV_MAX blocks to the ring through @slot */
+static int ring_queue(struct block_dev *dev, unsigned s, size_t block,
+		      size_t count, void **bufs, int write)
+{
+	struct ring_slot *slot = &dev->slots[s];
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		slot->iov[i].iov_base = bufs[i];
+		slot->iov[i].iov_len = BLOCK_SIZE;
+	}
+	if (uring_prep_rw(dev->ring, write, dev->fd, slot->iov, count,
+			  block * BLOCK_SIZE, s))
 		return -1;
+	slot->block = block;
+	slot->count = count;
+	slot->bufs = bufs;
+	slot->write = write;
+	slot->busy = 1;
+	return 0;
+}
+
+static int block_submit_ring(struct block_dev *dev, struct block_req *reqs,
+			     size_t nreqs)
+{
+	size_t i = 0, done = 0;
+	unsigned s, inflight = 0;
+	uint64_t user_data;
+	int res, ret = 0;
+
+	while (i < nreqs || inflight) {
+		/* Keep every free slot busy with the next chunk */
+		for (s = 0; s < dev->depth && i < nreqs; s++) {
+			size_t n = reqs[i].count - done;
+
+			if (dev->slots[s].busy)
+				continue;
+			if (n > MULTI_IOV_MAX)
+				n = MULTI_IOV_MAX;
+			if (ring_queue(dev, s, reqs[i].block + done, n,
+				       reqs[i].bufs + done, reqs[i].write))
+				break;
+			inflight++;
+			done += n;
+			if (done == reqs[i].count) {
+				i++;
+				done = 0;
+			}
+		}
+
+		if (uring_submit(dev->ring, 1)) {
+			perror("io_uring_enter");
+			return -1;
+		}
+
+		while (uring_reap(dev->ring, &user_data, &res)) {
+			struct ring_slot *slot = &dev->slots[user_data];
+
+			/* Redo failed or short transfers synchronously */
+			if (res != (int)(slot->count * BLOCK_SIZE) &&
+			    block_rw_multi(dev, slot->block, slot->count,
+					   slot->bufs, slot->write))
+				ret = -1;
+			slot->busy = 0;
+			inflight--;
+		}
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	return ret;
+}
+
+int block_dev_submit(struct block_dev *dev, struct block_req *reqs,
+		     size_t nreqs)
+{
+	size_t i;
+
+	if (!dev) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
+	for (i = 0; i < nreqs; i++) {
+		if (reqs[i].block >= dev->bcount ||
+		    reqs[i].count > dev->bcount - reqs[i].block) {
+			block_error("block range out of bounds (%zu+%zu/%zu)",
+				    reqs[i].block, reqs[i].count, dev->bcount);
+			return -1;
+		}
+	}
+	for (i = 0; i < nreqs; i++)
+		stats_add(reqs[i].write ? STATS_BLOCK_WRITES : STATS_BLOCK_READS,
+			  reqs[i].count);
+
+	if (dev->ring) {
+		int ret;
+
+		/* The ring and its slots are shared by every caller */
+		pthread_mutex_lock(&dev->lock);
+		ret = block_submit_ring(dev, reqs, nreqs);
+		pthread_mutex_unlock(&dev->lock);
+		return ret;
+	}
+
+	for (i = 0; i < nreqs; i++)
+		if (block_rw_multi(dev, reqs[i].block, reqs[i].count,
+				   reqs[i].bufs, reqs[i].write))
+			return -1;
 	return 0;
 }
 
+void *block_dev_ptr(struct block_dev *dev, size_t block)
+{
+	if (!dev || !dev->map || block >= dev->bcount)
+		return NULL;
+
+	return dev->map + block * BLOCK_SIZE;
+}
+
+/* Open the disk behind the single-disk calls */
+static int block_disk_attach(const char *diskname, enum block_disk_mode mode,
+			     unsigned queue_depth)
+{
+	if (disk) {
+		block_error("disk already open");
+		return -1;
+	}
+
+	disk = block_dev_open(diskname, mode, queue_depth);
+	return disk ? 0 : -1;
+}
+
+int block_disk_open(const char *diskname)
+{
+	return block_disk_attach(diskname, BLOCK_DISK_FD, 0);
+}
+
+int block_disk_open_mode(const char *diskname, enum block_disk_mode mode)
+{
+	return block_disk_attach(diskname, mode, 0);
+}
+
+int block_disk_open_uring(const char *diskname, unsigned queue_depth)
+{
+	return block_disk_attach(diskname, BLOCK_DISK_URING, queue_depth);
+}
+
+int block_disk_close(void)
+{
+	int ret = block_dev_close(disk);
+
+	disk = NULL;
+	return ret;
+}
+
+int block_disk_count(void)
+{
+	return block_dev_count(disk);
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return block_dev_write(disk, block, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return block_dev_read(disk, block, buf);
+}
+
+int block_write_multi(size_t block, size_t count, void *bufs[])
+{
+	return block_dev_write_multi(disk, block, count, bufs);
+}
+
+int block_read_multi(size_t block, size_t count, void *bufs[])
+{
+	return block_dev_read_multi(disk, block, count, bufs);
+}
+
+int block_submit(struct block_req *reqs, size_t nreqs)
+{
+	return block_dev_submit(disk, reqs, nreqs);
+}
+
+void *block_ptr(size_t block)
+{
+	return block_dev_ptr(disk, block);
+}
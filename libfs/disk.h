@@ -6,6 +6,31 @@
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** How the virtual disk file is accessed */
+enum block_disk_mode {
+	/* System calls on a file descriptor */
+	BLOCK_DISK_FD,
+	/* Memory copies from a shared mapping of the whole file */
+	BLOCK_DISK_MMAP,
+	/* Batches of requests kept in flight through io_uring */
+	BLOCK_DISK_URING,
+};
+
+/** Queue depth used by %BLOCK_DISK_URING when none is given */
+#define BLOCK_QUEUE_DEPTH_DEFAULT 32
+
+/** One request of a batch, see block_submit() */
+struct block_req {
+	/* Index of the first block */
+	size_t block;
+	/* Number of consecutive blocks */
+	size_t count;
+	/* Array of @count data buffers, one per block */
+	void **bufs;
+	/* Non-zero to write the blocks, zero to read them */
+	int write;
+};
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -19,6 +44,33 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_mode - Open virtual disk file with a given access mode
+ * @diskname: Name of the virtual disk file
+ * @mode: How blocks are accessed
+ *
+ * Same as block_disk_open(), which uses %BLOCK_DISK_FD. With %BLOCK_DISK_MMAP,
+ * the whole file is mapped in memory, block_read() and block_write() become
+ * memory copies, and block_ptr() gives direct access to the blocks.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, or is already open. 0 otherwise.
+ */
+int block_disk_open_mode(const char *diskname, enum block_disk_mode mode);
+
+/**
+ * block_disk_open_uring - Open virtual disk file with an io_uring queue
+ * @diskname: Name of the virtual disk file
+ * @queue_depth: Number of requests kept in flight, 0 for the default
+ *
+ * Same as block_disk_open_mode() with %BLOCK_DISK_URING, which uses
+ * %BLOCK_QUEUE_DEPTH_DEFAULT, but with @queue_depth requests in flight at most.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or is already open, or if the kernel does not support io_uring. 0 otherwise.
+ */
+int block_disk_open_uring(const char *diskname, unsigned queue_depth);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -60,5 +112,195 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_multi - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @bufs: Array of @count data buffers, one per block
+ *
+ * Write the content of buffers @bufs[0] to @bufs[@count - 1] (%BLOCK_SIZE
+ * bytes each) in the virtual disk's blocks @block to @block + @count - 1, using
+ * as few system calls as possible.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_multi(size_t block, size_t count, void *bufs[]);
+
+/**
+ * block_read_multi - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @bufs: Array of @count data buffers, one per block
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (%BLOCK_SIZE bytes each) into buffers @bufs[0] to @bufs[@count - 1], using as
+ * few system calls as possible.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_multi(size_t block, size_t count, void *bufs[]);
+
+/**
+ * block_submit - Perform a batch of multi-block requests
+ * @reqs: Array of requests
+ * @nreqs: Number of requests
+ *
+ * Perform every request of @reqs, in no particular order: requests of a batch
+ * must not overlap. With %BLOCK_DISK_URING, up to the queue depth requests are
+ * handed to the kernel at once and their completions reaped together.
+ * Otherwise the requests are performed one after the other like
+ * block_read_multi() and block_write_multi().
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if any
+ * of the requests fails. 0 otherwise.
+ */
+int block_submit(struct block_req *reqs, size_t nreqs);
+
+/**
+ * block_ptr - Get direct access to a block
+ * @block: Index of the block
+ *
+ * Only available when the disk was opened with %BLOCK_DISK_MMAP. Consecutive
+ * blocks are contiguous in memory, and the pointer stays valid until the disk
+ * is closed. Data written through it reaches the virtual disk file like data
+ * written with block_write().
+ *
+ * Return: NULL if no disk is open, if the disk is not memory-mapped, or if
+ * @block is out of bounds. A pointer to the %BLOCK_SIZE bytes of @block
+ * otherwise.
+ */
+void *block_ptr(size_t block);
+
+/** Opaque handle on an open virtual disk file */
+struct block_dev;
+
+/*
+ * The block_disk_*() and block_*() functions above work on a single virtual
+ * disk file. The block_dev_*() functions below do the same on any number of
+ * disks at once, each designated by the handle returned by block_dev_open().
+ * Blocks are transferred with positional system calls, so a handle can be
+ * used by several threads concurrently.
+ */
+
+/**
+ * block_dev_open - Open a virtual disk file and get a handle on it
+ * @diskname: Name of the virtual disk file
+ * @mode: How blocks are accessed
+ * @queue_depth: Number of requests kept in flight with %BLOCK_DISK_URING, 0
+ * for the default
+ *
+ * Same as block_disk_open_mode() and block_disk_open_uring(), except that the
+ * disk is not the one used by the single-disk functions, and that a disk file
+ * can be opened several times.
+ *
+ * Return: NULL if @diskname is invalid, if the virtual disk file cannot be
+ * opened or mapped, or if the kernel does not support io_uring. The handle on
+ * the disk otherwise.
+ */
+struct block_dev *block_dev_open(const char *diskname,
+				 enum block_disk_mode mode,
+				 unsigned queue_depth);
+
+/**
+ * block_dev_close - Close a virtual disk file
+ * @dev: Disk handle, released by the call
+ *
+ * Return: -1 if @dev is NULL. 0 otherwise.
+ */
+int block_dev_close(struct block_dev *dev);
+
+/**
+ * block_dev_count - Get a disk's block count
+ * @dev: Disk handle
+ *
+ * Return: -1 if @dev is NULL, otherwise the number of blocks that @dev
+ * contains.
+ */
+int block_dev_count(struct block_dev *dev);
+
+/**
+ * block_dev_write - Write a block to a disk
+ * @dev: Disk handle
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Same as block_write() on @dev.
+ *
+ * Return: -1 if @dev is NULL, if @block is out of bounds or inaccessible or if
+ * the writing operation fails. 0 otherwise.
+ */
+int block_dev_write(struct block_dev *dev, size_t block, const void *buf);
+
+/**
+ * block_dev_read - Read a block from a disk
+ * @dev: Disk handle
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Same as block_read() on @dev.
+ *
+ * Return: -1 if @dev is NULL, if @block is out of bounds or inaccessible, or if
+ * the reading operation fails. 0 otherwise.
+ */
+int block_dev_read(struct block_dev *dev, size_t block, void *buf);
+
+/**
+ * block_dev_write_multi - Write consecutive blocks to a disk
+ * @dev: Disk handle
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @bufs: Array of @count data buffers, one per block
+ *
+ * Same as block_write_multi() on @dev.
+ *
+ * Return: -1 if @dev is NULL, if any of the blocks is out of bounds or
+ * inaccessible, or if the writing operation fails. 0 otherwise.
+ */
+int block_dev_write_multi(struct block_dev *dev, size_t block, size_t count,
+			  void *bufs[]);
+
+/**
+ * block_dev_read_multi - Read consecutive blocks from a disk
+ * @dev: Disk handle
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @bufs: Array of @count data buffers, one per block
+ *
+ * Same as block_read_multi() on @dev.
+ *
+ * Return: -1 if @dev is NULL, if any of the blocks is out of bounds or
+ * inaccessible, or if the reading operation fails. 0 otherwise.
+ */
+int block_dev_read_multi(struct block_dev *dev, size_t block, size_t count,
+			 void *bufs[]);
+
+/**
+ * block_dev_submit - Perform a batch of multi-block requests on a disk
+ * @dev: Disk handle
+ * @reqs: Array of requests
+ * @nreqs: Number of requests
+ *
+ * Same as block_submit() on @dev.
+ *
+ * Return: -1 if @dev is NULL, if any of the blocks is out of bounds or
+ * inaccessible, or if any of the requests fails. 0 otherwise.
+ */
+int block_dev_submit(struct block_dev *dev, struct block_req *reqs,
+		     size_t nreqs);
+
+/**
+ * block_dev_ptr - Get direct access to a block of a disk
+ * @dev: Disk handle
+ * @block: Index of the block
+ *
+ * Same as block_ptr() on @dev.
+ *
+ * Return: NULL if @dev is NULL or not memory-mapped, or if @block is out of
+ * bounds. A pointer to the %BLOCK_SIZE bytes of @block otherwise.
+ */
+void *block_dev_ptr(struct block_dev *dev, size_t block);
+
 #endif /* _DISK_H */
 
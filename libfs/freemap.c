@@ -0,0 +1,199 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "freemap.h"
+
+/* Bits per map word */
+#define WORD_BITS 64
+
+/* Free runs examined by freemap_find_run() before settling for less */
+#define RUN_SEARCH_MAX 64
+
+/*
+ * Two-level bitmap: bit i of words[] is set when block i is free, and bit w
+ * of summary[] is set when words[w] has at least one free block.
+ */
+struct freemap {
+	size_t nbits;
+	size_t nwords;
+	size_t nsummary;
+	uint64_t *words;
+	uint64_t *summary;
+	size_t free_count;
+	/* Map words examined by searches */
+	size_t scanned;
+};
+
+struct freemap *freemap_create(size_t nbits)
+{
+	struct freemap *fm;
+
+	fm = calloc(1, sizeof(*fm));
+	if (!fm)
+		return NULL;
+	fm->nbits = nbits;
+	fm->nwords = (nbits + WORD_BITS - 1) / WORD_BITS;
+	fm->nsummary = (fm->nwords + WORD_BITS - 1) / WORD_BITS;
+	fm->words = calloc(fm->nwords + 1, sizeof(*fm->words));
+	fm->summary = calloc(fm->nsummary + 1, sizeof(*fm->summary));
+	if (!fm->words || !fm->summary) {
+		freemap_destroy(fm);
+		return NULL;
+	}
+	return fm;
+}
+
+void freemap_destroy(struct freemap *fm)
+{
+	if (!fm)
+		return;
+	free(fm->words);
+	free(fm->summary);
+	free(fm);
+}
+
+void freemap_set_free(struct freemap *fm, size_t bit)
+{
+	size_t w = bit / WORD_BITS;
+	uint64_t mask = (uint64_t)1 << (bit % WORD_BITS);
+
+	if (bit >= fm->nbits || (fm->words[w] & mask))
+		return;
+	fm->words[w] |= mask;
+	fm->summary[w / WORD_BITS] |= (uint64_t)1 << (w % WORD_BITS);
+	fm->free_count++;
+}
+
+void freemap_set_used(struct freemap *fm, size_t bit)
+{
+	size_t w = bit / WORD_BITS;
+	uint64_t mask = (uint64_t)1 << (bit % WORD_BITS);
+
+	if (bit >= fm->nbits || !(fm->words[w] & mask))
+		return;
+	fm->words[w] &= ~mask;
+	if (!fm->words[w])
+		fm->summary[w / WORD_BITS] &= ~((uint64_t)1 << (w % WORD_BITS));
+	fm->free_count--;
+}
+
+/* First free block at or after @from, or -1 */
+static long freemap_next(struct freemap *fm, size_t from)
+{
+	size_t w = from / WORD_BITS;
+	size_t s;
+	uint64_t bits;
+
+	if (from >= fm->nbits)
+		return -1;
+
+	/* Rest of the word holding @from */
+	fm->scanned++;
+	bits = fm->words[w] & (~(uint64_t)0 << (from % WORD_BITS));
+	if (bits)
+		return w * WORD_BITS + __builtin_ctzll(bits);
+
+	/* Then use the summary to jump to the next word with a free block */
+	w++;
+	s = w / WORD_BITS;
+	if (s >= fm->nsummary)
+		return -1;
+	bits = fm->summary[s] & (~(uint64_t)0 << (w % WORD_BITS));
+	fm->scanned++;
+	while (!bits) {
+		if (++s >= fm->nsummary)
+			return -1;
+		bits = fm->summary[s];
+		fm->scanned++;
+	}
+	w = s * WORD_BITS + __builtin_ctzll(bits);
+	fm->scanned++;
+	return w * WORD_BITS + __builtin_ctzll(fm->words[w]);
+}
+
+long freemap_find(struct freemap *fm, size_t hint)
+{
+	long bit;
+
+	if (!fm->free_count)
+		return -1;
+	bit = freemap_next(fm, hint);
+	if (bit < 0 && hint)
+		bit = freemap_next(fm, 0);
+	return bit;
+}
+
+/* Number of consecutive free blocks starting at @from, at most @max */
+static size_t freemap_run_length(struct freemap *fm, size_t from, size_t max)
+{
+	size_t len = 0;
+
+	while (len < max && from + len < fm->nbits) {
+		size_t bit = from + len;
+		uint64_t used = ~fm->words[bit / WORD_BITS] >> (bit % WORD_BITS);
+		size_t n;
+
+		fm->scanned++;
+		/* Free bits up to the first used one or the end of the word */
+		n = used ? (size_t)__builtin_ctzll(used) :
+			WORD_BITS - bit % WORD_BITS;
+		len += n;
+		if (used)
+			break;
+	}
+	if (from + len > fm->nbits)
+		len = fm->nbits - from;
+	return len < max ? len : max;
+}
+
+long freemap_find_run(struct freemap *fm, size_t hint, size_t want,
+		      size_t *len)
+{
+	long bit, best = -1;
+	size_t n, best_len = 0;
+	int tries, wrapped = 0;
+
+	*len = 0;
+	if (!fm->free_count || !want)
+		return -1;
+
+	bit = freemap_next(fm, hint);
+	if (bit < 0) {
+		wrapped = 1;
+		bit = freemap_next(fm, 0);
+	}
+
+	for (tries = 0; bit >= 0 && tries < RUN_SEARCH_MAX; tries++) {
+		n = freemap_run_length(fm, bit, want);
+		if (n == want || (size_t)bit == hint) {
+			*len = n;
+			return bit;
+		}
+		if (n > best_len) {
+			best = bit;
+			best_len = n;
+		}
+
+		/* Block bit + n is used, carry on after it */
+		bit = freemap_next(fm, bit + n + 1);
+		if (bit < 0 && !wrapped) {
+			wrapped = 1;
+			bit = freemap_next(fm, 0);
+		}
+		if (wrapped && bit >= 0 && (size_t)bit >= hint)
+			break;
+	}
+
+	*len = best_len;
+	return best;
+}
+
+size_t freemap_count(struct freemap *fm)
+{
+	return fm->free_count;
+}
+
+size_t freemap_scanned(struct freemap *fm)
+{
+	return fm->scanned;
+}
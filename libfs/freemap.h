@@ -0,0 +1,88 @@
+#ifndef _FREEMAP_H
+#define _FREEMAP_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Opaque free-space map instance */
+struct freemap;
+
+/**
+ * freemap_create - Create a free-space map
+ * @nbits: Number of blocks tracked by the map
+ *
+ * All the blocks start out used; mark the free ones with freemap_set_free().
+ *
+ * Return: NULL if memory cannot be allocated. The new map otherwise.
+ */
+struct freemap *freemap_create(size_t nbits);
+
+/**
+ * freemap_destroy - Release a free-space map
+ * @fm: Map to release
+ */
+void freemap_destroy(struct freemap *fm);
+
+/**
+ * freemap_set_free - Mark a block as free
+ * @fm: Map
+ * @bit: Index of the block
+ */
+void freemap_set_free(struct freemap *fm, size_t bit);
+
+/**
+ * freemap_set_used - Mark a block as used
+ * @fm: Map
+ * @bit: Index of the block
+ */
+void freemap_set_used(struct freemap *fm, size_t bit);
+
+/**
+ * freemap_find - Find a free block
+ * @fm: Map
+ * @hint: Index where the search starts
+ *
+ * Look for the first free block at or after @hint, wrapping around to the
+ * start of the map. The search skips 4096 fully used blocks per step, so its
+ * cost does not grow as the map fills up.
+ *
+ * Return: -1 if no block is free. The index of the free block otherwise.
+ */
+long freemap_find(struct freemap *fm, size_t hint);
+
+/**
+ * freemap_find_run - Find a run of consecutive free blocks
+ * @fm: Map
+ * @hint: Index where the search starts
+ * @want: Number of blocks wanted
+ * @len: Filled with the length of the run found, at most @want
+ *
+ * If block @hint is free, the run starting at @hint is returned even when it is
+ * shorter than @want, so that the caller keeps growing contiguously from
+ * there. Otherwise the first run of @want free blocks after @hint (wrapping
+ * around) is returned. If the search gives up before finding one, the longest
+ * run seen is returned instead.
+ *
+ * Return: -1 if no block is free. The index of the first block of the run
+ * otherwise.
+ */
+long freemap_find_run(struct freemap *fm, size_t hint, size_t want,
+		      size_t *len);
+
+/**
+ * freemap_count - Get the number of free blocks
+ * @fm: Map
+ *
+ * Return: The number of free blocks in @fm.
+ */
+size_t freemap_count(struct freemap *fm);
+
+/**
+ * freemap_scanned - Get the search effort so far
+ * @fm: Map
+ *
+ * Return: The number of map words, summary words included, that
+ * freemap_find() and freemap_find_run() examined since @fm was created.
+ */
+size_t freemap_scanned(struct freemap *fm);
+
+#endif /* _FREEMAP_H */
@@ -1,16 +1,62 @@
 #include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
+#include "cache.h"
+#include "dedup.h"
 #include "disk.h"
+#include "freemap.h"
 #include "fs.h"
+#include "lz.h"
+#include "stats.h"
+#include "trace.h"
 #define BLOCK_SIZE 4096
 #define NAME_SIZE 16
 #define FATSIZE 2
 #define FAT_E0C 0xFFFF
 #define EMPTY_REF 0x0
+// most blocks moved by a single vectored disk call
+#define RUN_MAX 256
+// most runs submitted together by fs_read and fs_write
+#define BATCH_MAX 64
+// most blocks reserved ahead of a growing file
+#define RESERVE_MAX 64
+// metadata updates batched into one journal transaction before it commits
+#define JOURNAL_GROUP_OPS 64
+// most home blocks of a transaction, every fat block plus the root dir
+#define JOURNAL_TX_MAX 256
+// fat_dirty flags: changed since last written or logged
+#define META_DIRTY 1
+// logged in the journal, not yet written at its home
+#define META_LOGGED 2
+// first readahead window of a sequential reader, doubled on every refill
+#define READAHEAD_MIN 4
+// file block with no disk block behind it, fat index 0 is never allocated
+#define HOLE_REF 0
+// most blocks a file with holes can span, one bit each in its hole map
+#define FILE_BLOCKS_MAX (BLOCK_SIZE * 8)
+// entries of one block of an on-disk block map, and most blocks such a map takes
+#define MAP_ENTRIES (BLOCK_SIZE / FATSIZE)
+#define MAP_BLOCKS_MAX (FILE_BLOCKS_MAX / MAP_ENTRIES)
+// root_nodes flags: the file keeps its block map on disk, index is the chain of the map
+#define ROOT_MAPPED 1
+// the file is compressed, its chain is its packed index then its packed blocks
+#define ROOT_COMPRESSED 2
+// unshare_blocks flags: the first or last block is only partly overwritten and keeps its
+// content, holes get a block too
+#define UNSHARE_COPY_FIRST 1
+#define UNSHARE_COPY_LAST 2
+#define UNSHARE_HOLES 4
+// most packed blocks of a compressed file loaded at once to decompress the blocks they hold
+#define UNPACK_MAX 16
+// buckets of the filename hash index, end of a bucket chain
+#define NAME_BUCKETS 256
+#define NO_SLOT -1
 struct superblock {
 	uint64_t Signature;
 	uint16_t Block_Amounts;
@@ -18,576 +64,4197 @@ struct superblock {
 	uint16_t Data_Start;
 	uint16_t Data_Blocks_Amount;
 	uint8_t Fat_Blocks;
-}first_block;
+	// journal region as a fat chain, 0 blocks when there is no journal
+	uint16_t Journal_Start;
+	uint16_t Journal_Blocks;
+	char padding[4075];
+} __attribute__((packed));
+
+// first block of the journal region
+struct journal_header {
+	uint64_t Signature;
+	// sequence number of the first transaction to replay
+	uint64_t Sequence;
+	// where that transaction starts in the region
+	uint32_t Start;
+	char padding[4076];
+} __attribute__((packed));
+
+// first block of a transaction, followed by one image per home block
+struct journal_descriptor {
+	uint64_t Signature;
+	uint64_t Sequence;
+	// covers the home block numbers and the images
+	uint64_t Checksum;
+	uint16_t Count;
+	uint16_t Homes[JOURNAL_TX_MAX];
+	char padding[BLOCK_SIZE - 26 - 2 * JOURNAL_TX_MAX];
+} __attribute__((packed));
 
 struct root_nodes {
 	char file_name[NAME_SIZE];
 	uint32_t file_size;
 	uint16_t index;
-	char padding[10];
-} root_dir[FS_FILE_MAX_COUNT];
+	// fat index of the hole map of a file with holes, 0 when every block is allocated
+	uint16_t hole_map;
+	// ROOT_ flags
+	uint8_t flags;
+	char padding[7];
+};
+
+// in-memory state shared by every fd open on the same file
+struct open_file {
+	struct root_nodes* root;
+	// fat index of every block of the chain, in file order, HOLE_REF for holes
+	uint16_t* blocks;
+	size_t nblocks;
+	size_t capacity;
+	// free blocks set aside for the next appends, right after the last block
+	uint16_t reserve_start;
+	size_t reserve_len;
+	// size of the last reservation, the next one doubles it
+	size_t last_growth;
+	// one bit per file block, set when the block is allocated, NULL without holes
+	uint8_t* hole_map;
+	// hole_map changed since it was last written
+	int hole_map_dirty;
+	// fat index of each block of the on-disk block map of a mapped file, in order
+	uint16_t map_blocks[MAP_BLOCKS_MAX];
+	size_t map_count;
+	// one bit per block of the on-disk block map changed since it was last written
+	uint32_t map_dirty;
+	// where each block of a compressed file starts in its packed blocks, one more entry for
+	// where the last one ends, NULL unless the file is compressed
+	uint32_t* extents;
+	// blocks the extents cover, and blocks of the chain the packed index takes
+	size_t packed_count;
+	size_t index_blocks;
+	// how many fds point at this file
+	int refs;
+	// bumped by every write, tells readahead buffers they went stale
+	unsigned generation;
+	// held for reading by fs_read, for writing by fs_write
+	pthread_rwlock_t lock;
+};
 
 struct fd {
 	struct root_nodes* root;
+	struct open_file* file;
 	size_t offset;
-} file_descriptors[FS_OPEN_MAX_COUNT];
+	// where the next read starts if the reader is sequential
+	size_t ra_next;
+	// blocks prefetched by the last refill, 0 while access is random
+	size_t ra_window;
+	// readahead buffer, holding ra_count blocks from block ra_start of the file
+	char* ra_buf;
+	size_t ra_start;
+	size_t ra_count;
+	// file generation the buffer was filled at
+	unsigned ra_generation;
+};
 
-uint16_t* fat_representation;
-int fs_mount(const char *diskname) {
-	if(block_disk_open(diskname) == -1) {
-		// opening failed
-		return -1;
+// everything about one mounted file system, the fs_* calls without a context use default_ctx
+struct fs_ctx {
+	struct superblock first_block;
+	struct root_nodes root_dir[FS_FILE_MAX_COUNT];
+	// root dir as it is on disk, fs_sync only writes root_dir when they differ
+	struct root_nodes root_disk[FS_FILE_MAX_COUNT];
+	// root dir as of the last journal transaction
+	struct root_nodes root_logged[FS_FILE_MAX_COUNT];
+	struct open_file open_files[FS_OPEN_MAX_COUNT];
+	struct fd file_descriptors[FS_OPEN_MAX_COUNT];
+	// virtual disk the file system lives on
+	struct block_dev* disk;
+	uint16_t* fat_representation;
+	// how many mapped files point at each data block, 0 for blocks of a chain
+	uint32_t* block_refs;
+	// fingerprints of the blocks fs_write wrote whole, NULL when dedup is off
+	struct dedup* dedup;
+	// fingerprint of a block of zeros
+	uint64_t zero_hash;
+	// META_ flags of each fat block
+	uint8_t* fat_dirty;
+	// next free block of the journal region, and next transaction sequence number
+	size_t journal_pos;
+	uint64_t journal_seq;
+	// metadata updates since the last transaction
+	unsigned journal_updates;
+	// write-back cache in front of the data blocks
+	struct cache* block_cache;
+	// how many runs fs_read and fs_write batch together
+	unsigned io_depth;
+	// largest readahead window in blocks, 0 disables readahead
+	size_t readahead_limit;
+	// which fat entries are free, kept in sync by fat_set
+	struct freemap* free_blocks;
+	// which root dir entries are free
+	struct freemap* free_slots;
+	// filename hash index over root_dir, chained through name_next
+	int16_t name_buckets[NAME_BUCKETS];
+	int16_t name_next[FS_FILE_MAX_COUNT];
+	// locks are always taken in this order: table_lock, a file lock, fat_lock
+	// guards the mount state, the fd table, open_files slots and the root dir names
+	pthread_mutex_t table_lock;
+	// guards fat_representation, block_refs, dedup, free_blocks and every file's reservation
+	pthread_mutex_t fat_lock;
+	// number recorded in traces, 0 for default_ctx
+	uint16_t trace_id;
+	// root dir entry the next fs_defrag picks up from
+	int defrag_next;
+};
+
+struct fs_ctx default_ctx = {
+	.table_lock = PTHREAD_MUTEX_INITIALIZER,
+	.fat_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+// trace number of the next context fs_mount_ctx creates
+uint16_t next_trace_id = 1;
+
+/// @brief release everything fs_mount set up and close the disk, without writing anything
+void fs_mount_cleanup(struct fs_ctx* ctx) {
+	cache_destroy(ctx->block_cache);
+	ctx->block_cache = NULL;
+	freemap_destroy(ctx->free_blocks);
+	ctx->free_blocks = NULL;
+	freemap_destroy(ctx->free_slots);
+	ctx->free_slots = NULL;
+	free(ctx->fat_representation);
+	ctx->fat_representation = NULL;
+	free(ctx->fat_dirty);
+	ctx->fat_dirty = NULL;
+	free(ctx->block_refs);
+	ctx->block_refs = NULL;
+	dedup_destroy(ctx->dedup);
+	ctx->dedup = NULL;
+	ctx->first_block.Signature = 0;
+	block_dev_close(ctx->disk);
+	ctx->disk = NULL;
+}
+
+/// @brief hash a filename into one of the name buckets
+/// @param filename 
+/// @return bucket index
+unsigned name_hash(const char* filename) {
+	uint32_t hash = 2166136261u;
+	for(int i = 0; i < NAME_SIZE && filename[i] != '\0'; i++) {
+		hash = (hash ^ (unsigned char)filename[i]) * 16777619u;
 	}
-	// read into first block
-	block_read(0,&first_block);
-	// parse the signature
-	char sig_parsed[8];
-	for(int i = 0; i < 8; i++) {
-		sig_parsed[i] = (first_block.Signature >> (i*8)) & 0xFF;
+	return hash % NAME_BUCKETS;
+}
+
+/// @brief add a used root dir entry to the name index
+/// @param slot 
+void name_insert(struct fs_ctx* ctx, int slot) {
+	unsigned bucket = name_hash(ctx->root_dir[slot].file_name);
+	ctx->name_next[slot] = ctx->name_buckets[bucket];
+	ctx->name_buckets[bucket] = slot;
+	freemap_set_used(ctx->free_slots, slot);
+}
+
+/// @brief take a root dir entry out of the name index
+/// @param slot 
+void name_remove(struct fs_ctx* ctx, int slot) {
+	int16_t* link = &ctx->name_buckets[name_hash(ctx->root_dir[slot].file_name)];
+	while(*link != slot) {
+		link = &ctx->name_next[*link];
 	}
-	char check[] = "ECS150FS";
-	for(int i = 0 ; i < 8 ; i++) {
-		if(sig_parsed[i] != check[i]){
-			return -1;
+	*link = ctx->name_next[slot];
+	freemap_set_free(ctx->free_slots, slot);
+}
+
+/// @brief find the root dir entry of a file
+/// @param filename 
+/// @return the entry index, -1 if there is no such file
+int name_lookup(struct fs_ctx* ctx, const char* filename) {
+	for(int slot = ctx->name_buckets[name_hash(filename)]; slot != NO_SLOT; slot = ctx->name_next[slot]) {
+		if(strncmp(ctx->root_dir[slot].file_name, filename, NAME_SIZE) == 0) {
+			return slot;
 		}
 	}
-	
-	fat_representation = malloc(first_block.Fat_Blocks * BLOCK_SIZE * sizeof(uint16_t));
-	
-	// need to match the fats and put them into fat_representation
-	int block_track = 1;
-	int offset = 0;
-	for(block_track = 1; block_track < 1 + first_block.Fat_Blocks; block_track++) {
-		if(block_read(block_track,&fat_representation[offset]) == -1) {
-			return -1;
-		}
-		offset += first_block.Data_Blocks_Amount/first_block.Fat_Blocks;
+	return -1;
+}
+
+/// @brief a filename needs at least one character and room for the NULL character
+/// @param filename 
+/// @return -1 if invalid
+int name_validation(const char* filename) {
+	if(filename == NULL) {
+		return -1;
+	}
+	size_t length = strnlen(filename, NAME_SIZE);
+	if(length == 0 || length == NAME_SIZE) {
+		return -1;
 	}
-	block_read(block_track,root_dir);
 	return 0;
-	
 }
 
-int fs_umount(void) {
-	int offset = 0;
-	// check if there is an fd open
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-		if(file_descriptors[i].root != EMPTY_REF){
-			return -1;
+/// @brief change a fat entry, keeping the free block map up to date
+/// @param fat_index not accounting for data start
+/// @param value 
+void fat_set(struct fs_ctx* ctx, uint16_t fat_index, uint16_t value) {
+	if(value == 0 && ctx->fat_representation[fat_index] != 0){
+		freemap_set_free(ctx->free_blocks, fat_index);
+		if(ctx->dedup != NULL){
+			dedup_forget(ctx->dedup, fat_index);
 		}
 	}
-	for(int i = 1 ; i < 1 + first_block.Fat_Blocks; i++){
-		if(block_write(i,&fat_representation[offset]) == -1){
+	else if(value != 0 && ctx->fat_representation[fat_index] == 0){
+		freemap_set_used(ctx->free_blocks, fat_index);
+	}
+	if(ctx->fat_representation[fat_index] != value){
+		ctx->fat_dirty[fat_index / (BLOCK_SIZE / FATSIZE)] |= META_DIRTY;
+	}
+	ctx->fat_representation[fat_index] = value;
+}
+
+/// @brief drop a reference to a block of a mapped file, freeing it with the last one,
+/// called with fat_lock held
+/// @param fat_index not accounting for data start
+void block_release(struct fs_ctx* ctx, uint16_t fat_index){
+	if(ctx->block_refs[fat_index] > 1){
+		ctx->block_refs[fat_index]--;
+		return;
+	}
+	ctx->block_refs[fat_index] = 0;
+	fat_set(ctx, fat_index, 0);
+}
+
+/// @brief go over the on-disk block map of a mapped file that is not open, either counting
+/// a reference to each of its blocks or dropping them and freeing the map, called with fat_lock held
+/// @param root 
+/// @param release 0 to count, 1 to drop
+/// @return -1 if the map cannot be read
+int block_map_refs(struct fs_ctx* ctx, struct root_nodes* root, int release){
+	uint16_t entries[MAP_ENTRIES];
+	uint16_t map = root->index;
+	for(int i = 0; map != FAT_E0C && i < MAP_BLOCKS_MAX; i++){
+		if(cache_read(ctx->block_cache, ctx->first_block.Data_Start + map, entries) == -1){
 			return -1;
 		}
-		offset += first_block.Data_Blocks_Amount/first_block.Fat_Blocks;
+		for(int j = 0; j < MAP_ENTRIES; j++){
+			if(entries[j] == HOLE_REF || entries[j] >= ctx->first_block.Data_Blocks_Amount){
+				continue;
+			}
+			if(release){
+				block_release(ctx, entries[j]);
+			}
+			else{
+				ctx->block_refs[entries[j]]++;
+			}
+		}
+		uint16_t next = ctx->fat_representation[map];
+		if(release){
+			fat_set(ctx, map, 0);
+		}
+		map = next;
 	}
-	// load in the root dir
-	int root_location = 1 + first_block.Fat_Blocks;
-	block_write(root_location,root_dir);
-	block_disk_close();
-	free(fat_representation);
 	return 0;
 }
 
-int fs_info(void) {
-	// if no fs is mounted
-	if(first_block.Signature == 0){
-		return -1;
+/// @brief home block of the root dir
+/// @return block index
+size_t root_location(struct fs_ctx* ctx) {
+	return 1 + ctx->first_block.Fat_Blocks;
+}
+
+/// @brief disk block of a block of the journal region
+/// @param pos position in the region
+/// @return block index
+size_t journal_block(struct fs_ctx* ctx, size_t pos) {
+	return ctx->first_block.Data_Start + ctx->first_block.Journal_Start + pos;
+}
+
+/// @brief most blocks a single transaction takes in the journal
+/// @return descriptor, every fat block and the root dir
+size_t journal_tx_blocks(struct fs_ctx* ctx) {
+	return 1 + ctx->first_block.Fat_Blocks + 1;
+}
+
+/// @brief checksum of a transaction, FNV-1a over its home block numbers and images
+/// @param desc 
+/// @param images 
+/// @return 
+uint64_t journal_checksum(const struct journal_descriptor* desc, void** images) {
+	uint64_t hash = 14695981039346656037u;
+	const unsigned char* homes = (const unsigned char*)desc->Homes;
+	for(size_t i = 0; i < desc->Count * sizeof(uint16_t); i++) {
+		hash = (hash ^ homes[i]) * 1099511628211u;
 	}
-	printf("FS Info: \n");
-	// total blocks
-	printf("total_blk_count=%d\n", first_block.Block_Amounts);
-	// fat blocks
-	printf("fat_blk_count=%d\n", first_block.Fat_Blocks);
-	// which block is the rdir
-	printf("rdir_blk=%d\n", first_block.Root_Dir);
-	// where is data start
-	printf("data_blk=%d\n",first_block.Data_Start);
-	// how many data blocks there are
-	printf("data_blk_count=%d\n",first_block.Block_Amounts - first_block.Fat_Blocks - 1 - 1);
-	// how many are free(fat)
-	int total_fat = first_block.Block_Amounts - first_block.Fat_Blocks - 1 - 1;
-	int free_fat = 0;
-	for(int i = 0 ; i < total_fat;i++) {
-		if(*(fat_representation + i) == 0){
-			free_fat += 1;
+	for(int i = 0; i < desc->Count; i++) {
+		const unsigned char* image = images[i];
+		for(int j = 0; j < BLOCK_SIZE; j++) {
+			hash = (hash ^ image[j]) * 1099511628211u;
 		}
 	}
-	printf("fat_free_ratio=%d", free_fat);
-	printf("/%d\n",total_fat);
-	// how many free rootdirs there are
-	int root_dir_elements = FS_FILE_MAX_COUNT;
-	int free_dir = 0;
-	for(int i = 0; i < root_dir_elements;i++) {
-		if(root_dir[i].file_name[0] == '\0'){
-			free_dir += 1;
-		}
+	return hash;
+}
+
+/// @brief point the journal header at the next transaction, dropping everything before it
+/// @return -1 on failure
+int journal_reset(struct fs_ctx* ctx) {
+	struct journal_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(&header.Signature, "ECS150JR", 8);
+	header.Sequence = ctx->journal_seq;
+	header.Start = 1;
+	if(block_dev_write(ctx->disk, journal_block(ctx, 0), &header) == -1) {
+		return -1;
 	}
-	printf("rdir_free_ratio=%d",free_dir);
-	printf("/%d\n",root_dir_elements);
+	ctx->journal_pos = 1;
 	return 0;
 }
 
-int fs_create(const char *filename) {
-	// first find an available root dir
-	// not mounted
-	if(first_block.Signature == 0){
+/// @brief apply every complete transaction of the journal to the fat and root dir blocks,
+/// reading only the log itself
+/// @return -1 if the journal cannot be read
+int journal_replay(struct fs_ctx* ctx) {
+	struct journal_header header;
+	if(block_dev_read(ctx->disk, journal_block(ctx, 0), &header) == -1 || memcmp(&header.Signature, "ECS150JR", 8) != 0) {
 		return -1;
 	}
-	// name invalid or too long
-	if(strlen(filename) == 0 || strlen(filename) > NAME_SIZE)
-	{
+	char* images = malloc(JOURNAL_TX_MAX * BLOCK_SIZE);
+	if(images == NULL) {
 		return -1;
 	}
-	// max files have been created
-	int root_dir_elements = FS_FILE_MAX_COUNT;
-	int free_dir = 0;
-	for(int i = 0; i < root_dir_elements;i++) {
-		if(root_dir[i].file_name[0] == '\0'){
-			free_dir += 1;
+	struct journal_descriptor desc;
+	void* bufs[JOURNAL_TX_MAX];
+	size_t pos = header.Start;
+	ctx->journal_seq = header.Sequence;
+	int replayed = 0;
+	// stop at the first transaction that is not there or did not fully reach the disk
+	while(pos < ctx->first_block.Journal_Blocks) {
+		if(block_dev_read(ctx->disk, journal_block(ctx, pos), &desc) == -1) {
+			break;
 		}
-		// name already exists
-		if(strcmp(root_dir[i].file_name,filename) == 0) {
-			return -1;
+		if(memcmp(&desc.Signature, "ECS150TX", 8) != 0 || desc.Sequence != ctx->journal_seq
+		   || desc.Count == 0 || desc.Count > JOURNAL_TX_MAX || pos + 1 + desc.Count > ctx->first_block.Journal_Blocks) {
+			break;
 		}
-	}
-	if(free_dir == 0){
-		return -1;
-	}
-	root_dir_elements = FS_FILE_MAX_COUNT;
-	// find a place where root is not taken
-	for(int i = 0; i < root_dir_elements; i++){
-		if(root_dir[i].file_name[0] == '\0'){
-			// found free spot for root 
-			struct root_nodes* this_root = &root_dir[i];
-			strncpy(this_root->file_name,filename,strlen(filename));
-			this_root->file_size = 0;
-			// init the start index to fate0c
-			this_root->index = FAT_E0C;
-			return 0;
+		for(int i = 0; i < desc.Count; i++) {
+			bufs[i] = images + i * BLOCK_SIZE;
+		}
+		if(block_dev_read_multi(ctx->disk, journal_block(ctx, pos + 1), desc.Count, bufs) == -1 || journal_checksum(&desc, bufs) != desc.Checksum) {
+			break;
+		}
+		for(int i = 0; i < desc.Count; i++) {
+			// only metadata blocks can be logged
+			if(desc.Homes[i] == 0 || desc.Homes[i] > root_location(ctx) || block_dev_write(ctx->disk, desc.Homes[i], bufs[i]) == -1) {
+				free(images);
+				return -1;
+			}
 		}
+		replayed = 1;
+		pos += 1 + desc.Count;
+		ctx->journal_seq++;
 	}
-	return -1;
-}
-/// @brief clear the directory, set the index to 0, set the name to empty, set size to 0
-/// @param this_root 
-void clear_directory (struct root_nodes* this_root) {
-	this_root -> index = 0;
-	this_root -> file_size = 0;
-	for(int i = 0 ; i < (int)sizeof(this_root ->file_name); i++){
-		(this_root -> file_name)[i] = '\000';
+	free(images);
+	if(replayed) {
+		// everything is at home now
+		return journal_reset(ctx);
 	}
-	return;
+	ctx->journal_pos = pos;
+	return 0;
 }
-// run through the fat and clear every item the fat is conencted to
-void clear_fat(int head) {
-	int fat_location = head;
-	while(1){
-		uint16_t next_fat = fat_representation[fat_location];
-		fat_representation[fat_location] = 0;
-		if(next_fat == FAT_E0C){
-			return;
+
+/// @brief write the fat blocks carrying a flag to their home, clearing the flag
+/// @param flag META_DIRTY or META_LOGGED
+/// @return -1 on failure
+int write_fat_home(struct fs_ctx* ctx, uint8_t flag) {
+	int offset = 0;
+	for(int i = 0 ; i < ctx->first_block.Fat_Blocks; i++){
+		if(ctx->fat_dirty[i] & flag){
+			if(block_dev_write(ctx->disk, 1 + i,&ctx->fat_representation[offset]) == -1){
+				return -1;
+			}
+			ctx->fat_dirty[i] &= ~flag;
 		}
-		fat_location = next_fat;
+		offset += BLOCK_SIZE / FATSIZE;
 	}
+	return 0;
 }
-int fs_delete(const char *filename) {
-	// not opened
-	if(first_block.Signature == 0){
-		return -1;
-	}
-	// name invalid or too long
-	if(strlen(filename) == 0 || strlen(filename) > NAME_SIZE)
-	{
-		return -1;
-	}
-	// check for file name exists
-	int root_dir_elements = FS_FILE_MAX_COUNT;
-	int found_file = -1;
-	for(int i = 0; i < root_dir_elements;i++) {
-		// name exists
-		if(strcmp(root_dir[i].file_name,filename) == 0) {
-			found_file = 1;
-			break;
-		}
+
+/// @brief write every logged metadata block to its home and empty the journal
+/// @return -1 on failure
+int journal_checkpoint(struct fs_ctx* ctx) {
+	// nothing logged since the last checkpoint
+	if(ctx->journal_pos == 1){
+		return 0;
 	}
-	if(found_file == -1){
+	if(write_fat_home(ctx, META_LOGGED) == -1){
 		return -1;
 	}
-	// check if the file is currently opened
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-		if(file_descriptors[i].root != EMPTY_REF){
-			if(strcmp(file_descriptors[i].root->file_name, filename) == 0){
+	if(memcmp(ctx->root_disk, ctx->root_logged, sizeof(ctx->root_logged)) != 0){
+		if(block_dev_write(ctx->disk, root_location(ctx), ctx->root_logged) == -1){
 			return -1;
 		}
-		}
-	}
-	// first find the file in the rootdir
-	root_dir_elements = FS_FILE_MAX_COUNT;
-	for(int i = 0; i < root_dir_elements;i++){
-		if(strncmp(root_dir[i].file_name,filename,sizeof(root_dir[i].file_name)) == 0){
-			struct root_nodes* this_root = &root_dir[i];
-			// first need to know fat index
-			int fat_index = this_root -> index;
-			// set the name to all \000
-			clear_directory(this_root);
-			// clear all of the linked listed fat and make them 0
-			clear_fat(fat_index);
-			return 0;
-		}
+		memcpy(ctx->root_disk, ctx->root_logged, sizeof(ctx->root_logged));
 	}
-	return -1;
+	return journal_reset(ctx);
 }
 
-int fs_ls(void) {
-	// not mounted
-	if(first_block.Signature == 0){
-		return -1;
-	}
-	printf("FS Ls:\n");
-	int root_dir_elements = FS_FILE_MAX_COUNT;
-	int found = 0;
-	for(int i = 0; i < root_dir_elements;i++){
-		if(root_dir[i].file_name[0] != '\0'){
-			found = 1;
-			printf("file: ");
-			printf("%s, ",root_dir[i].file_name);
-			printf("size: %d, ", root_dir[i].file_size);
-			printf("data_blk: %d\n", root_dir[i].index);
+/// @brief log every fat block and the root dir changed since the last transaction,
+/// in one sequential write
+/// @return -1 on failure
+int journal_commit(struct fs_ctx* ctx) {
+	struct journal_descriptor desc;
+	void* bufs[1 + JOURNAL_TX_MAX];
+	memset(&desc, 0, sizeof(desc));
+	int offset = 0;
+	for(int i = 0; i < ctx->first_block.Fat_Blocks; i++) {
+		if(ctx->fat_dirty[i] & META_DIRTY) {
+			desc.Homes[desc.Count] = 1 + i;
+			bufs[1 + desc.Count++] = &ctx->fat_representation[offset];
 		}
+		offset += BLOCK_SIZE / FATSIZE;
 	}
-	if(!found){
-		return -1;
+	int root_changed = memcmp(ctx->root_logged, ctx->root_dir, sizeof(ctx->root_dir)) != 0;
+	if(root_changed) {
+		desc.Homes[desc.Count] = root_location(ctx);
+		bufs[1 + desc.Count++] = ctx->root_dir;
 	}
-	return 0;
-}
-
-int fs_open(const char *filename) {
-	// not mounted
-	if(first_block.Signature == 0){
-		return -1;
+	ctx->journal_updates = 0;
+	if(desc.Count == 0) {
+		return 0;
 	}
-	// file name invalid
-	if(strlen(filename) > NAME_SIZE || strlen(filename) == 0){
+	memcpy(&desc.Signature, "ECS150TX", 8);
+	desc.Sequence = ctx->journal_seq;
+	desc.Checksum = journal_checksum(&desc, bufs + 1);
+	bufs[0] = &desc;
+	if(block_dev_write_multi(ctx->disk, journal_block(ctx, ctx->journal_pos), 1 + desc.Count, bufs) == -1) {
 		return -1;
 	}
-	// check where does this filename exist in our root
-	int root_dir_elements = FS_FILE_MAX_COUNT;
-	int found_root = -1; // where is the root element
-	for(int i = 0 ; i < root_dir_elements; i++){
-		if(strcmp(root_dir[i].file_name,filename) == 0){
-			found_root = i;
-			break;
+	ctx->journal_pos += 1 + desc.Count;
+	ctx->journal_seq++;
+	for(int i = 0; i < ctx->first_block.Fat_Blocks; i++) {
+		if(ctx->fat_dirty[i] & META_DIRTY) {
+			ctx->fat_dirty[i] = META_LOGGED;
 		}
 	}
-	// the filename does not exist in the root
-	if(found_root == -1){
-		return -1;
+	if(root_changed) {
+		memcpy(ctx->root_logged, ctx->root_dir, sizeof(ctx->root_dir));
 	}
-	int found_fd = -1;
-	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
-		if(file_descriptors[i].root == EMPTY_REF){
-			found_fd = i;
-			file_descriptors[i].root = &root_dir[found_root];
-			file_descriptors[i].offset = 0;
-			break;
-		}
+	// make sure the next transaction always fits
+	if(ctx->first_block.Journal_Blocks - ctx->journal_pos < journal_tx_blocks(ctx)) {
+		return journal_checkpoint(ctx);
 	}
-	// return -1 if we dont have a single fd that is available
-	// return the fd that is assigned if we can find a fd available
-	return found_fd;
+	return 0;
 }
 
-/// @brief checks for 3 things. 1: not mounted 2: oob 3: not open
-/// @param fd 
-/// @return 
-int fd_validation(int fd){
-	if(first_block.Signature == 0){
-		return -1;
+/// @brief give a journal region that could not be set up back to the free blocks, on disk too
+/// @param start first block of the region
+/// @param blocks size of the region
+void journal_unchain(struct fs_ctx* ctx, size_t start, size_t blocks) {
+	for(size_t i = 0; i < blocks; i++) {
+		fat_set(ctx, start + i, 0);
 	}
-	// out of bounds
-	if(fd < 0 || fd > FS_OPEN_MAX_COUNT - 1){
-		return -1;
+	ctx->first_block.Journal_Start = 0;
+	ctx->first_block.Journal_Blocks = 0;
+	// best effort, the mount fails either way
+	write_fat_home(ctx, META_DIRTY);
+}
+
+/// @brief carve a journal region out of the free data blocks and record it in the superblock
+/// @param blocks size of the region
+/// @return -1 if there is no free run that long
+int journal_create(struct fs_ctx* ctx, size_t blocks) {
+	// room for the header and at least two transactions
+	if(blocks < 1 + 2 * journal_tx_blocks(ctx)) {
+		blocks = 1 + 2 * journal_tx_blocks(ctx);
 	}
-	if(file_descriptors[fd].root == EMPTY_REF){
+	size_t len;
+	long start = freemap_find_run(ctx->free_blocks, 0, blocks, &len);
+	if(start == -1 || len < blocks) {
 		return -1;
 	}
-	return 0;
-}
-int fs_close(int fd){
-	// not mounted
-	if(fd_validation(fd) == -1){
-		return -1;
+	// chain the region so that it reads as allocated
+	for(size_t i = 0; i < blocks; i++) {
+		fat_set(ctx, start + i, i + 1 < blocks ? start + i + 1 : FAT_E0C);
 	}
-	// clear out the reference and the offset
-	file_descriptors[fd].root = EMPTY_REF;
-	file_descriptors[fd].offset = 0;
-	return 0;
-}
-
-int fs_stat(int fd) {
-	if(fd_validation(fd) == -1){
+	if(write_fat_home(ctx, META_DIRTY) == -1) {
+		journal_unchain(ctx, start, blocks);
 		return -1;
 	}
-	return file_descriptors[fd].root->file_size;
-}
-
-int fs_lseek(int fd, size_t offset){
-	if(fd_validation(fd) == -1){
+	ctx->first_block.Journal_Start = start;
+	ctx->first_block.Journal_Blocks = blocks;
+	ctx->journal_seq = 1;
+	if(journal_reset(ctx) == -1) {
+		journal_unchain(ctx, start, blocks);
 		return -1;
 	}
-	size_t max_size = fs_stat(fd);
-	// offset too large
-	if(offset > max_size){
+	// the region only becomes a journal once the superblock says so
+	if(block_dev_write(ctx->disk, 0, &ctx->first_block) == -1) {
+		journal_unchain(ctx, start, blocks);
 		return -1;
 	}
-	file_descriptors[fd].offset = offset;
 	return 0;
 }
 
-/// @brief find the first available fat from the fd
-/// @param this_file 
-/// @return dirty fat offset is where the offset in the dirty fat
-uint16_t find_dirty_fat(struct fd this_file){
-	uint16_t current_fat = this_file.root->index;
-	int offset = this_file.offset;
-	offset -= BLOCK_SIZE;
-	while(1){
-		if(offset <= 0){
-			return current_fat + first_block.Data_Start;
-		}
-		current_fat = fat_representation[current_fat];
-		offset -= BLOCK_SIZE;
-	}
+int fs_mount(const char *diskname) {
+	return fs_mount_cache(diskname, FS_CACHE_DEFAULT_BLOCKS);
 }
 
-int find_new_block(){
-	for(int i = 0 ; i < first_block.Data_Blocks_Amount;i++){
-		if(fat_representation[i] == 0){
-			// need to deal with the initial blocks such as root, fat
-			return i + first_block.Data_Start;
-		}
-	}
-	return -1;
+int fs_mount_cache(const char *diskname, size_t cache_blocks) {
+	struct fs_options opts = {
+		.cache_blocks = cache_blocks,
+		.backend = FS_BACKEND_FD,
+		.queue_depth = 0,
+		.journal_blocks = 0,
+		.readahead_blocks = FS_READAHEAD_DEFAULT_BLOCKS,
+		.dedup_entries = 0,
+	};
+	return fs_mount_opts(diskname, &opts);
 }
 
-void* create_writeblock (void* buf, size_t count, uint16_t real_block){
-	void* write = malloc(BLOCK_SIZE*sizeof(char));
-	if(real_block != 0){
-		block_read(real_block,write);
+/// @brief mount a disk, called with table_lock held
+/// @param diskname 
+/// @param opts 
+/// @return -1 on failure
+int mount_locked(struct fs_ctx* ctx, const char *diskname, const struct fs_options *opts) {
+	// already mounted
+	if(ctx->first_block.Signature != 0){
+		return -1;
 	}
-	memcpy(write,buf,count);
-	return write;
-}
-
-// how much space we have allocated 
-int allocated_space (int size){
-	if(size%BLOCK_SIZE == 0){
-		return size;
+	enum block_disk_mode mode = BLOCK_DISK_FD;
+	size_t cache_blocks = opts->cache_blocks;
+	if(opts->backend == FS_BACKEND_MMAP){
+		// the mapping already keeps every block in memory
+		mode = BLOCK_DISK_MMAP;
+		cache_blocks = 0;
 	}
-	return size/BLOCK_SIZE*BLOCK_SIZE + BLOCK_SIZE;
-}
-
-int fs_write(int fd, void *buf, size_t count){
-	int valid = fd_validation(fd);
-	if(valid == -1){
+	ctx->readahead_limit = mode == BLOCK_DISK_MMAP ? 0 : opts->readahead_blocks;
+	ctx->io_depth = opts->queue_depth ? opts->queue_depth : FS_QUEUE_DEPTH_DEFAULT;
+	if(ctx->io_depth > BATCH_MAX){
+		ctx->io_depth = BATCH_MAX;
+	}
+	if(opts->backend == FS_BACKEND_URING){
+		ctx->disk = block_dev_open(diskname, BLOCK_DISK_URING, ctx->io_depth);
+	}
+	else{
+		ctx->disk = block_dev_open(diskname, mode, 0);
+	}
+	if(ctx->disk == NULL) {
+		// opening failed
 		return -1;
 	}
-	if(buf == NULL){
+	// read into first block
+	if(block_dev_read(ctx->disk, 0,&ctx->first_block) == -1) {
+		block_dev_close(ctx->disk);
+		ctx->disk = NULL;
 		return -1;
 	}
-	struct fd this_file = file_descriptors[fd];
-	// need to find where the first block available is
-	void* buf_cpy = buf;
-	uint16_t first_write_fat = 0;
-	if(this_file.root->index == FAT_E0C){
-		if(count == 0){
-			return 0;
+	// parse the signature
+	char sig_parsed[8];
+	for(int i = 0; i < 8; i++) {
+		sig_parsed[i] = (ctx->first_block.Signature >> (i*8)) & 0xFF;
+	}
+	char check[] = "ECS150FS";
+	for(int i = 0 ; i < 8 ; i++) {
+		if(sig_parsed[i] != check[i]){
+			ctx->first_block.Signature = 0;
+			block_dev_close(ctx->disk);
+			ctx->disk = NULL;
+			return -1;
 		}
-		// haven't found the init index yet
-		int find_free = find_new_block();
-		if(find_free == -1){
-			// no fat available
-			return 0;
+	}
+	
+	// finish whatever the journal holds before trusting the fat and root dir
+	if(ctx->first_block.Journal_Blocks != 0) {
+		if((size_t)ctx->first_block.Journal_Start + ctx->first_block.Journal_Blocks > ctx->first_block.Data_Blocks_Amount
+		   || journal_replay(ctx) == -1) {
+			ctx->first_block.Signature = 0;
+			block_dev_close(ctx->disk);
+			ctx->disk = NULL;
+			return -1;
 		}
-		this_file.root->index = find_free - first_block.Data_Start;
-		fat_representation[find_free - first_block.Data_Start] = FAT_E0C;
-	}
-	first_write_fat = find_dirty_fat(this_file);
-	// first deal with the dirty fat
-	// how much space we have in the dirty fat block
-	uint16_t left_over_offset = BLOCK_SIZE - this_file.offset%BLOCK_SIZE;
-	// if it's 0, then we do have 4096 left over
-	// if it is 4096, we actually have 0 offset left over
-	if(this_file.offset%BLOCK_SIZE == 0 && this_file.offset != 0){
-		left_over_offset = 0;
-	}
-	void* dirty_block = malloc(BLOCK_SIZE*sizeof(char));
-	block_read(first_write_fat,dirty_block);
-	// the left over of the dirty fat block is enough
-	if(left_over_offset >= count){
-		// we only need to deal with the dirty fat block
-		memcpy(dirty_block + this_file.offset%BLOCK_SIZE, buf_cpy, count);
-		block_write(first_write_fat,dirty_block);
-		// set the offset
-		this_file.root->file_size += count;
-		if(this_file.offset + count > this_file.root->file_size) {
-			this_file.root ->file_size = this_file.offset + count;
-		}
-		fs_lseek(fd,this_file.offset + count);
-		free(dirty_block);
-		return count;
-	}
-	int written = 0;
-	memcpy(dirty_block + this_file.offset%BLOCK_SIZE, buf_cpy, left_over_offset);
-	block_write(first_write_fat,dirty_block);
-	free(dirty_block);
-	buf_cpy += left_over_offset;
-	written += left_over_offset;
-	// track whether if we need to allocate new block or use the old
-	int left_over_track = allocated_space(this_file.root->file_size) - this_file.offset;
-	// keep track of how much data we need to write
-	size_t leftover_count = count;
-	leftover_count -= left_over_offset;
-	left_over_track -= left_over_offset;
-	// the most recent block that we have wrote to
-	// did not account for the datastart
-	uint16_t last_block = first_write_fat;
-	while(leftover_count > 0){
-		// find an available block
-		// did not account for datastart
-		int available_fat = -1;
-		if(left_over_track > 0){
-			available_fat = fat_representation[last_block - first_block.Data_Start] + first_block.Data_Start;
+	}
+	ctx->fat_representation = malloc(ctx->first_block.Fat_Blocks * BLOCK_SIZE * sizeof(uint16_t));
+	ctx->fat_dirty = calloc(ctx->first_block.Fat_Blocks, sizeof(uint8_t));
+	ctx->block_cache = cache_create(ctx->disk, cache_blocks);
+	if(ctx->fat_representation == NULL || ctx->fat_dirty == NULL || ctx->block_cache == NULL) {
+		fs_mount_cleanup(ctx);
+		return -1;
+	}
+	
+	// need to match the fats and put them into fat_representation
+	int block_track = 1;
+	int offset = 0;
+	for(block_track = 1; block_track < 1 + ctx->first_block.Fat_Blocks; block_track++) {
+		if(block_dev_read(ctx->disk, block_track,&ctx->fat_representation[offset]) == -1) {
+			fs_mount_cleanup(ctx);
+			return -1;
 		}
-		else{
-			available_fat = find_new_block(); 
-			if(available_fat == -1){
-				// no more blocks available
-				// update the offset
-				if(this_file.offset + written > this_file.root->file_size) {
-					this_file.root->file_size = this_file.offset + written;
-				}
-				fs_lseek(fd,this_file.offset + written);
-				return written;
-			}
-			// we have a block, now write into it
-			// need to account for fake fat vs real fat
-			fat_representation[last_block - first_block.Data_Start ] = available_fat - first_block.Data_Start;
-			fat_representation[available_fat - first_block.Data_Start] = FAT_E0C;
-		}
-		if(leftover_count <= BLOCK_SIZE){
-			// just write to this block and then we dones
-			// need to copy down the original block
-			void* new_block = create_writeblock(buf_cpy,leftover_count,available_fat);
-			// write it onto the data block
-			block_write(available_fat,new_block);
-			free(new_block);
-			written += leftover_count;
-			if(this_file.offset + written > this_file.root->file_size) {
-				this_file.root->file_size = this_file.offset + written;
-			}
-			fs_lseek(fd,this_file.offset + written);
-			
-			return written;
-		}
-		// fresh block, we need to fill all of it
-		// create a fresh block without taking from the original block
-		void* new_block = create_writeblock(buf_cpy,BLOCK_SIZE, 0);
-		block_write(available_fat,new_block);
-		free(new_block);
-		written += BLOCK_SIZE;
-		// update the buffer to next location
-		buf_cpy += BLOCK_SIZE;
-		left_over_track -= BLOCK_SIZE;
-		leftover_count -= BLOCK_SIZE;
-		last_block = available_fat;
+		// each fat block holds BLOCK_SIZE / FATSIZE entries
+		offset += BLOCK_SIZE / FATSIZE;
 	}
-	return -1;
-}
-
-uint16_t find_first_read(struct fd this_file, int* offset_left) {
-	uint16_t current_fat = this_file.root->index;
-	int offset = this_file.offset;
-	// traverse the offset
-	while(offset > BLOCK_SIZE){
-		offset -= BLOCK_SIZE;
-		current_fat = fat_representation[current_fat];
+	if(block_dev_read(ctx->disk, block_track,ctx->root_dir) == -1) {
+		fs_mount_cleanup(ctx);
+		return -1;
 	}
-	*offset_left = offset;
-	return current_fat + first_block.Data_Start;
-}
-
-int fs_read(int fd, void *buf, size_t count){
-	int valid = fd_validation(fd);
-	if(valid == -1){
+	memcpy(ctx->root_disk, ctx->root_dir, sizeof(ctx->root_dir));
+	memcpy(ctx->root_logged, ctx->root_dir, sizeof(ctx->root_dir));
+	// index the free fat entries once so allocations never scan the fat
+	ctx->free_blocks = freemap_create(ctx->first_block.Data_Blocks_Amount);
+	if(ctx->free_blocks == NULL) {
+		fs_mount_cleanup(ctx);
 		return -1;
 	}
-	if(buf == NULL){
+	for(int i = 0; i < ctx->first_block.Data_Blocks_Amount; i++) {
+		if(ctx->fat_representation[i] == 0) {
+			freemap_set_free(ctx->free_blocks, i);
+		}
+	}
+	// same for the root dir, plus a hash index of the filenames
+	ctx->free_slots = freemap_create(FS_FILE_MAX_COUNT);
+	if(ctx->free_slots == NULL) {
+		fs_mount_cleanup(ctx);
 		return -1;
 	}
-	void *orig_buf = buf;
-	/* TODO: Phase 4 */
-	size_t count_left = count;
-	int file_size_temp = file_descriptors[fd].root->file_size;
-	file_size_temp -= file_descriptors[fd].offset;
-	if(file_size_temp <= 0) {
-		// offset points to beyond the end of the file
-		return 0;
+	for(int i = 0; i < NAME_BUCKETS; i++) {
+		ctx->name_buckets[i] = NO_SLOT;
 	}
-	int offset_left = 0;
-	// the fat that we are currently reading, not accounting for data start
-	uint16_t current_fat = find_first_read(file_descriptors[fd], &offset_left);
-	void* dirty_block = malloc(BLOCK_SIZE*sizeof(char));
-	block_read(current_fat,dirty_block);
-	// if whatever is left over of the dirty block is greater than count
-	if((int)count <= BLOCK_SIZE - offset_left){
-		// 2 cases
-		// 1: whatever is left of the block we want
-		// 2: the block is not fully written
-		if(file_size_temp <= (int)count){
-			memcpy(buf,dirty_block + offset_left, file_size_temp);
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if(ctx->root_dir[i].file_name[0] == '\0') {
+			freemap_set_free(ctx->free_slots, i);
+		}
+		else {
+			name_insert(ctx, i);
 		}
-		else{
-			memcpy(buf,dirty_block + offset_left, count);
-		}
-		buf = orig_buf;
-		fs_lseek(fd,file_descriptors[fd].offset + count);
-		return count;
-	}
-	memcpy(buf,dirty_block + offset_left, BLOCK_SIZE - offset_left);
-	buf += (BLOCK_SIZE - offset_left);
-	count_left -= (BLOCK_SIZE - offset_left);
-	int total_read = BLOCK_SIZE - offset_left;
-	// move current fat to next
-	current_fat = fat_representation[current_fat - first_block.Data_Start] + first_block.Data_Start;
-	while(count_left > 0){
-		if(current_fat == FAT_E0C){
-			// the amount we want to read > the amount of data we actually have
-			// set the count_left to the amount that we have left in the file
-			if((int)count_left > file_size_temp){
-				count_left = file_size_temp;
-			}
-		}
-		void* new_block = malloc(BLOCK_SIZE*sizeof(char));
-		block_read(current_fat,new_block);
-		if(count_left <= BLOCK_SIZE){
-			// read the amount we need and return
-			memcpy(buf,new_block,count_left);
-			buf = orig_buf;
-			total_read += count_left;
-			fs_lseek(fd,file_descriptors[fd].offset + total_read);
-			return total_read;
-		}
-		// arrive here if the count that we got left > a whole block
-		memcpy(buf, new_block, BLOCK_SIZE);
-		buf += BLOCK_SIZE;
-		count_left -= BLOCK_SIZE;
-		file_size_temp -= BLOCK_SIZE;
-		current_fat = fat_representation[current_fat - first_block.Data_Start] + first_block.Data_Start;
-		total_read += BLOCK_SIZE;
 	}
-	return -1;
+	// mapped files may share blocks, count how many of them point at each one
+	ctx->block_refs = calloc(ctx->first_block.Data_Blocks_Amount, sizeof(uint32_t));
+	if(ctx->block_refs == NULL) {
+		fs_mount_cleanup(ctx);
+		return -1;
+	}
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if(ctx->root_dir[i].file_name[0] != '\0' && (ctx->root_dir[i].flags & ROOT_MAPPED)
+		   && block_map_refs(ctx, &ctx->root_dir[i], 0) == -1) {
+			fs_mount_cleanup(ctx);
+			return -1;
+		}
+	}
+	if(ctx->first_block.Journal_Blocks == 0 && opts->journal_blocks > 0) {
+		if(journal_create(ctx, opts->journal_blocks) == -1) {
+			fs_mount_cleanup(ctx);
+			return -1;
+		}
+	}
+	// the index starts out empty, it learns the blocks as fs_write writes them
+	if(opts->dedup_entries > 0) {
+		char zeros[BLOCK_SIZE] = {0};
+		ctx->dedup = dedup_create(opts->dedup_entries, ctx->first_block.Data_Blocks_Amount);
+		if(ctx->dedup == NULL) {
+			fs_mount_cleanup(ctx);
+			return -1;
+		}
+		ctx->zero_hash = dedup_hash(zeros);
+	}
+	ctx->journal_updates = 0;
+	ctx->defrag_next = 0;
+	return 0;
+	
+}
+
+int fs_mount_opts(const char *diskname, const struct fs_options *opts) {
+	if(opts == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&default_ctx.table_lock);
+	int ret = mount_locked(&default_ctx, diskname, opts);
+	pthread_mutex_unlock(&default_ctx.table_lock);
+	trace_end(start, FS_TRACE_MOUNT, 0, -1, 0, ret, diskname);
+	return ret;
+}
+
+struct fs_ctx *fs_mount_ctx(const char *diskname, const struct fs_options *opts) {
+	if(opts == NULL){
+		return NULL;
+	}
+	struct fs_ctx* ctx = calloc(1, sizeof(struct fs_ctx));
+	if(ctx == NULL){
+		return NULL;
+	}
+	pthread_mutex_init(&ctx->table_lock, NULL);
+	pthread_mutex_init(&ctx->fat_lock, NULL);
+	// 0 stands for default_ctx, skip it when the numbers wrap around
+	do{
+		ctx->trace_id = __atomic_fetch_add(&next_trace_id, 1, __ATOMIC_RELAXED);
+	}while(ctx->trace_id == 0);
+	uint64_t start = trace_begin();
+	// nobody else can see the context yet, but mount_locked expects the lock
+	pthread_mutex_lock(&ctx->table_lock);
+	int ret = mount_locked(ctx, diskname, opts);
+	pthread_mutex_unlock(&ctx->table_lock);
+	trace_end(start, FS_TRACE_MOUNT, ctx->trace_id, -1, 0, ret, diskname);
+	if(ret == -1){
+		pthread_mutex_destroy(&ctx->table_lock);
+		pthread_mutex_destroy(&ctx->fat_lock);
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+/// @brief write the cache and the changed metadata out, called with table_lock held
+/// and no file busy writing
+/// @return -1 on failure
+int sync_locked(struct fs_ctx* ctx) {
+	// data blocks first so the metadata never points at stale data
+	if(cache_flush(ctx->block_cache) == -1){
+		return -1;
+	}
+	if(ctx->first_block.Journal_Blocks != 0){
+		return journal_commit(ctx);
+	}
+	if(write_fat_home(ctx, META_DIRTY) == -1){
+		return -1;
+	}
+	// load in the root dir, if anything changed since it was last written
+	if(memcmp(ctx->root_disk, ctx->root_dir, sizeof(ctx->root_dir)) != 0){
+		if(block_dev_write(ctx->disk, root_location(ctx),ctx->root_dir) == -1){
+			return -1;
+		}
+		memcpy(ctx->root_disk, ctx->root_dir, sizeof(ctx->root_dir));
+	}
+	return 0;
+}
+
+/// @brief hold every open file for reading, so sizes and chains stay put
+/// @param lock 1 to take the file locks, 0 to release them
+void lock_open_files(struct fs_ctx* ctx, int lock) {
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+		if(ctx->open_files[i].refs == 0){
+			continue;
+		}
+		if(lock){
+			pthread_rwlock_rdlock(&ctx->open_files[i].lock);
+		}
+		else{
+			pthread_rwlock_unlock(&ctx->open_files[i].lock);
+		}
+	}
+}
+
+/// @brief unmount, called with table_lock held
+/// @return -1 if not mounted, if an fd is still open or if writing fails
+int umount_locked(struct fs_ctx* ctx) {
+	int ret = -1;
+	// must be mounted with no file open, by an fd or by fs_defrag
+	int busy = ctx->first_block.Signature == 0;
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+		if(ctx->open_files[i].refs > 0){
+			busy = 1;
+		}
+	}
+	if(!busy && sync_locked(ctx) == 0){
+		// leave nothing to replay behind
+		if(ctx->first_block.Journal_Blocks == 0 || journal_checkpoint(ctx) == 0){
+			fs_mount_cleanup(ctx);
+			ret = 0;
+		}
+	}
+	return ret;
+}
+
+int fs_umount(void) {
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&default_ctx.table_lock);
+	int ret = umount_locked(&default_ctx);
+	pthread_mutex_unlock(&default_ctx.table_lock);
+	trace_end(start, FS_TRACE_UMOUNT, 0, -1, 0, ret, NULL);
+	return ret;
+}
+
+int fs_umount_ctx(struct fs_ctx *ctx) {
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	pthread_mutex_lock(&ctx->table_lock);
+	int ret = umount_locked(ctx);
+	pthread_mutex_unlock(&ctx->table_lock);
+	trace_end(start, FS_TRACE_UMOUNT, ctx->trace_id, -1, 0, ret, NULL);
+	if(ret == 0){
+		pthread_mutex_destroy(&ctx->table_lock);
+		pthread_mutex_destroy(&ctx->fat_lock);
+		free(ctx);
+	}
+	return ret;
+}
+
+/// @brief fs_sync_ctx without the tracing
+int sync_untraced(struct fs_ctx* ctx) {
+	pthread_mutex_lock(&ctx->table_lock);
+	int ret = -1;
+	// not mounted
+	if(ctx->first_block.Signature != 0){
+		lock_open_files(ctx, 1);
+		pthread_mutex_lock(&ctx->fat_lock);
+		ret = sync_locked(ctx);
+		pthread_mutex_unlock(&ctx->fat_lock);
+		lock_open_files(ctx, 0);
+	}
+	pthread_mutex_unlock(&ctx->table_lock);
+	return ret;
+}
+
+int fs_sync_ctx(struct fs_ctx *ctx) {
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = sync_untraced(ctx);
+	trace_end(start, FS_TRACE_SYNC, ctx->trace_id, -1, 0, ret, NULL);
+	return ret;
+}
+
+int fs_sync(void) {
+	return fs_sync_ctx(&default_ctx);
+}
+
+/// @brief count a metadata update, and commit the journal once enough of them piled up,
+/// called with table_lock held and no file lock
+void journal_note_update(struct fs_ctx* ctx) {
+	if(ctx->first_block.Journal_Blocks == 0 || ++ctx->journal_updates < JOURNAL_GROUP_OPS){
+		return;
+	}
+	lock_open_files(ctx, 1);
+	pthread_mutex_lock(&ctx->fat_lock);
+	// a failed commit leaves the updates pending for the next fs_sync
+	sync_locked(ctx);
+	pthread_mutex_unlock(&ctx->fat_lock);
+	lock_open_files(ctx, 0);
+}
+
+int fs_cache_stats_ctx(struct fs_ctx *ctx, struct fs_cache_stats *stats) {
+	if(ctx == NULL){
+		return -1;
+	}
+	pthread_mutex_lock(&ctx->table_lock);
+	// not mounted
+	if(ctx->first_block.Signature == 0 || stats == NULL){
+		pthread_mutex_unlock(&ctx->table_lock);
+		return -1;
+	}
+	struct cache_stats counters;
+	cache_get_stats(ctx->block_cache, &counters);
+	pthread_mutex_unlock(&ctx->table_lock);
+	stats->hits = counters.hits;
+	stats->misses = counters.misses;
+	stats->evictions = counters.evictions;
+	stats->writebacks = counters.writebacks;
+	return 0;
+}
+
+int fs_cache_stats(struct fs_cache_stats *stats) {
+	return fs_cache_stats_ctx(&default_ctx, stats);
+}
+
+int fs_stats(struct fs_stats *stats) {
+	if(stats == NULL){
+		return -1;
+	}
+	size_t totals[STATS_COUNTERS];
+	stats_sum(totals);
+	stats->block_reads = totals[STATS_BLOCK_READS];
+	stats->block_writes = totals[STATS_BLOCK_WRITES];
+	stats->fat_hops = totals[STATS_FAT_HOPS];
+	stats->alloc_searches = totals[STATS_ALLOC_SEARCHES];
+	stats->alloc_scanned = totals[STATS_ALLOC_SCANNED];
+	stats->rmw_cycles = totals[STATS_RMW_CYCLES];
+	stats->read_ops = totals[STATS_READ_OPS];
+	stats->read_bytes = totals[STATS_READ_BYTES];
+	stats->write_ops = totals[STATS_WRITE_OPS];
+	stats->write_bytes = totals[STATS_WRITE_BYTES];
+	stats->cow_blocks = totals[STATS_COW_BLOCKS];
+	stats->dedup_blocks = totals[STATS_DEDUP_BLOCKS];
+	stats->unpacked_blocks = totals[STATS_UNPACKED_BLOCKS];
+	return 0;
+}
+
+void fs_stats_reset(void) {
+	stats_reset();
+}
+
+int fs_trace_start(const char *path) {
+	if(path == NULL){
+		return -1;
+	}
+	return trace_start(path);
+}
+
+int fs_trace_stop(void) {
+	return trace_stop();
+}
+
+/// @brief fs_info_ctx without the tracing
+int info_untraced(struct fs_ctx* ctx) {
+	pthread_mutex_lock(&ctx->table_lock);
+	// if no fs is mounted
+	if(ctx->first_block.Signature == 0){
+		pthread_mutex_unlock(&ctx->table_lock);
+		return -1;
+	}
+	printf("FS Info: \n");
+	// total blocks
+	printf("total_blk_count=%d\n", ctx->first_block.Block_Amounts);
+	// fat blocks
+	printf("fat_blk_count=%d\n", ctx->first_block.Fat_Blocks);
+	// which block is the rdir
+	printf("rdir_blk=%d\n", ctx->first_block.Root_Dir);
+	// where is data start
+	printf("data_blk=%d\n",ctx->first_block.Data_Start);
+	// how many data blocks there are
+	printf("data_blk_count=%d\n",ctx->first_block.Block_Amounts - ctx->first_block.Fat_Blocks - 1 - 1);
+	// how many are free(fat)
+	int total_fat = ctx->first_block.Block_Amounts - ctx->first_block.Fat_Blocks - 1 - 1;
+	pthread_mutex_lock(&ctx->fat_lock);
+	int free_fat = freemap_count(ctx->free_blocks);
+	pthread_mutex_unlock(&ctx->fat_lock);
+	printf("fat_free_ratio=%d", free_fat);
+	printf("/%d\n",total_fat);
+	// how many free rootdirs there are
+	int root_dir_elements = FS_FILE_MAX_COUNT;
+	int free_dir = freemap_count(ctx->free_slots);
+	printf("rdir_free_ratio=%d",free_dir);
+	printf("/%d\n",root_dir_elements);
+	pthread_mutex_unlock(&ctx->table_lock);
+	return 0;
+}
+
+int fs_info_ctx(struct fs_ctx *ctx) {
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = info_untraced(ctx);
+	trace_end(start, FS_TRACE_INFO, ctx->trace_id, -1, 0, ret, NULL);
+	return ret;
+}
+
+int fs_info(void) {
+	return fs_info_ctx(&default_ctx);
+}
+
+/// @brief create a file, called with table_lock held
+/// @param filename 
+/// @return -1 on failure
+int create_locked(struct fs_ctx* ctx, const char *filename) {
+	// not mounted
+	if(ctx->first_block.Signature == 0){
+		return -1;
+	}
+	// name invalid or too long
+	if(name_validation(filename) == -1)
+	{
+		return -1;
+	}
+	// name already exists
+	if(name_lookup(ctx, filename) != -1) {
+		return -1;
+	}
+	// find a place where root is not taken
+	long slot = freemap_find(ctx->free_slots, 0);
+	if(slot == -1){
+		// max files have been created
+		return -1;
+	}
+	// found free spot for root 
+	struct root_nodes* this_root = &ctx->root_dir[slot];
+	strncpy(this_root->file_name,filename,NAME_SIZE);
+	this_root->file_size = 0;
+	// init the start index to fate0c
+	this_root->index = FAT_E0C;
+	this_root->hole_map = 0;
+	this_root->flags = 0;
+	name_insert(ctx, slot);
+	return 0;
+}
+
+/// @brief fs_create_ctx without the tracing
+int create_untraced(struct fs_ctx* ctx, const char *filename) {
+	pthread_mutex_lock(&ctx->table_lock);
+	int ret = create_locked(ctx, filename);
+	if(ret == 0){
+		journal_note_update(ctx);
+	}
+	pthread_mutex_unlock(&ctx->table_lock);
+	return ret;
+}
+
+int fs_create_ctx(struct fs_ctx *ctx, const char *filename) {
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = create_untraced(ctx, filename);
+	trace_end(start, FS_TRACE_CREATE, ctx->trace_id, -1, 0, ret, filename);
+	return ret;
+}
+
+int fs_create(const char *filename) {
+	return fs_create_ctx(&default_ctx, filename);
+}
+/// @brief clear the directory, set the index to 0, set the name to empty, set size to 0
+/// @param this_root 
+void clear_directory (struct root_nodes* this_root) {
+	this_root -> index = 0;
+	this_root -> hole_map = 0;
+	this_root -> flags = 0;
+	this_root -> file_size = 0;
+	for(int i = 0 ; i < (int)sizeof(this_root ->file_name); i++){
+		(this_root -> file_name)[i] = '\000';
+	}
+	return;
+}
+// run through the fat and clear every item the fat is conencted to
+void clear_fat(struct fs_ctx* ctx, int head) {
+	int fat_location = head;
+	// empty file, nothing was allocated
+	if(head == FAT_E0C){
+		return;
+	}
+	size_t hops = 0;
+	while(1){
+		uint16_t next_fat = ctx->fat_representation[fat_location];
+		fat_set(ctx, fat_location, 0);
+		hops++;
+		if(next_fat == FAT_E0C){
+			break;
+		}
+		fat_location = next_fat;
+	}
+	stats_add(STATS_FAT_HOPS, hops);
+}
+/// @brief delete a file, called with table_lock held
+/// @param filename 
+/// @return -1 on failure
+int delete_locked(struct fs_ctx* ctx, const char *filename) {
+	// not opened
+	if(ctx->first_block.Signature == 0){
+		return -1;
+	}
+	// name invalid or too long
+	if(name_validation(filename) == -1)
+	{
+		return -1;
+	}
+	// check for file name exists
+	int slot = name_lookup(ctx, filename);
+	if(slot == -1){
+		return -1;
+	}
+	struct root_nodes* this_root = &ctx->root_dir[slot];
+	// check if the file is currently opened, by an fd or by fs_defrag
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+		if(ctx->open_files[i].refs > 0 && ctx->open_files[i].root == this_root){
+			return -1;
+		}
+	}
+	// first need to know fat index
+	struct root_nodes old_root = *this_root;
+	name_remove(ctx, slot);
+	// set the name to all \000
+	clear_directory(this_root);
+	pthread_mutex_lock(&ctx->fat_lock);
+	if(old_root.flags & ROOT_MAPPED){
+		// blocks shared with clones stay until their last file goes,
+		// what cannot be read is left for fs_fsck to find
+		block_map_refs(ctx, &old_root, 1);
+	}
+	else{
+		// clear all of the linked listed fat and make them 0
+		clear_fat(ctx, old_root.index);
+	}
+	if(old_root.hole_map != 0){
+		fat_set(ctx, old_root.hole_map, 0);
+	}
+	pthread_mutex_unlock(&ctx->fat_lock);
+	return 0;
+}
+
+/// @brief fs_delete_ctx without the tracing
+int delete_untraced(struct fs_ctx* ctx, const char *filename) {
+	pthread_mutex_lock(&ctx->table_lock);
+	int ret = delete_locked(ctx, filename);
+	if(ret == 0){
+		journal_note_update(ctx);
+	}
+	pthread_mutex_unlock(&ctx->table_lock);
+	return ret;
+}
+
+int fs_delete_ctx(struct fs_ctx *ctx, const char *filename) {
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = delete_untraced(ctx, filename);
+	trace_end(start, FS_TRACE_DELETE, ctx->trace_id, -1, 0, ret, filename);
+	return ret;
+}
+
+int fs_delete(const char *filename) {
+	return fs_delete_ctx(&default_ctx, filename);
+}
+
+/// @brief fs_ls_ctx without the tracing
+int ls_untraced(struct fs_ctx* ctx) {
+	pthread_mutex_lock(&ctx->table_lock);
+	// not mounted
+	if(ctx->first_block.Signature == 0){
+		pthread_mutex_unlock(&ctx->table_lock);
+		return -1;
+	}
+	// sizes of open files only change under their lock
+	lock_open_files(ctx, 1);
+	printf("FS Ls:\n");
+	int root_dir_elements = FS_FILE_MAX_COUNT;
+	int found = 0;
+	for(int i = 0; i < root_dir_elements;i++){
+		if(ctx->root_dir[i].file_name[0] != '\0'){
+			found = 1;
+			printf("file: ");
+			printf("%s, ",ctx->root_dir[i].file_name);
+			printf("size: %d, ", ctx->root_dir[i].file_size);
+			printf("data_blk: %d\n", ctx->root_dir[i].index);
+		}
+	}
+	lock_open_files(ctx, 0);
+	pthread_mutex_unlock(&ctx->table_lock);
+	if(!found){
+		return -1;
+	}
+	return 0;
+}
+
+int fs_ls_ctx(struct fs_ctx *ctx) {
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = ls_untraced(ctx);
+	trace_end(start, FS_TRACE_LS, ctx->trace_id, -1, 0, ret, NULL);
+	return ret;
+}
+
+int fs_ls(void) {
+	return fs_ls_ctx(&default_ctx);
+}
+
+/// @brief add a block at the end of the block map of a file
+/// @param file 
+/// @param fat_index not accounting for data start
+/// @return -1 if the map cannot grow
+int block_map_append(struct open_file* file, uint16_t fat_index){
+	if(file->nblocks == file->capacity){
+		size_t capacity = file->capacity ? file->capacity * 2 : 16;
+		uint16_t* blocks = realloc(file->blocks, capacity * sizeof(uint16_t));
+		if(blocks == NULL){
+			return -1;
+		}
+		file->blocks = blocks;
+		file->capacity = capacity;
+	}
+	file->blocks[file->nblocks++] = fat_index;
+	return 0;
+}
+
+/// @brief give the reserved but unused blocks of a file back to the free map
+/// @param file 
+void release_reservation(struct fs_ctx* ctx, struct open_file* file){
+	for(size_t i = 0; i < file->reserve_len; i++){
+		freemap_set_free(ctx->free_blocks, file->reserve_start + i);
+	}
+	file->reserve_len = 0;
+}
+
+/// @brief give back the reservations of every open file, when a search comes up empty
+/// other open files may be sitting on the last free blocks
+void release_all_reservations(struct fs_ctx* ctx){
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+		if(ctx->open_files[i].refs > 0){
+			release_reservation(ctx, &ctx->open_files[i]);
+		}
+	}
+}
+
+/// @brief whether the hole map of a file leaves a block unallocated
+/// @param file 
+/// @param block_index in file order
+/// @return 0 for files without holes
+int is_hole_bit(struct open_file* file, size_t block_index){
+	if(file->hole_map == NULL){
+		return 0;
+	}
+	return !(file->hole_map[block_index / 8] & (1 << (block_index % 8)));
+}
+
+/// @brief whether a block of a file has no disk block, past the end of the block map counts as a hole
+/// @param file 
+/// @param block_index in file order
+/// @return 
+int is_hole(struct open_file* file, size_t block_index){
+	return block_index >= file->nblocks || file->blocks[block_index] == HOLE_REF;
+}
+
+/// @brief count the holes from a block of a file on
+/// @param file 
+/// @param block_index in file order
+/// @param max_blocks never count more than this
+/// @return length of the run of holes
+size_t hole_run(struct open_file* file, size_t block_index, size_t max_blocks){
+	size_t run = 0;
+	while(run < max_blocks && is_hole(file, block_index + run)){
+		run++;
+	}
+	return run;
+}
+
+/// @brief record in the hole map of a file that a block is now allocated
+/// @param file 
+/// @param block_index in file order
+void hole_map_fill(struct open_file* file, size_t block_index){
+	if(file->hole_map != NULL){
+		file->hole_map[block_index / 8] |= 1 << (block_index % 8);
+		file->hole_map_dirty = 1;
+	}
+}
+
+/// @brief record in the hole map of a file that a block is no longer allocated
+/// @param file 
+/// @param block_index in file order
+void hole_map_clear(struct open_file* file, size_t block_index){
+	if(file->hole_map != NULL && !is_hole_bit(file, block_index)){
+		file->hole_map[block_index / 8] &= ~(1 << (block_index % 8));
+		file->hole_map_dirty = 1;
+	}
+}
+
+/// @brief write the hole map of a file out if it changed, called with the file held for writing
+/// @param file 
+void hole_map_flush(struct fs_ctx* ctx, struct open_file* file){
+	if(file->hole_map_dirty){
+		// through the cache like data, so it reaches the disk before the chain that needs it
+		file->hole_map_dirty = 0;
+		cache_write(ctx->block_cache, ctx->first_block.Data_Start + file->root->hole_map, file->hole_map);
+	}
+}
+
+/// @brief give a file a hole map so that it can have holes, called with fat_lock held
+/// @param ctx 
+/// @param file 
+/// @return -1 if there is no block left for the map
+int make_sparse(struct fs_ctx* ctx, struct open_file* file){
+	// a mapped file has its holes in its block map
+	if(file->hole_map != NULL || (file->root->flags & ROOT_MAPPED)){
+		return 0;
+	}
+	long map = freemap_find(ctx->free_blocks, 0);
+	if(map == -1){
+		return -1;
+	}
+	file->hole_map = calloc(1, BLOCK_SIZE);
+	if(file->hole_map == NULL){
+		return -1;
+	}
+	fat_set(ctx, map, FAT_E0C);
+	// every block so far is allocated
+	for(size_t i = 0; i < file->nblocks; i++){
+		hole_map_fill(file, i);
+	}
+	file->root->hole_map = map;
+	file->hole_map_dirty = 1;
+	return 0;
+}
+
+/// @brief last allocated block of a file before a position
+/// @param file 
+/// @param block_index in file order
+/// @return its fat index, FAT_E0C if there is none
+uint16_t allocated_before(struct open_file* file, size_t block_index){
+	while(block_index-- > 0){
+		if(file->blocks[block_index] != HOLE_REF){
+			return file->blocks[block_index];
+		}
+	}
+	return FAT_E0C;
+}
+
+/// @brief record that an entry of the block map of a mapped file changed
+/// @param file 
+/// @param block_index in file order
+void block_map_note(struct open_file* file, size_t block_index){
+	if(file->root->flags & ROOT_MAPPED){
+		file->map_dirty |= 1u << (block_index / MAP_ENTRIES);
+	}
+}
+
+/// @brief write one block of the on-disk block map of a file from its block map
+/// @param file 
+/// @param pos position of the block in the on-disk map
+/// @param map fat index of the block to write
+/// @return -1 if the block cannot be written
+int block_map_write(struct fs_ctx* ctx, struct open_file* file, size_t pos, uint16_t map){
+	uint16_t entries[MAP_ENTRIES];
+	size_t first = pos * MAP_ENTRIES;
+	size_t used = file->nblocks > first ? file->nblocks - first : 0;
+	if(used > MAP_ENTRIES){
+		used = MAP_ENTRIES;
+	}
+	memcpy(entries, file->blocks + first, used * sizeof(uint16_t));
+	// past the end of the block map is holes, and HOLE_REF is 0
+	memset(entries + used, 0, (MAP_ENTRIES - used) * sizeof(uint16_t));
+	// a map block is a data block of the map chain, sync writes it back ahead of the root entry
+	// that marks the file mapped, so a clone never points at stale entries
+	return cache_write(ctx->block_cache, ctx->first_block.Data_Start + map, entries);
+}
+
+/// @brief write the on-disk block map of a mapped file out where it changed, called with the
+/// file held for writing
+/// @param file 
+void block_map_flush(struct fs_ctx* ctx, struct open_file* file){
+	for(size_t i = 0; file->map_dirty != 0 && i < file->map_count; i++){
+		if(file->map_dirty & (1u << i)){
+			file->map_dirty &= ~(1u << i);
+			block_map_write(ctx, file, i, file->map_blocks[i]);
+		}
+	}
+}
+
+/// @brief give the on-disk block map of a mapped file room for more blocks, called with fat_lock held
+/// @param file 
+/// @param blocks how many blocks the map must cover
+/// @return -1 if the map cannot grow that much
+int block_map_grow(struct fs_ctx* ctx, struct open_file* file, size_t blocks){
+	while(file->map_count * MAP_ENTRIES < blocks){
+		if(file->map_count == MAP_BLOCKS_MAX){
+			return -1;
+		}
+		long map = freemap_find(ctx->free_blocks, 0);
+		if(map == -1){
+			return -1;
+		}
+		fat_set(ctx, map, FAT_E0C);
+		if(file->map_count == 0){
+			file->root->index = map;
+		}
+		else{
+			fat_set(ctx, file->map_blocks[file->map_count - 1], map);
+		}
+		file->map_dirty |= 1u << file->map_count;
+		file->map_blocks[file->map_count++] = map;
+	}
+	return 0;
+}
+
+/// @brief free the blocks of the on-disk block map of a mapped file its block map no longer needs,
+/// called with fat_lock held
+/// @param file 
+void block_map_trim(struct fs_ctx* ctx, struct open_file* file){
+	size_t keep = (file->nblocks + MAP_ENTRIES - 1) / MAP_ENTRIES;
+	if(keep >= file->map_count){
+		return;
+	}
+	for(size_t i = keep; i < file->map_count; i++){
+		fat_set(ctx, file->map_blocks[i], 0);
+	}
+	if(keep == 0){
+		file->root->index = FAT_E0C;
+	}
+	else{
+		fat_set(ctx, file->map_blocks[keep - 1], FAT_E0C);
+	}
+	file->map_count = keep;
+	file->map_dirty &= (1u << keep) - 1;
+}
+
+/// @brief read the on-disk block map of a mapped file into its block map
+/// @param file 
+/// @return -1 if the map cannot be read
+int block_map_load(struct fs_ctx* ctx, struct open_file* file){
+	pthread_mutex_lock(&ctx->fat_lock);
+	uint16_t map = file->root->index;
+	while(map != FAT_E0C && file->map_count < MAP_BLOCKS_MAX){
+		file->map_blocks[file->map_count++] = map;
+		map = ctx->fat_representation[map];
+	}
+	pthread_mutex_unlock(&ctx->fat_lock);
+	stats_add(STATS_FAT_HOPS, file->map_count);
+	uint16_t entries[MAP_ENTRIES];
+	size_t used = 0;
+	for(size_t i = 0; i < file->map_count; i++){
+		if(cache_read(ctx->block_cache, ctx->first_block.Data_Start + file->map_blocks[i], entries) == -1){
+			return -1;
+		}
+		for(size_t j = 0; j < MAP_ENTRIES; j++){
+			uint16_t entry = entries[j] < ctx->first_block.Data_Blocks_Amount ? entries[j] : HOLE_REF;
+			if(block_map_append(file, entry) == -1){
+				return -1;
+			}
+			if(entry != HOLE_REF){
+				used = file->nblocks;
+			}
+		}
+	}
+	// holes at the end are left out, like anything past the end of the map
+	file->nblocks = used;
+	return 0;
+}
+
+/// @brief move the block map of a file from its chain to blocks of its own, so that its blocks
+/// can be shared, called with fat_lock held
+/// @param file 
+/// @return -1 if the file spans too many blocks or there is no block left for the map
+int make_mapped(struct fs_ctx* ctx, struct open_file* file){
+	struct root_nodes* root = file->root;
+	if(root->flags & ROOT_MAPPED){
+		return 0;
+	}
+	if(file->nblocks > FILE_BLOCKS_MAX){
+		return -1;
+	}
+	uint16_t chain = root->index;
+	root->index = FAT_E0C;
+	if(block_map_grow(ctx, file, file->nblocks) == -1){
+		for(size_t i = 0; i < file->map_count; i++){
+			fat_set(ctx, file->map_blocks[i], 0);
+		}
+		file->map_count = 0;
+		file->map_dirty = 0;
+		root->index = chain;
+		return -1;
+	}
+	// every block ends a chain of its own, the map tells where it goes
+	for(size_t i = 0; i < file->nblocks; i++){
+		if(file->blocks[i] != HOLE_REF){
+			fat_set(ctx, file->blocks[i], FAT_E0C);
+			ctx->block_refs[file->blocks[i]] = 1;
+		}
+	}
+	// holes are entries of the map too
+	if(root->hole_map != 0){
+		fat_set(ctx, root->hole_map, 0);
+		root->hole_map = 0;
+		free(file->hole_map);
+		file->hole_map = NULL;
+		file->hole_map_dirty = 0;
+	}
+	root->flags |= ROOT_MAPPED;
+	return 0;
+}
+
+/// @brief give a mapped file blocks of its own in place of the blocks it shares in a range,
+/// before they are written, called with the file held for writing. Blocks are handled in
+/// order, so that nothing past where a full disk stops it changes
+/// @param file 
+/// @param from first block, in file order
+/// @param to end of the range
+/// @param how UNSHARE_ flags
+/// @return the first block of the range left shared, or left a hole with UNSHARE_HOLES,
+/// to if there is none
+size_t unshare_blocks(struct fs_ctx* ctx, struct open_file* file, size_t from, size_t to, int how){
+	if(!(file->root->flags & ROOT_MAPPED)){
+		return to;
+	}
+	char block[BLOCK_SIZE];
+	size_t unshared = 0;
+	pthread_mutex_lock(&ctx->fat_lock);
+	for(size_t i = from; i < to && i < file->nblocks; i++){
+		uint16_t old = file->blocks[i];
+		if(old == HOLE_REF ? !(how & UNSHARE_HOLES) : ctx->block_refs[old] <= 1){
+			if(old != HOLE_REF && ctx->dedup != NULL){
+				// about to change in place, no other file may pick it up from the index meanwhile
+				dedup_forget(ctx->dedup, old);
+			}
+			continue;
+		}
+		uint16_t prev = allocated_before(file, i);
+		size_t hint = prev == FAT_E0C ? 0 : prev + 1;
+		long fresh = freemap_find(ctx->free_blocks, hint);
+		if(fresh == -1){
+			release_all_reservations(ctx);
+			fresh = freemap_find(ctx->free_blocks, hint);
+		}
+		stats_add(STATS_ALLOC_SEARCHES, 1);
+		if(fresh == -1){
+			pthread_mutex_unlock(&ctx->fat_lock);
+			stats_add(STATS_COW_BLOCKS, unshared);
+			return i;
+		}
+		if(old != HOLE_REF && ((i == from && (how & UNSHARE_COPY_FIRST)) || (i == to - 1 && (how & UNSHARE_COPY_LAST)))){
+			// nobody writes a shared block in place, it is safe to read while we hold fat_lock
+			if(cache_read(ctx->block_cache, ctx->first_block.Data_Start + old, block) == -1
+			   || cache_write(ctx->block_cache, ctx->first_block.Data_Start + fresh, block) == -1){
+				pthread_mutex_unlock(&ctx->fat_lock);
+				stats_add(STATS_COW_BLOCKS, unshared);
+				return i;
+			}
+		}
+		fat_set(ctx, fresh, FAT_E0C);
+		ctx->block_refs[fresh] = 1;
+		if(old != HOLE_REF){
+			block_release(ctx, old);
+			unshared++;
+		}
+		file->blocks[i] = fresh;
+		block_map_note(file, i);
+	}
+	pthread_mutex_unlock(&ctx->fat_lock);
+	stats_add(STATS_COW_BLOCKS, unshared);
+	return to;
+}
+
+/// @brief how many blocks the packed index of a compressed file takes
+/// @param count blocks of the file the index covers
+/// @return 
+size_t packed_index_blocks(size_t count){
+	// the block count, then where each block starts, then where the last one ends
+	return ((count + 2) * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/// @brief check the extents of a packed index
+/// @param extents count + 1 entries
+/// @param count blocks the extents cover
+/// @param limit bytes the packed blocks hold
+/// @return the first block whose extent is not valid, count if there is none
+size_t packed_check(const uint32_t* extents, size_t count, size_t limit){
+	if(extents[0] != 0){
+		return 0;
+	}
+	for(size_t i = 0; i < count; i++){
+		if(extents[i + 1] < extents[i] || extents[i + 1] - extents[i] > BLOCK_SIZE || extents[i + 1] > limit){
+			return i;
+		}
+	}
+	return count;
+}
+
+/// @brief read the packed index of a compressed file once its chain is walked. The blocks
+/// from the first one the index gets wrong read as zeros, fs_fsck tells which
+/// @param file 
+/// @return -1 if the index cannot be read
+int packed_load(struct fs_ctx* ctx, struct open_file* file){
+	const size_t per_block = BLOCK_SIZE / sizeof(uint32_t);
+	uint32_t words[BLOCK_SIZE / sizeof(uint32_t)];
+	size_t count = 0;
+	if(file->nblocks > 0){
+		if(cache_read(ctx->block_cache, ctx->first_block.Data_Start + file->blocks[0], words) == -1){
+			return -1;
+		}
+		count = words[0];
+	}
+	size_t index_blocks = packed_index_blocks(count);
+	if(file->nblocks == 0 || index_blocks > file->nblocks){
+		count = 0;
+		index_blocks = file->nblocks;
+	}
+	file->extents = calloc(count + 1, sizeof(uint32_t));
+	if(file->extents == NULL){
+		return -1;
+	}
+	for(size_t i = 0; count > 0 && i <= count; i++){
+		size_t word = i + 1;
+		if(word % per_block == 0
+		   && cache_read(ctx->block_cache, ctx->first_block.Data_Start + file->blocks[word / per_block], words) == -1){
+			free(file->extents);
+			file->extents = NULL;
+			return -1;
+		}
+		file->extents[i] = words[word % per_block];
+	}
+	size_t good = packed_check(file->extents, count, (file->nblocks - index_blocks) * BLOCK_SIZE);
+	for(size_t i = good + 1; i <= count; i++){
+		file->extents[i] = file->extents[good];
+	}
+	file->packed_count = count;
+	file->index_blocks = index_blocks;
+	return 0;
+}
+
+/// @brief find the open file state of a root entry, building it on first open
+/// @param root 
+/// @return NULL if the block map cannot be built
+struct open_file* open_file_get(struct fs_ctx* ctx, struct root_nodes* root){
+	struct open_file* free_slot = NULL;
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+		if(ctx->open_files[i].refs > 0 && ctx->open_files[i].root == root){
+			ctx->open_files[i].refs++;
+			return &ctx->open_files[i];
+		}
+		if(ctx->open_files[i].refs == 0 && free_slot == NULL){
+			free_slot = &ctx->open_files[i];
+		}
+	}
+	if(free_slot == NULL){
+		return NULL;
+	}
+	// walk the chain once, every later lookup goes through the map
+	free_slot->root = root;
+	free_slot->blocks = NULL;
+	free_slot->nblocks = 0;
+	free_slot->capacity = 0;
+	free_slot->reserve_len = 0;
+	free_slot->last_growth = 0;
+	free_slot->hole_map = NULL;
+	free_slot->hole_map_dirty = 0;
+	free_slot->map_count = 0;
+	free_slot->map_dirty = 0;
+	free_slot->extents = NULL;
+	free_slot->packed_count = 0;
+	free_slot->index_blocks = 0;
+	if(root->flags & ROOT_MAPPED){
+		// the block map is on disk already
+		if(block_map_load(ctx, free_slot) == -1){
+			free(free_slot->blocks);
+			return NULL;
+		}
+		pthread_rwlock_init(&free_slot->lock, NULL);
+		free_slot->refs = 1;
+		return free_slot;
+	}
+	int compressed = root->flags & ROOT_COMPRESSED;
+	if(root->hole_map != 0 && !compressed){
+		free_slot->hole_map = malloc(BLOCK_SIZE);
+		if(free_slot->hole_map == NULL
+		   || cache_read(ctx->block_cache, ctx->first_block.Data_Start + root->hole_map, free_slot->hole_map) == -1){
+			free(free_slot->hole_map);
+			return NULL;
+		}
+	}
+	size_t hops = 0;
+	pthread_mutex_lock(&ctx->fat_lock);
+	uint16_t fat = root->index;
+	// the chain only holds the allocated blocks, the hole map tells where they go
+	while(fat != FAT_E0C && (free_slot->hole_map == NULL || free_slot->nblocks < FILE_BLOCKS_MAX)){
+		uint16_t entry = HOLE_REF;
+		if(!is_hole_bit(free_slot, free_slot->nblocks)){
+			entry = fat;
+			fat = ctx->fat_representation[fat];
+			hops++;
+		}
+		if(block_map_append(free_slot, entry) == -1){
+			pthread_mutex_unlock(&ctx->fat_lock);
+			free(free_slot->blocks);
+			free(free_slot->hole_map);
+			return NULL;
+		}
+	}
+	pthread_mutex_unlock(&ctx->fat_lock);
+	stats_add(STATS_FAT_HOPS, hops);
+	if(compressed && packed_load(ctx, free_slot) == -1){
+		free(free_slot->blocks);
+		return NULL;
+	}
+	pthread_rwlock_init(&free_slot->lock, NULL);
+	free_slot->refs = 1;
+	return free_slot;
+}
+
+/// @brief drop a reference to an open file, freeing its block map on the last one
+/// @param file 
+void open_file_put(struct fs_ctx* ctx, struct open_file* file){
+	if(--file->refs > 0){
+		return;
+	}
+	pthread_mutex_lock(&ctx->fat_lock);
+	release_reservation(ctx, file);
+	pthread_mutex_unlock(&ctx->fat_lock);
+	pthread_rwlock_destroy(&file->lock);
+	free(file->hole_map);
+	file->hole_map = NULL;
+	free(file->extents);
+	file->extents = NULL;
+	free(file->blocks);
+	file->blocks = NULL;
+	file->nblocks = 0;
+	file->capacity = 0;
+	file->map_count = 0;
+	file->root = EMPTY_REF;
+}
+
+/// @brief open a file, called with table_lock held
+/// @param filename 
+/// @return the new fd, -1 on failure
+int open_locked(struct fs_ctx* ctx, const char *filename) {
+	// not mounted
+	if(ctx->first_block.Signature == 0){
+		return -1;
+	}
+	// file name invalid
+	if(name_validation(filename) == -1){
+		return -1;
+	}
+	// check where does this filename exist in our root
+	int found_root = name_lookup(ctx, filename); // where is the root element
+	// the filename does not exist in the root
+	if(found_root == -1){
+		return -1;
+	}
+	int found_fd = -1;
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+		if(ctx->file_descriptors[i].root == EMPTY_REF){
+			struct open_file* file = open_file_get(ctx, &ctx->root_dir[found_root]);
+			if(file == NULL){
+				return -1;
+			}
+			found_fd = i;
+			ctx->file_descriptors[i].root = &ctx->root_dir[found_root];
+			ctx->file_descriptors[i].file = file;
+			ctx->file_descriptors[i].offset = 0;
+			ctx->file_descriptors[i].ra_next = 0;
+			ctx->file_descriptors[i].ra_window = 0;
+			ctx->file_descriptors[i].ra_buf = NULL;
+			ctx->file_descriptors[i].ra_count = 0;
+			break;
+		}
+	}
+	// return -1 if we dont have a single fd that is available
+	// return the fd that is assigned if we can find a fd available
+	return found_fd;
+}
+
+/// @brief fs_open_ctx without the tracing
+int open_untraced(struct fs_ctx* ctx, const char *filename) {
+	pthread_mutex_lock(&ctx->table_lock);
+	int ret = open_locked(ctx, filename);
+	pthread_mutex_unlock(&ctx->table_lock);
+	return ret;
+}
+
+int fs_open_ctx(struct fs_ctx *ctx, const char *filename) {
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = open_untraced(ctx, filename);
+	trace_end(start, FS_TRACE_OPEN, ctx->trace_id, -1, 0, ret, filename);
+	return ret;
+}
+
+int fs_open(const char *filename) {
+	return fs_open_ctx(&default_ctx, filename);
+}
+
+/// @brief checks for 3 things. 1: not mounted 2: oob 3: not open, called with table_lock held
+/// @param fd 
+/// @return 
+int fd_validation(struct fs_ctx* ctx, int fd){
+	if(ctx->first_block.Signature == 0){
+		return -1;
+	}
+	// out of bounds
+	if(fd < 0 || fd > FS_OPEN_MAX_COUNT - 1){
+		return -1;
+	}
+	if(ctx->file_descriptors[fd].root == EMPTY_REF){
+		return -1;
+	}
+	return 0;
+}
+/// @brief look up the open file behind an fd and take its lock
+/// @param fd 
+/// @param write 1 to take the lock for writing, 0 for reading
+/// @return NULL if the fd is invalid
+struct fd* fd_acquire(struct fs_ctx* ctx, int fd, int write){
+	pthread_mutex_lock(&ctx->table_lock);
+	if(fd_validation(ctx, fd) == -1){
+		pthread_mutex_unlock(&ctx->table_lock);
+		return NULL;
+	}
+	struct fd* this_file = &ctx->file_descriptors[fd];
+	pthread_mutex_unlock(&ctx->table_lock);
+	// the fd holds a reference, the open file stays put until it is closed
+	if(write){
+		pthread_rwlock_wrlock(&this_file->file->lock);
+	}
+	else{
+		pthread_rwlock_rdlock(&this_file->file->lock);
+	}
+	return this_file;
+}
+
+/// @brief release the lock taken by fd_acquire
+/// @param this_file 
+void fd_release(struct fd* this_file){
+	pthread_rwlock_unlock(&this_file->file->lock);
+}
+
+/// @brief fs_close_ctx without the tracing
+int close_untraced(struct fs_ctx* ctx, int fd){
+	pthread_mutex_lock(&ctx->table_lock);
+	// not mounted
+	if(fd_validation(ctx, fd) == -1){
+		pthread_mutex_unlock(&ctx->table_lock);
+		return -1;
+	}
+	// clear out the reference and the offset
+	open_file_put(ctx, ctx->file_descriptors[fd].file);
+	ctx->file_descriptors[fd].root = EMPTY_REF;
+	ctx->file_descriptors[fd].file = EMPTY_REF;
+	ctx->file_descriptors[fd].offset = 0;
+	free(ctx->file_descriptors[fd].ra_buf);
+	ctx->file_descriptors[fd].ra_buf = NULL;
+	pthread_mutex_unlock(&ctx->table_lock);
+	return 0;
+}
+
+int fs_close_ctx(struct fs_ctx *ctx, int fd){
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = close_untraced(ctx, fd);
+	trace_end(start, FS_TRACE_CLOSE, ctx->trace_id, fd, 0, ret, NULL);
+	return ret;
+}
+
+int fs_close(int fd){
+	return fs_close_ctx(&default_ctx, fd);
+}
+
+/// @brief fs_stat_ctx without the tracing
+int stat_untraced(struct fs_ctx* ctx, int fd) {
+	struct fd* this_file = fd_acquire(ctx, fd, 0);
+	if(this_file == NULL){
+		return -1;
+	}
+	int size = this_file->root->file_size;
+	fd_release(this_file);
+	return size;
+}
+
+int fs_stat_ctx(struct fs_ctx *ctx, int fd) {
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = stat_untraced(ctx, fd);
+	trace_end(start, FS_TRACE_STAT, ctx->trace_id, fd, 0, ret, NULL);
+	return ret;
+}
+
+int fs_stat(int fd) {
+	return fs_stat_ctx(&default_ctx, fd);
+}
+
+/// @brief fs_lseek_ctx without the tracing
+int lseek_untraced(struct fs_ctx* ctx, int fd, size_t offset){
+	struct fd* this_file = fd_acquire(ctx, fd, 0);
+	if(this_file == NULL){
+		return -1;
+	}
+	fd_release(this_file);
+	// offset too large: seeking past the end is fine, the gap becomes a hole
+	if(offset > FS_FILE_SIZE_MAX){
+		return -1;
+	}
+	this_file->offset = offset;
+	return 0;
+}
+
+int fs_lseek_ctx(struct fs_ctx *ctx, int fd, size_t offset){
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = lseek_untraced(ctx, fd, offset);
+	trace_end(start, FS_TRACE_LSEEK, ctx->trace_id, fd, offset, ret, NULL);
+	return ret;
+}
+
+int fs_lseek(int fd, size_t offset){
+	return fs_lseek_ctx(&default_ctx, fd, offset);
+}
+
+/// @brief find free blocks for a reservation, preferring a single run that holds the whole
+/// pending write over continuing the file where it ends
+/// @param hint where the file would continue
+/// @param want blocks wanted
+/// @param needed blocks the pending write needs
+/// @param len filled with the length of the run found
+/// @return first block of the run, -1 if no block is free
+long reserve_search(struct fs_ctx* ctx, size_t hint, size_t want, size_t needed, size_t* len){
+	long start = freemap_find_run(ctx->free_blocks, hint, want, len);
+	if(start != -1 && *len < needed){
+		// the run right after the file is too short, look past it for a longer one
+		size_t other_len;
+		long other = freemap_find_run(ctx->free_blocks, start + *len, want, &other_len);
+		if(other != -1 && other_len > *len){
+			*len = other_len;
+			return other;
+		}
+	}
+	return start;
+}
+
+/// @brief set aside a contiguous run of free blocks for a growing file, called with fat_lock held
+/// @param file 
+/// @param needed how many blocks the pending write still needs
+/// @return -1 if the disk is full
+int reserve_blocks(struct fs_ctx* ctx, struct open_file* file, size_t needed){
+	// cover the pending write, and at least twice what the file grew by last time
+	size_t want = file->last_growth * 2;
+	if(want > RESERVE_MAX){
+		want = RESERVE_MAX;
+	}
+	if(want < needed){
+		want = needed;
+	}
+	// try to continue right after the current last block
+	size_t hint = 0;
+	uint16_t last = allocated_before(file, file->nblocks);
+	if(last != FAT_E0C){
+		hint = last + 1;
+	}
+	size_t len;
+	size_t scanned = freemap_scanned(ctx->free_blocks);
+	long start = reserve_search(ctx, hint, want, needed, &len);
+	if(start == -1){
+		release_all_reservations(ctx);
+		start = reserve_search(ctx, hint, want, needed, &len);
+	}
+	stats_add(STATS_ALLOC_SEARCHES, 1);
+	stats_add(STATS_ALLOC_SCANNED, freemap_scanned(ctx->free_blocks) - scanned);
+	if(start == -1){
+		return -1;
+	}
+	for(size_t i = 0; i < len; i++){
+		freemap_set_used(ctx->free_blocks, start + i);
+	}
+	file->reserve_start = start;
+	file->reserve_len = len;
+	file->last_growth = len;
+	return 0;
+}
+
+/// @brief allocate the holes of a range of blocks of a file and link them into the chain,
+/// called with fat_lock held
+/// @param file 
+/// @param from first block, in file order
+/// @param to end of the range, at most the length of the block map
+/// @return the first block left a hole, to if every hole was filled
+size_t fill_holes(struct fs_ctx* ctx, struct open_file* file, size_t from, size_t to){
+	int mapped = file->root->flags & ROOT_MAPPED;
+	if(file->hole_map == NULL && !mapped){
+		return to;
+	}
+	size_t i = from;
+	while(i < to){
+		size_t holes = hole_run(file, i, to - i);
+		if(holes == 0){
+			i++;
+			continue;
+		}
+		// the chain runs from the last allocated block before the hole to the first one after
+		uint16_t prev = allocated_before(file, i);
+		uint16_t next = prev == FAT_E0C ? file->root->index : ctx->fat_representation[prev];
+		size_t len;
+		size_t scanned = freemap_scanned(ctx->free_blocks);
+		long start = freemap_find_run(ctx->free_blocks, prev == FAT_E0C ? 0 : prev + 1, holes, &len);
+		if(start == -1){
+			release_all_reservations(ctx);
+			start = freemap_find_run(ctx->free_blocks, prev == FAT_E0C ? 0 : prev + 1, holes, &len);
+		}
+		stats_add(STATS_ALLOC_SEARCHES, 1);
+		stats_add(STATS_ALLOC_SCANNED, freemap_scanned(ctx->free_blocks) - scanned);
+		if(start == -1){
+			// no more blocks available
+			return i;
+		}
+		for(size_t k = 0; k < len; k++){
+			uint16_t new_fat = start + k;
+			if(mapped){
+				fat_set(ctx, new_fat, FAT_E0C);
+				ctx->block_refs[new_fat] = 1;
+				block_map_note(file, i + k);
+				file->blocks[i + k] = new_fat;
+				continue;
+			}
+			fat_set(ctx, new_fat, next);
+			if(prev == FAT_E0C){
+				file->root->index = new_fat;
+			}
+			else{
+				fat_set(ctx, prev, new_fat);
+			}
+			prev = new_fat;
+			file->blocks[i + k] = new_fat;
+			hole_map_fill(file, i + k);
+		}
+		i += len;
+	}
+	return to;
+}
+
+/// @brief make sure a range of blocks of a file is allocated: holes in it are filled, blocks
+/// past the end of the chain are added, and the blocks skipped to reach the range become holes
+/// @param file 
+/// @param from first block of the range, in file order
+/// @param blocks end of the range
+/// @return the first block of the range left unallocated, blocks if there is none,
+/// less than asked if the disk is full
+size_t extend_chain(struct fs_ctx* ctx, struct open_file* file, size_t from, size_t blocks){
+	int mapped = file->root->flags & ROOT_MAPPED;
+	if(file->hole_map == NULL && !mapped && file->nblocks >= blocks){
+		return blocks;
+	}
+	pthread_mutex_lock(&ctx->fat_lock);
+	if(from > file->nblocks){
+		// writing past the end, leave a hole in between
+		if(from >= FILE_BLOCKS_MAX || make_sparse(ctx, file) == -1 || (mapped && block_map_grow(ctx, file, from) == -1)){
+			pthread_mutex_unlock(&ctx->fat_lock);
+			return from;
+		}
+		while(file->nblocks < from){
+			if(block_map_append(file, HOLE_REF) == -1){
+				pthread_mutex_unlock(&ctx->fat_lock);
+				return from;
+			}
+		}
+	}
+	if((file->hole_map != NULL || mapped) && blocks > FILE_BLOCKS_MAX){
+		// the hole map has no room for more
+		blocks = FILE_BLOCKS_MAX;
+	}
+	if(mapped && block_map_grow(ctx, file, blocks) == -1){
+		// no block left for the map, stop where it ends
+		blocks = file->map_count * MAP_ENTRIES;
+	}
+	size_t inside = blocks < file->nblocks ? blocks : file->nblocks;
+	size_t filled = fill_holes(ctx, file, from, inside);
+	if(filled < inside){
+		pthread_mutex_unlock(&ctx->fat_lock);
+		return filled;
+	}
+	uint16_t tail = allocated_before(file, file->nblocks);
+	while(file->nblocks < blocks){
+		if(file->reserve_len == 0 && reserve_blocks(ctx, file, blocks - file->nblocks) == -1){
+			// no more blocks available
+			break;
+		}
+		uint16_t new_fat = file->reserve_start;
+		if(block_map_append(file, new_fat) == -1){
+			break;
+		}
+		file->reserve_start++;
+		file->reserve_len--;
+		fat_set(ctx, new_fat, FAT_E0C);
+		if(mapped){
+			ctx->block_refs[new_fat] = 1;
+			block_map_note(file, file->nblocks - 1);
+		}
+		else if(tail == FAT_E0C){
+			file->root->index = new_fat;
+		}
+		else{
+			fat_set(ctx, tail, new_fat);
+		}
+		tail = new_fat;
+		hole_map_fill(file, file->nblocks - 1);
+	}
+	pthread_mutex_unlock(&ctx->fat_lock);
+	return file->nblocks > from ? file->nblocks : from;
+}
+
+/// @brief cut the chain of a file down to its first blocks and free the others,
+/// called with fat_lock held
+/// @param file 
+/// @param keep how many blocks stay, in file order
+void truncate_chain(struct fs_ctx* ctx, struct open_file* file, size_t keep){
+	if(keep >= file->nblocks){
+		return;
+	}
+	release_reservation(ctx, file);
+	file->last_growth = 0;
+	for(size_t i = keep; i < file->nblocks; i++){
+		if(file->blocks[i] != HOLE_REF){
+			block_release(ctx, file->blocks[i]);
+		}
+		hole_map_clear(file, i);
+		block_map_note(file, i);
+	}
+	if(file->root->flags & ROOT_MAPPED){
+		file->nblocks = keep;
+		block_map_trim(ctx, file);
+		return;
+	}
+	uint16_t last = allocated_before(file, keep);
+	if(last == FAT_E0C){
+		file->root->index = FAT_E0C;
+	}
+	else{
+		fat_set(ctx, last, FAT_E0C);
+	}
+	file->nblocks = keep;
+}
+
+/// @brief count how many blocks of a file are laid out back to back on disk
+/// @param file 
+/// @param block_index first block of the run, in file order, not a hole
+/// @param max_blocks never count more than this
+/// @return length of the run, at least 1
+size_t find_run(struct open_file* file, size_t block_index, size_t max_blocks){
+	size_t run = 1;
+	uint16_t* blocks = file->blocks + block_index;
+	while(run < max_blocks && run < RUN_MAX && block_index + run < file->nblocks && blocks[run] == blocks[0] + run){
+		run++;
+	}
+	return run;
+}
+
+/// @brief overwrite the allocated blocks of a range of a file with zeros
+/// @param file 
+/// @param from first block, in file order
+/// @param to end of the range, at most the length of the block map
+/// @return -1 if the blocks cannot be written
+int zero_blocks(struct fs_ctx* ctx, struct open_file* file, size_t from, size_t to){
+	static char zeros[BLOCK_SIZE];
+	void* bufs[RUN_MAX];
+	for(size_t i = 0; i < RUN_MAX; i++){
+		bufs[i] = zeros;
+	}
+	// nothing of a shared block is kept, a fresh one is enough
+	if(unshare_blocks(ctx, file, from, to, 0) < to){
+		return -1;
+	}
+	while(from < to){
+		if(is_hole(file, from)){
+			from++;
+			continue;
+		}
+		size_t run = find_run(file, from, to - from);
+		if(cache_write_multi(ctx->block_cache, file->blocks[from] + ctx->first_block.Data_Start, run, bufs) == -1){
+			return -1;
+		}
+		from += run;
+	}
+	return 0;
+}
+
+/// @brief point each block of a run straight at the caller's buffer, except for
+/// a partial first or last block which goes through a bounce block
+/// @param bufs filled with one pointer per block
+/// @param run number of blocks in the run
+/// @param user caller's data for this run
+/// @param block_offset where the data starts in the first block
+/// @param chunk how many bytes of the run are covered
+/// @param head bounce block for a partial first block
+/// @param tail bounce block for a partial last block
+void run_buffers(void** bufs, size_t run, char* user, size_t block_offset, size_t chunk, char* head, char* tail){
+	int partial_head = block_offset != 0;
+	int partial_tail = (block_offset + chunk) % BLOCK_SIZE != 0;
+	for(size_t i = 0; i < run; i++){
+		if(i == 0 && partial_head){
+			bufs[i] = head;
+		}
+		else if(i == run - 1 && partial_tail){
+			bufs[i] = tail;
+		}
+		else{
+			bufs[i] = user + i * BLOCK_SIZE - block_offset;
+		}
+	}
+}
+
+/// @brief load the current content of a block that is about to be partially overwritten
+/// @param bounce 
+/// @param real_block 
+/// @param block_pos position of the block in the file
+/// @param file_size 
+void fill_bounce(struct fs_ctx* ctx, char* bounce, size_t real_block, size_t block_pos, size_t file_size){
+	if(block_pos < file_size){
+		stats_add(STATS_RMW_CYCLES, 1);
+		cache_read(ctx->block_cache, real_block, bounce);
+		// whatever lies past the end must read as zeros once the file grows over it
+		if(file_size - block_pos < BLOCK_SIZE){
+			memset(bounce + (file_size - block_pos), 0, BLOCK_SIZE - (file_size - block_pos));
+		}
+	}
+	else{
+		// past the end of the file, nothing to keep
+		memset(bounce, 0, BLOCK_SIZE);
+	}
+}
+
+/// @brief decompress blocks of a compressed file, reading each packed block they need once
+/// @param file 
+/// @param block_index first block, in file order
+/// @param blocks how many
+/// @param dst room for that many blocks
+/// @return -1 if the packed blocks cannot be read or do not decompress
+int unpack_blocks(struct fs_ctx* ctx, struct open_file* file, size_t block_index, size_t blocks, char* dst){
+	char packed[UNPACK_MAX * BLOCK_SIZE];
+	void* bufs[UNPACK_MAX];
+	struct block_req reqs[UNPACK_MAX];
+	const uint32_t* extents = file->extents;
+	size_t done = 0;
+	while(done < blocks){
+		size_t first = block_index + done;
+		if(first >= file->packed_count){
+			// past what the index covers is zeros
+			memset(dst + done * BLOCK_SIZE, 0, (blocks - done) * BLOCK_SIZE);
+			return 0;
+		}
+		// as many blocks as the buffer has room for the packed blocks of, at least one
+		size_t start = extents[first] / BLOCK_SIZE;
+		size_t end = first + 1;
+		while(end < block_index + blocks && end < file->packed_count
+		      && (extents[end + 1] + BLOCK_SIZE - 1) / BLOCK_SIZE - start <= UNPACK_MAX){
+			end++;
+		}
+		size_t span = (extents[end] + BLOCK_SIZE - 1) / BLOCK_SIZE - start;
+		const char* base = packed;
+		size_t nreqs = 0;
+		if(span > 0 && find_run(file, file->index_blocks + start, span) == span){
+			// memory-mapped disk, decompress straight out of the mapping
+			const char* direct = cache_direct(ctx->block_cache, file->blocks[file->index_blocks + start] + ctx->first_block.Data_Start, span);
+			if(direct != NULL){
+				base = direct;
+				span = 0;
+			}
+		}
+		for(size_t i = 0; i < span;){
+			size_t chain = file->index_blocks + start + i;
+			size_t run = find_run(file, chain, span - i);
+			for(size_t k = 0; k < run; k++){
+				bufs[i + k] = packed + (i + k) * BLOCK_SIZE;
+			}
+			reqs[nreqs].block = file->blocks[chain] + ctx->first_block.Data_Start;
+			reqs[nreqs].count = run;
+			reqs[nreqs].bufs = &bufs[i];
+			reqs[nreqs].write = 0;
+			nreqs++;
+			i += run;
+			if(nreqs == ctx->io_depth || i == span){
+				if(cache_submit(ctx->block_cache, reqs, nreqs) == -1){
+					return -1;
+				}
+				nreqs = 0;
+			}
+		}
+		size_t unpacked = 0;
+		for(size_t i = first; i < end; i++){
+			char* out = dst + (i - block_index) * BLOCK_SIZE;
+			const char* in = base + (extents[i] - start * BLOCK_SIZE);
+			size_t len = extents[i + 1] - extents[i];
+			if(len == 0){
+				// a block of zeros takes no room at all
+				memset(out, 0, BLOCK_SIZE);
+			}
+			else if(len == BLOCK_SIZE){
+				// it did not compress, it is kept as it is
+				memcpy(out, in, BLOCK_SIZE);
+			}
+			else if(lz_decompress(in, len, out, BLOCK_SIZE) != BLOCK_SIZE){
+				stats_add(STATS_UNPACKED_BLOCKS, unpacked);
+				return -1;
+			}
+			else{
+				unpacked++;
+			}
+		}
+		stats_add(STATS_UNPACKED_BLOCKS, unpacked);
+		done = end - block_index;
+	}
+	return 0;
+}
+
+/// @brief read from a compressed file, decompressing whole blocks straight into the caller's
+/// buffer and partial ones through a bounce block
+/// @param file 
+/// @param pos where the read starts
+/// @param buf 
+/// @param count never past the end of the file
+/// @return how many bytes were read
+size_t unpack_read(struct fs_ctx* ctx, struct open_file* file, size_t pos, char* buf, size_t count){
+	char bounce[BLOCK_SIZE];
+	size_t done = 0;
+	while(done < count){
+		size_t block_index = (pos + done) / BLOCK_SIZE;
+		size_t offset = (pos + done) % BLOCK_SIZE;
+		size_t whole = offset == 0 ? (count - done) / BLOCK_SIZE : 0;
+		if(whole > 0){
+			if(unpack_blocks(ctx, file, block_index, whole, buf + done) == -1){
+				break;
+			}
+			done += whole * BLOCK_SIZE;
+			continue;
+		}
+		size_t chunk = BLOCK_SIZE - offset < count - done ? BLOCK_SIZE - offset : count - done;
+		if(unpack_blocks(ctx, file, block_index, 1, bounce) == -1){
+			break;
+		}
+		memcpy(buf + done, bounce + offset, chunk);
+		done += chunk;
+	}
+	return done;
+}
+
+/// @brief give a compressed file blocks of its own again, decompressed, before it is modified,
+/// called with the file held for writing by every path that changes a file's blocks.
+/// Blocks of zeros become holes
+/// @param file 
+/// @return 0 right away if the file is not compressed, -1 if there are not enough free blocks
+/// or the packed blocks cannot be read, the file then stays compressed
+int expand_file(struct fs_ctx* ctx, struct open_file* file){
+	if(file->extents == NULL){
+		return 0;
+	}
+	struct root_nodes* root = file->root;
+	size_t size = root->file_size;
+	size_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	char* buf = malloc(RUN_MAX * BLOCK_SIZE);
+	if(buf == NULL){
+		return -1;
+	}
+	// the packed blocks are read through a copy of the compressed state while the file grows anew,
+	// refs and the lock are left out, they are not ours to read
+	struct open_file packed = {
+		.root = root,
+		.blocks = file->blocks,
+		.nblocks = file->nblocks,
+		.capacity = file->capacity,
+		.extents = file->extents,
+		.packed_count = file->packed_count,
+		.index_blocks = file->index_blocks,
+	};
+	uint16_t head = root->index;
+	file->blocks = NULL;
+	file->nblocks = 0;
+	file->capacity = 0;
+	file->extents = NULL;
+	file->packed_count = 0;
+	file->index_blocks = 0;
+	root->index = FAT_E0C;
+	root->flags &= ~ROOT_COMPRESSED;
+	file->generation++;
+	int ret = 0;
+	size_t i = 0;
+	while(ret == 0 && i < blocks){
+		if(i >= packed.packed_count || packed.extents[i + 1] == packed.extents[i]){
+			i++;
+			continue;
+		}
+		size_t end = i + 1;
+		while(end < blocks && end - i < RUN_MAX && end < packed.packed_count && packed.extents[end + 1] != packed.extents[end]){
+			end++;
+		}
+		if(extend_chain(ctx, file, i, end) < end || unpack_blocks(ctx, &packed, i, end - i, buf) == -1){
+			ret = -1;
+			break;
+		}
+		if(end * BLOCK_SIZE > size){
+			// whatever lies past the end must read as zeros once the file grows over it
+			memset(buf + (size - i * BLOCK_SIZE), 0, end * BLOCK_SIZE - size);
+		}
+		void* bufs[RUN_MAX];
+		for(size_t k = i; ret == 0 && k < end;){
+			size_t run = find_run(file, k, end - k);
+			for(size_t j = 0; j < run; j++){
+				bufs[j] = buf + (k - i + j) * BLOCK_SIZE;
+			}
+			ret = cache_write_multi(ctx->block_cache, ctx->first_block.Data_Start + file->blocks[k], run, bufs);
+			k += run;
+		}
+		i = end;
+	}
+	free(buf);
+	pthread_mutex_lock(&ctx->fat_lock);
+	if(ret == 0 && file->nblocks < blocks){
+		// extend_chain only left holes before the blocks it added, the blocks of zeros at the end
+		// are holes too, and only a hole map lets the chain stop short of the size
+		if(blocks > FILE_BLOCKS_MAX || make_sparse(ctx, file) == -1){
+			ret = -1;
+		}
+	}
+	if(ret == 0){
+		// the index and the packed blocks
+		clear_fat(ctx, head);
+	}
+	else{
+		truncate_chain(ctx, file, 0);
+		release_reservation(ctx, file);
+		if(root->hole_map != 0){
+			fat_set(ctx, root->hole_map, 0);
+			root->hole_map = 0;
+			free(file->hole_map);
+			file->hole_map = NULL;
+			file->hole_map_dirty = 0;
+		}
+		free(file->blocks);
+		file->blocks = packed.blocks;
+		file->nblocks = packed.nblocks;
+		file->capacity = packed.capacity;
+		file->extents = packed.extents;
+		file->packed_count = packed.packed_count;
+		file->index_blocks = packed.index_blocks;
+		root->index = head;
+		root->flags |= ROOT_COMPRESSED;
+	}
+	pthread_mutex_unlock(&ctx->fat_lock);
+	if(ret == 0){
+		hole_map_flush(ctx, file);
+		free(packed.blocks);
+		free(packed.extents);
+	}
+	return ret;
+}
+
+/// @brief leave a whole block of a mapped file unwritten, pointing the file at an indexed block
+/// with the same content instead, or at a hole if it only holds zeros, called with the file held
+/// for writing
+/// @param file 
+/// @param block_index in file order, a block of the file's own
+/// @param buf what is about to be written there
+/// @param hash fingerprint of buf
+/// @return 1 if the block needs no write, 0 if it does
+int dedup_block(struct fs_ctx* ctx, struct open_file* file, size_t block_index, const char* buf, uint64_t hash){
+	uint16_t target = HOLE_REF;
+	char block[BLOCK_SIZE];
+	pthread_mutex_lock(&ctx->fat_lock);
+	// a block of zeros is the same shifted by one byte
+	if(hash != ctx->zero_hash || buf[0] != 0 || memcmp(buf, buf + 1, BLOCK_SIZE - 1) != 0){
+		// an indexed block is dropped from the index before anything writes it again,
+		// so it cannot change between the comparison and taking the reference
+		long found = dedup_lookup(ctx->dedup, hash);
+		if(found == -1 || cache_read(ctx->block_cache, ctx->first_block.Data_Start + found, block) == -1
+		   || memcmp(block, buf, BLOCK_SIZE) != 0){
+			pthread_mutex_unlock(&ctx->fat_lock);
+			return 0;
+		}
+		target = found;
+		ctx->block_refs[target]++;
+	}
+	block_release(ctx, file->blocks[block_index]);
+	file->blocks[block_index] = target;
+	block_map_note(file, block_index);
+	pthread_mutex_unlock(&ctx->fat_lock);
+	stats_add(STATS_DEDUP_BLOCKS, 1);
+	return 1;
+}
+
+/// @brief fingerprint the whole blocks of a run about to be written, leaving the first one
+/// unwritten if dedup_block can, and cutting the run before any other that it probably can
+/// @param file 
+/// @param block_index first block of the run, in file order
+/// @param user data of the run, starting at block_offset in its first block
+/// @param block_offset 
+/// @param left bytes of data from user on
+/// @param run length of the run
+/// @param hashes filled with the fingerprint of each block of the run, 0 for partial blocks
+/// @return how many blocks of the run to write, 0 if the first block needs no write
+size_t dedup_run(struct fs_ctx* ctx, struct open_file* file, size_t block_index, const char* user,
+                 size_t block_offset, size_t left, size_t run, uint64_t* hashes){
+	for(size_t k = 0; k < run; k++){
+		hashes[k] = 0;
+		size_t pos = k == 0 ? 0 : k * BLOCK_SIZE - block_offset;
+		if((k == 0 && block_offset != 0) || pos + BLOCK_SIZE > left){
+			continue;
+		}
+		uint64_t hash = dedup_hash(user + pos);
+		if(k == 0){
+			if(dedup_block(ctx, file, block_index, user, hash)){
+				return 0;
+			}
+		}
+		else{
+			pthread_mutex_lock(&ctx->fat_lock);
+			int found = hash == ctx->zero_hash || dedup_lookup(ctx->dedup, hash) != -1;
+			pthread_mutex_unlock(&ctx->fat_lock);
+			if(found){
+				// it gets a run of its own next
+				return k;
+			}
+		}
+		hashes[k] = hash;
+	}
+	return run;
+}
+
+/// @brief write at the offset of an fd, called with the file held for writing
+/// @param this_file 
+/// @param buf 
+/// @param count 
+/// @return how many bytes were written
+int write_locked(struct fs_ctx* ctx, struct fd* this_file, void *buf, size_t count){
+	if(count == 0){
+		return 0;
+	}
+	struct open_file* file = this_file->file;
+	file->generation++;
+	struct root_nodes* root = this_file->root;
+	if(expand_file(ctx, file) == -1){
+		return 0;
+	}
+	// make sure the chain covers every block we are about to touch
+	size_t block_index = this_file->offset / BLOCK_SIZE;
+	size_t end_index = (this_file->offset + count - 1) / BLOCK_SIZE + 1;
+	// blocks that were holes have nothing worth reading back
+	size_t head_size = is_hole(file, block_index) ? 0 : root->file_size;
+	size_t tail_size = is_hole(file, end_index - 1) ? 0 : root->file_size;
+	if(this_file->offset > root->file_size){
+		// blocks preallocated past the end hold stale data, what lies before the offset must read as zeros
+		size_t first_past = (root->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if(zero_blocks(ctx, file, first_past, block_index < file->nblocks ? block_index : file->nblocks) == -1){
+			// the stale data would show once the file grows over it
+			block_map_flush(ctx, file);
+			return 0;
+		}
+	}
+	// whole blocks can only be shared once the file keeps a block map
+	int dedup = 0;
+	if(ctx->dedup != NULL){
+		pthread_mutex_lock(&ctx->fat_lock);
+		dedup = make_mapped(ctx, file) == 0;
+		pthread_mutex_unlock(&ctx->fat_lock);
+	}
+	// a mapped file first gets blocks of its own for its holes and for the blocks it shares
+	// with a clone, then the chain grows past its end
+	int how = UNSHARE_HOLES;
+	if(this_file->offset % BLOCK_SIZE != 0){
+		how |= UNSHARE_COPY_FIRST;
+	}
+	if((this_file->offset + count) % BLOCK_SIZE != 0){
+		how |= UNSHARE_COPY_LAST;
+	}
+	size_t own = unshare_blocks(ctx, file, block_index, end_index, how);
+	size_t have = own > block_index ? extend_chain(ctx, file, block_index, own) : block_index;
+	if(have > own){
+		have = own;
+	}
+	hole_map_flush(ctx, file);
+	block_map_flush(ctx, file);
+	if(have <= block_index){
+		// no space left at all
+		return 0;
+	}
+	if(have < end_index){
+		// disk is full, write as much as we can
+		count = have * BLOCK_SIZE - this_file->offset;
+		end_index = have;
+	}
+	// whole blocks go straight from the caller's buffer to the disk
+	char head[BLOCK_SIZE];
+	char tail[BLOCK_SIZE];
+	void* bufs[RUN_MAX];
+	// fingerprint of each whole block in bufs, indexed once written
+	uint64_t hashes[RUN_MAX];
+	struct block_req reqs[BATCH_MAX];
+	size_t block_offset = this_file->offset % BLOCK_SIZE;
+	size_t written = 0;
+	while(written < count){
+		// gather up to io_depth runs, RUN_MAX blocks in total, into one batch
+		size_t nreqs = 0;
+		size_t used = 0;
+		size_t batched = written;
+		while(batched < count && nreqs < ctx->io_depth && used < RUN_MAX){
+			size_t left = count - batched;
+			size_t needed = (block_offset + left + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			size_t run = find_run(file, block_index, needed < RUN_MAX - used ? needed : RUN_MAX - used);
+			char* user = (char*)buf + batched;
+			if(dedup){
+				run = dedup_run(ctx, file, block_index, user, block_offset, left, run, &hashes[used]);
+				if(run == 0){
+					batched += BLOCK_SIZE;
+					block_index++;
+					continue;
+				}
+			}
+			size_t chunk = run * BLOCK_SIZE - block_offset;
+			if(chunk > left){
+				chunk = left;
+			}
+			void** run_bufs = &bufs[used];
+			// real block number of the start of the run
+			size_t real_block = file->blocks[block_index] + ctx->first_block.Data_Start;
+			// position in the file of the start of the run
+			size_t block_pos = block_index * BLOCK_SIZE;
+			run_buffers(run_bufs, run, user, block_offset, chunk, head, tail);
+			// partial first and last blocks keep whatever the file had there
+			if(run_bufs[0] == head){
+				size_t head_bytes = BLOCK_SIZE - block_offset < chunk ? BLOCK_SIZE - block_offset : chunk;
+				fill_bounce(ctx, head, real_block, block_pos, head_size);
+				memcpy(head + block_offset, user, head_bytes);
+			}
+			if(run_bufs[run - 1] == tail){
+				size_t tail_bytes = (block_offset + chunk) % BLOCK_SIZE;
+				size_t last = run - 1;
+				fill_bounce(ctx, tail, real_block + last, block_pos + last * BLOCK_SIZE, tail_size);
+				memcpy(tail, user + chunk - tail_bytes, tail_bytes);
+			}
+			reqs[nreqs].block = real_block;
+			reqs[nreqs].count = run;
+			reqs[nreqs].bufs = run_bufs;
+			reqs[nreqs].write = 1;
+			nreqs++;
+			used += run;
+			batched += chunk;
+			block_index += run;
+			block_offset = 0;
+		}
+		if(cache_submit(ctx->block_cache, reqs, nreqs) == -1){
+			break;
+		}
+		written = batched;
+		if(dedup){
+			// only now that they hold it can other writes share these blocks
+			pthread_mutex_lock(&ctx->fat_lock);
+			for(size_t r = 0; r < nreqs; r++){
+				for(size_t k = 0; k < reqs[r].count; k++){
+					uint64_t hash = hashes[reqs[r].bufs - bufs + k];
+					if(hash != 0){
+						dedup_insert(ctx->dedup, hash, reqs[r].block - ctx->first_block.Data_Start + k);
+					}
+				}
+			}
+			pthread_mutex_unlock(&ctx->fat_lock);
+		}
+	}
+	if(dedup){
+		block_map_flush(ctx, file);
+	}
+	if(this_file->offset + written > root->file_size){
+		root->file_size = this_file->offset + written;
+	}
+	this_file->offset += written;
+	return written;
+}
+
+/// @brief read blocks of a file into the readahead buffer of an fd
+/// @param this_file 
+/// @param block_index first block, in file order
+/// @param blocks how many blocks, at most readahead_limit
+/// @return -1 if the blocks cannot be read
+int readahead_fill(struct fs_ctx* ctx, struct fd* this_file, size_t block_index, size_t blocks){
+	struct open_file* file = this_file->file;
+	if(this_file->ra_buf == NULL){
+		this_file->ra_buf = malloc(ctx->readahead_limit * BLOCK_SIZE);
+		if(this_file->ra_buf == NULL){
+			return -1;
+		}
+	}
+	this_file->ra_count = 0;
+	void* bufs[RUN_MAX];
+	struct block_req reqs[BATCH_MAX];
+	size_t filled = 0;
+	if(file->extents != NULL){
+		// a compressed file is prefetched decompressed
+		if(unpack_blocks(ctx, file, block_index, blocks, this_file->ra_buf) == -1){
+			return -1;
+		}
+		filled = blocks;
+	}
+	while(filled < blocks){
+		size_t nreqs = 0;
+		size_t used = 0;
+		while(filled < blocks && nreqs < ctx->io_depth && used < RUN_MAX){
+			size_t left = blocks - filled;
+			if(is_hole(file, block_index + filled)){
+				size_t holes = hole_run(file, block_index + filled, left);
+				memset(this_file->ra_buf + filled * BLOCK_SIZE, 0, holes * BLOCK_SIZE);
+				filled += holes;
+				continue;
+			}
+			size_t run = find_run(file, block_index + filled, left < RUN_MAX - used ? left : RUN_MAX - used);
+			for(size_t i = 0; i < run; i++){
+				bufs[used + i] = this_file->ra_buf + (filled + i) * BLOCK_SIZE;
+			}
+			reqs[nreqs].block = file->blocks[block_index + filled] + ctx->first_block.Data_Start;
+			reqs[nreqs].count = run;
+			reqs[nreqs].bufs = &bufs[used];
+			reqs[nreqs].write = 0;
+			nreqs++;
+			used += run;
+			filled += run;
+		}
+		if(cache_submit(ctx->block_cache, reqs, nreqs) == -1){
+			return -1;
+		}
+	}
+	this_file->ra_start = block_index;
+	this_file->ra_count = blocks;
+	this_file->ra_generation = file->generation;
+	return 0;
+}
+
+/// @brief serve a sequential read from the readahead buffer, prefetching a growing
+/// window of blocks whenever it runs dry
+/// @param this_file 
+/// @param buf 
+/// @param count never past the end of the file
+/// @return how many bytes were copied, the rest is left to the regular path
+size_t readahead_read(struct fs_ctx* ctx, struct fd* this_file, char* buf, size_t count){
+	size_t file_blocks = (this_file->root->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if(this_file->ra_generation != this_file->file->generation){
+		// the file was written since the buffer was filled
+		this_file->ra_count = 0;
+	}
+	size_t done = 0;
+	while(done < count){
+		size_t pos = this_file->offset + done;
+		size_t block_index = pos / BLOCK_SIZE;
+		if(block_index < this_file->ra_start || block_index >= this_file->ra_start + this_file->ra_count){
+			size_t needed = (pos % BLOCK_SIZE + count - done + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			if(needed >= ctx->readahead_limit){
+				// large reads go straight to the caller's buffer
+				break;
+			}
+			size_t window = this_file->ra_window ? this_file->ra_window * 2 : READAHEAD_MIN;
+			if(window > ctx->readahead_limit){
+				window = ctx->readahead_limit;
+			}
+			if(window < needed){
+				window = needed;
+			}
+			if(window > file_blocks - block_index){
+				window = file_blocks - block_index;
+			}
+			if(readahead_fill(ctx, this_file, block_index, window) == -1){
+				break;
+			}
+			this_file->ra_window = window;
+		}
+		size_t buffered = (this_file->ra_start + this_file->ra_count) * BLOCK_SIZE - pos;
+		size_t copy = count - done < buffered ? count - done : buffered;
+		memcpy(buf + done, this_file->ra_buf + (pos - this_file->ra_start * BLOCK_SIZE), copy);
+		done += copy;
+	}
+	return done;
+}
+
+/// @brief read from the offset of an fd, called with the file held for reading
+/// @param this_file 
+/// @param buf 
+/// @param count 
+/// @return how many bytes were read
+int read_locked(struct fs_ctx* ctx, struct fd* this_file, void *buf, size_t count){
+	struct open_file* file = this_file->file;
+	size_t file_size = this_file->root->file_size;
+	if(this_file->offset >= file_size){
+		// offset points to the end of the file
+		return 0;
+	}
+	// never read past the end of the file
+	if(count > file_size - this_file->offset){
+		count = file_size - this_file->offset;
+	}
+	size_t total_read = 0;
+	if(ctx->readahead_limit > 0){
+		if(this_file->offset == this_file->ra_next){
+			total_read = readahead_read(ctx, this_file, buf, count);
+		}
+		else{
+			// random access, stop prefetching
+			this_file->ra_window = 0;
+			this_file->ra_count = 0;
+		}
+	}
+	if(file->extents != NULL){
+		total_read += unpack_read(ctx, file, this_file->offset + total_read, (char*)buf + total_read, count - total_read);
+		this_file->offset += total_read;
+		this_file->ra_next = this_file->offset;
+		return total_read;
+	}
+	size_t block_index = (this_file->offset + total_read) / BLOCK_SIZE;
+	size_t offset_left = (this_file->offset + total_read) % BLOCK_SIZE;
+	// whole blocks go straight from the disk to the caller's buffer
+	char head[BLOCK_SIZE];
+	char tail[BLOCK_SIZE];
+	void* bufs[RUN_MAX];
+	struct block_req reqs[BATCH_MAX];
+	while(total_read < count){
+		// gather up to io_depth runs, RUN_MAX blocks in total, into one batch
+		size_t nreqs = 0;
+		size_t used = 0;
+		size_t batched = total_read;
+		// where the bounce blocks go once the batch is done
+		char* head_dst = NULL;
+		size_t head_off = 0;
+		size_t head_bytes = 0;
+		char* tail_dst = NULL;
+		size_t tail_bytes = 0;
+		while(batched < count && nreqs < ctx->io_depth && used < RUN_MAX){
+			size_t left = count - batched;
+			size_t needed = (offset_left + left + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			char* user = (char*)buf + batched;
+			if(is_hole(file, block_index)){
+				// holes read as zeros, without going to the disk
+				size_t holes = hole_run(file, block_index, needed);
+				size_t chunk = holes * BLOCK_SIZE - offset_left;
+				if(chunk > left){
+					chunk = left;
+				}
+				memset(user, 0, chunk);
+				batched += chunk;
+				block_index += holes;
+				offset_left = 0;
+				continue;
+			}
+			size_t run = find_run(file, block_index, needed < RUN_MAX - used ? needed : RUN_MAX - used);
+			size_t chunk = run * BLOCK_SIZE - offset_left;
+			if(chunk > left){
+				chunk = left;
+			}
+			size_t real_block = file->blocks[block_index] + ctx->first_block.Data_Start;
+			const char* direct = cache_direct(ctx->block_cache, real_block, run);
+			if(direct != NULL){
+				// memory-mapped disk, copy straight out of the mapping
+				memcpy(user, direct + offset_left, chunk);
+			}
+			else{
+				void** run_bufs = &bufs[used];
+				run_buffers(run_bufs, run, user, offset_left, chunk, head, tail);
+				if(run_bufs[0] == head){
+					head_dst = user;
+					head_off = offset_left;
+					head_bytes = BLOCK_SIZE - offset_left < chunk ? BLOCK_SIZE - offset_left : chunk;
+				}
+				if(run_bufs[run - 1] == tail){
+					tail_bytes = (offset_left + chunk) % BLOCK_SIZE;
+					tail_dst = user + chunk - tail_bytes;
+				}
+				reqs[nreqs].block = real_block;
+				reqs[nreqs].count = run;
+				reqs[nreqs].bufs = run_bufs;
+				reqs[nreqs].write = 0;
+				nreqs++;
+				used += run;
+			}
+			batched += chunk;
+			block_index += run;
+			offset_left = 0;
+		}
+		if(nreqs > 0 && cache_submit(ctx->block_cache, reqs, nreqs) == -1){
+			break;
+		}
+		if(head_dst != NULL){
+			memcpy(head_dst, head + head_off, head_bytes);
+		}
+		if(tail_dst != NULL){
+			memcpy(tail_dst, tail, tail_bytes);
+		}
+		total_read = batched;
+	}
+	this_file->offset += total_read;
+	this_file->ra_next = this_file->offset;
+	return total_read;
+}
+
+/// @brief fs_write_ctx without the tracing
+int write_untraced(struct fs_ctx* ctx, int fd, void *buf, size_t count){
+	if(buf == NULL){
+		return -1;
+	}
+	struct fd* this_file = fd_acquire(ctx, fd, 1);
+	if(this_file == NULL){
+		return -1;
+	}
+	size_t old_size = this_file->root->file_size;
+	int written = write_locked(ctx, this_file, buf, count);
+	int grew = this_file->root->file_size != old_size;
+	fd_release(this_file);
+	stats_add(STATS_WRITE_OPS, 1);
+	stats_add(STATS_WRITE_BYTES, written);
+	if(grew && ctx->first_block.Journal_Blocks != 0){
+		pthread_mutex_lock(&ctx->table_lock);
+		journal_note_update(ctx);
+		pthread_mutex_unlock(&ctx->table_lock);
+	}
+	return written;
+}
+
+int fs_write_ctx(struct fs_ctx *ctx, int fd, void *buf, size_t count){
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = write_untraced(ctx, fd, buf, count);
+	trace_end(start, FS_TRACE_WRITE, ctx->trace_id, fd, count, ret, NULL);
+	return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count){
+	return fs_write_ctx(&default_ctx, fd, buf, count);
+}
+
+/// @brief fs_read_ctx without the tracing
+int read_untraced(struct fs_ctx* ctx, int fd, void *buf, size_t count){
+	if(buf == NULL){
+		return -1;
+	}
+	struct fd* this_file = fd_acquire(ctx, fd, 0);
+	if(this_file == NULL){
+		return -1;
+	}
+	int total_read = read_locked(ctx, this_file, buf, count);
+	fd_release(this_file);
+	stats_add(STATS_READ_OPS, 1);
+	stats_add(STATS_READ_BYTES, total_read);
+	return total_read;
+}
+
+int fs_read_ctx(struct fs_ctx *ctx, int fd, void *buf, size_t count){
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = read_untraced(ctx, fd, buf, count);
+	trace_end(start, FS_TRACE_READ, ctx->trace_id, fd, count, ret, NULL);
+	return ret;
+}
+
+int fs_read(int fd, void *buf, size_t count){
+	return fs_read_ctx(&default_ctx, fd, buf, count);
+}
+
+/// @brief fs_truncate_ctx without the tracing
+int truncate_untraced(struct fs_ctx* ctx, int fd, size_t size){
+	struct fd* this_file = fd_acquire(ctx, fd, 1);
+	if(this_file == NULL){
+		return -1;
+	}
+	struct open_file* file = this_file->file;
+	struct root_nodes* root = this_file->root;
+	// only shrinking, fs_fallocate grows files
+	if(size > root->file_size){
+		fd_release(this_file);
+		return -1;
+	}
+	if(expand_file(ctx, file) == -1){
+		fd_release(this_file);
+		return -1;
+	}
+	file->generation++;
+	size_t keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	// a last block shared with a clone needs a copy of its own before its end is cleared
+	if(size % BLOCK_SIZE != 0 && unshare_blocks(ctx, file, keep - 1, keep, UNSHARE_COPY_FIRST) < keep){
+		fd_release(this_file);
+		return -1;
+	}
+	pthread_mutex_lock(&ctx->fat_lock);
+	truncate_chain(ctx, file, keep);
+	pthread_mutex_unlock(&ctx->fat_lock);
+	hole_map_flush(ctx, file);
+	block_map_flush(ctx, file);
+	int ret = 0;
+	if(size % BLOCK_SIZE != 0 && !is_hole(file, keep - 1)){
+		// the cut off end of the last block must read as zeros once the file grows over it
+		char block[BLOCK_SIZE];
+		size_t real_block = file->blocks[keep - 1] + ctx->first_block.Data_Start;
+		stats_add(STATS_RMW_CYCLES, 1);
+		if(cache_read(ctx->block_cache, real_block, block) == -1){
+			ret = -1;
+		}
+		else{
+			memset(block + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+			ret = cache_write(ctx->block_cache, real_block, block);
+		}
+	}
+	size_t old_size = root->file_size;
+	root->file_size = size;
+	fd_release(this_file);
+	if(old_size != size && ctx->first_block.Journal_Blocks != 0){
+		pthread_mutex_lock(&ctx->table_lock);
+		journal_note_update(ctx);
+		pthread_mutex_unlock(&ctx->table_lock);
+	}
+	return ret;
+}
+
+int fs_truncate_ctx(struct fs_ctx *ctx, int fd, size_t size){
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = truncate_untraced(ctx, fd, size);
+	trace_end(start, FS_TRACE_TRUNCATE, ctx->trace_id, fd, size, ret, NULL);
+	return ret;
+}
+
+int fs_truncate(int fd, size_t size){
+	return fs_truncate_ctx(&default_ctx, fd, size);
+}
+
+/// @brief allocate the blocks of a file up to a size, called with the file held for writing
+/// @param this_file 
+/// @param size 
+/// @return -1 if the disk does not have enough free blocks
+int fallocate_locked(struct fs_ctx* ctx, struct fd* this_file, size_t size){
+	struct open_file* file = this_file->file;
+	if(expand_file(ctx, file) == -1){
+		return -1;
+	}
+	size_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t old_blocks = file->nblocks;
+	// holes inside the file are filled with zeros, they already read that way, and so
+	// are the holes at its end the block map leaves out
+	size_t inside = (this_file->root->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if(inside > blocks){
+		inside = blocks;
+	}
+	size_t i = 0;
+	while(i < inside){
+		size_t holes = hole_run(file, i, inside - i);
+		if(holes == 0){
+			i++;
+			continue;
+		}
+		file->generation++;
+		size_t have = extend_chain(ctx, file, i, i + holes);
+		if(have > i + holes){
+			have = i + holes;
+		}
+		if(zero_blocks(ctx, file, i, have) == -1 || have < i + holes){
+			return -1;
+		}
+		i += holes;
+	}
+	if(blocks <= file->nblocks){
+		return 0;
+	}
+	// one reservation for the whole rest, so that it comes in a single run when the disk has one
+	pthread_mutex_lock(&ctx->fat_lock);
+	if(file->reserve_len < blocks - file->nblocks){
+		release_reservation(ctx, file);
+	}
+	pthread_mutex_unlock(&ctx->fat_lock);
+	if(extend_chain(ctx, file, file->nblocks, blocks) < blocks){
+		// give back the part that could be allocated
+		pthread_mutex_lock(&ctx->fat_lock);
+		truncate_chain(ctx, file, old_blocks);
+		pthread_mutex_unlock(&ctx->fat_lock);
+		return -1;
+	}
+	return 0;
+}
+
+/// @brief fs_fallocate_ctx without the tracing
+int fallocate_untraced(struct fs_ctx* ctx, int fd, size_t size){
+	if(size > FS_FILE_SIZE_MAX){
+		return -1;
+	}
+	struct fd* this_file = fd_acquire(ctx, fd, 1);
+	if(this_file == NULL){
+		return -1;
+	}
+	struct open_file* file = this_file->file;
+	int ret = fallocate_locked(ctx, this_file, size);
+	hole_map_flush(ctx, file);
+	block_map_flush(ctx, file);
+	fd_release(this_file);
+	if(ctx->first_block.Journal_Blocks != 0){
+		pthread_mutex_lock(&ctx->table_lock);
+		journal_note_update(ctx);
+		pthread_mutex_unlock(&ctx->table_lock);
+	}
+	return ret;
+}
+
+int fs_fallocate_ctx(struct fs_ctx *ctx, int fd, size_t size){
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = fallocate_untraced(ctx, fd, size);
+	trace_end(start, FS_TRACE_FALLOCATE, ctx->trace_id, fd, size, ret, NULL);
+	return ret;
+}
+
+int fs_fallocate(int fd, size_t size){
+	return fs_fallocate_ctx(&default_ctx, fd, size);
+}
+
+/// @brief create a file sharing the blocks of another one, called with table_lock held
+/// @param src 
+/// @param dst 
+/// @return -1 on failure
+int clone_locked(struct fs_ctx* ctx, const char* src, const char* dst){
+	// not mounted
+	if(ctx->first_block.Signature == 0){
+		return -1;
+	}
+	if(name_validation(src) == -1 || name_validation(dst) == -1){
+		return -1;
+	}
+	int src_slot = name_lookup(ctx, src);
+	if(src_slot == -1 || name_lookup(ctx, dst) != -1){
+		return -1;
+	}
+	long slot = freemap_find(ctx->free_slots, 0);
+	if(slot == -1){
+		// max files have been created
+		return -1;
+	}
+	struct open_file* file = open_file_get(ctx, &ctx->root_dir[src_slot]);
+	if(file == NULL){
+		return -1;
+	}
+	// writers of the source wait until both files point at the same blocks
+	pthread_rwlock_wrlock(&file->lock);
+	// packed blocks cannot be shared, the source is expanded back first
+	int ret = expand_file(ctx, file);
+	struct root_nodes* root = &ctx->root_dir[slot];
+	size_t need = (file->nblocks + MAP_ENTRIES - 1) / MAP_ENTRIES;
+	uint16_t maps[MAP_BLOCKS_MAX];
+	size_t count = 0;
+	pthread_mutex_lock(&ctx->fat_lock);
+	if(ret == 0){
+		ret = make_mapped(ctx, file);
+	}
+	// the clone gets an on-disk block map of its own, pointing at the same blocks
+	while(ret == 0 && count < need){
+		long map = freemap_find(ctx->free_blocks, 0);
+		if(map == -1){
+			ret = -1;
+			break;
+		}
+		fat_set(ctx, map, FAT_E0C);
+		if(count > 0){
+			fat_set(ctx, maps[count - 1], map);
+		}
+		maps[count] = map;
+		ret = block_map_write(ctx, file, count, map);
+		count++;
+	}
+	if(ret == 0){
+		for(size_t i = 0; i < file->nblocks; i++){
+			if(file->blocks[i] != HOLE_REF){
+				ctx->block_refs[file->blocks[i]]++;
+			}
+		}
+	}
+	else{
+		for(size_t i = 0; i < count; i++){
+			fat_set(ctx, maps[i], 0);
+		}
+	}
+	pthread_mutex_unlock(&ctx->fat_lock);
+	if(ret == 0){
+		strncpy(root->file_name, dst, NAME_SIZE);
+		root->file_size = file->root->file_size;
+		root->index = count > 0 ? maps[0] : FAT_E0C;
+		root->hole_map = 0;
+		root->flags = ROOT_MAPPED;
+		name_insert(ctx, slot);
+	}
+	// the source may have just moved to an on-disk block map
+	block_map_flush(ctx, file);
+	pthread_rwlock_unlock(&file->lock);
+	open_file_put(ctx, file);
+	return ret;
+}
+
+/// @brief fs_clone_ctx without the tracing
+int clone_untraced(struct fs_ctx* ctx, const char* src, const char* dst){
+	pthread_mutex_lock(&ctx->table_lock);
+	int ret = clone_locked(ctx, src, dst);
+	if(ret == 0){
+		journal_note_update(ctx);
+	}
+	pthread_mutex_unlock(&ctx->table_lock);
+	return ret;
+}
+
+int fs_clone_ctx(struct fs_ctx *ctx, const char *src, const char *dst){
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = clone_untraced(ctx, src, dst);
+	trace_end_names(start, FS_TRACE_CLONE, ctx->trace_id, ret, src, dst);
+	return ret;
 }
 
+int fs_clone(const char *src, const char *dst){
+	return fs_clone_ctx(&default_ctx, src, dst);
+}
+
+/// @brief link one more free block to the end of a chain being built, called with fat_lock held
+/// @param chain blocks of the chain so far, room for one more
+/// @param len how many
+/// @return -1 if there is no free block left
+int chain_append(struct fs_ctx* ctx, uint16_t* chain, size_t len){
+	long block = freemap_find(ctx->free_blocks, len > 0 ? chain[len - 1] + 1 : 0);
+	stats_add(STATS_ALLOC_SEARCHES, 1);
+	if(block == -1){
+		return -1;
+	}
+	fat_set(ctx, block, FAT_E0C);
+	if(len > 0){
+		fat_set(ctx, chain[len - 1], block);
+	}
+	chain[len] = block;
+	return 0;
+}
+
+/// @brief add a packed block to the end of the chain of a file being compressed
+/// @param chain blocks of the chain so far
+/// @param len how many, bumped
+/// @param allocated blocks the file holds uncompressed
+/// @param block content of the packed block
+/// @return -1 if there is no free block left or the block cannot be written, 1 if the chain
+/// would be no shorter than what the file holds uncompressed
+int packed_write(struct fs_ctx* ctx, uint16_t* chain, size_t* len, size_t allocated, const char* block){
+	if(*len + 1 >= allocated){
+		return 1;
+	}
+	pthread_mutex_lock(&ctx->fat_lock);
+	int ret = chain_append(ctx, chain, *len);
+	pthread_mutex_unlock(&ctx->fat_lock);
+	if(ret == -1){
+		return -1;
+	}
+	return cache_write(ctx->block_cache, ctx->first_block.Data_Start + chain[(*len)++], block);
+}
+
+/// @brief compress the blocks of a file one by one and pack them back to back in a new chain,
+/// behind an index of where each one starts, then free the old blocks, called with the file held
+/// for writing
+/// @param file 
+/// @return -1 if the blocks cannot be read or written or there are not enough free blocks,
+/// 1 if the packed blocks would not take fewer blocks, the file then stays as it was, 0 otherwise
+int compress_file(struct fs_ctx* ctx, struct open_file* file){
+	struct root_nodes* root = file->root;
+	if(file->extents != NULL){
+		return 0;
+	}
+	size_t count = (root->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t index_blocks = packed_index_blocks(count);
+	// every block the file holds now, block maps and hole map included
+	size_t allocated = file->map_count + (root->hole_map != 0);
+	for(size_t i = 0; i < file->nblocks; i++){
+		allocated += file->blocks[i] != HOLE_REF;
+	}
+	if(count == 0 || index_blocks >= allocated){
+		return 1;
+	}
+	uint32_t* index = calloc(index_blocks, BLOCK_SIZE);
+	uint32_t* extents = malloc((count + 1) * sizeof(uint32_t));
+	uint16_t* chain = malloc(allocated * sizeof(uint16_t));
+	char* buf = malloc(RUN_MAX * BLOCK_SIZE);
+	char packed[BLOCK_SIZE];
+	char out[BLOCK_SIZE];
+	void* bufs[RUN_MAX];
+	size_t len = 0;
+	size_t fill = 0;
+	int ret = index == NULL || extents == NULL || chain == NULL || buf == NULL ? -1 : 0;
+	// the index comes first, so that it is found from the head of the chain
+	pthread_mutex_lock(&ctx->fat_lock);
+	while(ret == 0 && len < index_blocks){
+		ret = chain_append(ctx, chain, len);
+		len += ret == 0;
+	}
+	pthread_mutex_unlock(&ctx->fat_lock);
+	if(ret == 0){
+		index[0] = count;
+		extents[0] = 0;
+	}
+	for(size_t i = 0; ret == 0 && i < count;){
+		size_t run = count - i < RUN_MAX ? count - i : RUN_MAX;
+		for(size_t k = 0; ret == 0 && k < run;){
+			if(is_hole(file, i + k)){
+				memset(buf + k * BLOCK_SIZE, 0, BLOCK_SIZE);
+				k++;
+				continue;
+			}
+			size_t blocks = find_run(file, i + k, run - k);
+			for(size_t j = 0; j < blocks; j++){
+				bufs[j] = buf + (k + j) * BLOCK_SIZE;
+			}
+			ret = cache_read_multi(ctx->block_cache, ctx->first_block.Data_Start + file->blocks[i + k], blocks, bufs);
+			k += blocks;
+		}
+		if(ret == 0 && (i + run) * BLOCK_SIZE > root->file_size){
+			// what lies past the end of the file is not worth keeping
+			memset(buf + (root->file_size - i * BLOCK_SIZE), 0, (i + run) * BLOCK_SIZE - root->file_size);
+		}
+		for(size_t k = 0; ret == 0 && k < run; k++){
+			const char* block = buf + k * BLOCK_SIZE;
+			size_t size = 0;
+			if(block[0] != 0 || memcmp(block, block + 1, BLOCK_SIZE - 1) != 0){
+				// a block that does not get smaller is kept as it is
+				size = lz_compress(block, BLOCK_SIZE, out, BLOCK_SIZE - 1);
+				if(size == 0){
+					memcpy(out, block, BLOCK_SIZE);
+					size = BLOCK_SIZE;
+				}
+			}
+			extents[i + k + 1] = extents[i + k] + size;
+			for(size_t done = 0; ret == 0 && done < size;){
+				size_t piece = size - done < BLOCK_SIZE - fill ? size - done : BLOCK_SIZE - fill;
+				memcpy(packed + fill, out + done, piece);
+				fill += piece;
+				done += piece;
+				if(fill == BLOCK_SIZE){
+					ret = packed_write(ctx, chain, &len, allocated, packed);
+					fill = 0;
+				}
+			}
+		}
+		i += run;
+	}
+	if(ret == 0 && fill > 0){
+		memset(packed + fill, 0, BLOCK_SIZE - fill);
+		ret = packed_write(ctx, chain, &len, allocated, packed);
+	}
+	if(ret == 0){
+		memcpy(index + 1, extents, (count + 1) * sizeof(uint32_t));
+		for(size_t i = 0; ret == 0 && i < index_blocks; i++){
+			ret = cache_write(ctx->block_cache, ctx->first_block.Data_Start + chain[i], (char*)index + i * BLOCK_SIZE);
+		}
+	}
+	free(index);
+	free(buf);
+	pthread_mutex_lock(&ctx->fat_lock);
+	if(ret != 0){
+		if(len > 0){
+			clear_fat(ctx, chain[0]);
+		}
+		pthread_mutex_unlock(&ctx->fat_lock);
+		free(chain);
+		free(extents);
+		return ret;
+	}
+	// the file lets go of its blocks, maps and preallocated blocks included, for the new chain
+	truncate_chain(ctx, file, 0);
+	release_reservation(ctx, file);
+	if(root->hole_map != 0){
+		fat_set(ctx, root->hole_map, 0);
+		root->hole_map = 0;
+		free(file->hole_map);
+		file->hole_map = NULL;
+		file->hole_map_dirty = 0;
+	}
+	root->index = chain[0];
+	root->flags = (root->flags & ~ROOT_MAPPED) | ROOT_COMPRESSED;
+	pthread_mutex_unlock(&ctx->fat_lock);
+	free(file->blocks);
+	file->blocks = chain;
+	file->nblocks = len;
+	file->capacity = allocated;
+	file->map_count = 0;
+	file->map_dirty = 0;
+	file->extents = extents;
+	file->packed_count = count;
+	file->index_blocks = index_blocks;
+	file->generation++;
+	return 0;
+}
+
+/// @brief fs_compress_ctx without the tracing
+int compress_untraced(struct fs_ctx* ctx, const char* filename){
+	pthread_mutex_lock(&ctx->table_lock);
+	// not mounted, or no such file
+	int slot = ctx->first_block.Signature == 0 || name_validation(filename) == -1 ? -1 : name_lookup(ctx, filename);
+	// holding the open file keeps the entry from being deleted while it is compressed
+	struct open_file* file = slot == -1 ? NULL : open_file_get(ctx, &ctx->root_dir[slot]);
+	pthread_mutex_unlock(&ctx->table_lock);
+	if(file == NULL){
+		return -1;
+	}
+	pthread_rwlock_wrlock(&file->lock);
+	int ret = compress_file(ctx, file);
+	pthread_rwlock_unlock(&file->lock);
+	pthread_mutex_lock(&ctx->table_lock);
+	open_file_put(ctx, file);
+	if(ret == 0){
+		journal_note_update(ctx);
+	}
+	pthread_mutex_unlock(&ctx->table_lock);
+	return ret == -1 ? -1 : 0;
+}
+
+int fs_compress_ctx(struct fs_ctx *ctx, const char *filename){
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = compress_untraced(ctx, filename);
+	trace_end(start, FS_TRACE_COMPRESS, ctx->trace_id, -1, 0, ret, filename);
+	return ret;
+}
+
+int fs_compress(const char *filename){
+	return fs_compress_ctx(&default_ctx, filename);
+}
+
+/// @brief milliseconds on a clock that never goes back
+uint64_t clock_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// @brief count the runs of back to back blocks a file is split into
+/// @param file 
+/// @return 0 for a file without blocks
+size_t file_extents(struct open_file* file){
+	size_t extents = 0;
+	uint16_t last = FAT_E0C;
+	for(size_t i = 0; i < file->nblocks; i++){
+		if(file->blocks[i] == HOLE_REF){
+			continue;
+		}
+		if(last == FAT_E0C || file->blocks[i] != last + 1){
+			extents++;
+		}
+		last = file->blocks[i];
+	}
+	return extents;
+}
+
+/// @brief copy the allocated blocks of a file, in order, to consecutive blocks
+/// @param file 
+/// @param start first block of the destination run
+/// @return -1 if the blocks cannot be read or written
+int copy_blocks(struct fs_ctx* ctx, struct open_file* file, size_t start){
+	char* buf = malloc(RUN_MAX * BLOCK_SIZE);
+	if(buf == NULL){
+		return -1;
+	}
+	void* bufs[RUN_MAX];
+	uint16_t src[RUN_MAX];
+	for(size_t i = 0; i < RUN_MAX; i++){
+		bufs[i] = buf + i * BLOCK_SIZE;
+	}
+	size_t i = 0;
+	size_t done = 0;
+	int ret = 0;
+	while(ret == 0 && i < file->nblocks){
+		size_t count = 0;
+		while(count < RUN_MAX && i < file->nblocks){
+			if(file->blocks[i] != HOLE_REF){
+				src[count++] = file->blocks[i];
+			}
+			i++;
+		}
+		// the pieces come from the cache when they are there, dirty or not
+		for(size_t k = 0; ret == 0 && k < count;){
+			size_t run = 1;
+			while(k + run < count && src[k + run] == src[k] + run){
+				run++;
+			}
+			ret = cache_read_multi(ctx->block_cache, ctx->first_block.Data_Start + src[k], run, &bufs[k]);
+			k += run;
+		}
+		if(ret == 0 && count > 0){
+			ret = cache_write_multi(ctx->block_cache, ctx->first_block.Data_Start + start + done, count, bufs);
+		}
+		done += count;
+	}
+	free(buf);
+	return ret;
+}
+
+/// @brief move the blocks of a file into a single run of free blocks, called with the file held for writing
+/// @param file 
+/// @param max_blocks most blocks the whole fs_defrag call may move, 0 for no limit
+/// @param report 
+/// @return -1 if the blocks cannot be copied, 1 if the file does not fit in what is left
+/// of the budget but would in a budget of its own, 0 otherwise
+int defrag_file(struct fs_ctx* ctx, struct open_file* file, size_t max_blocks, struct fs_defrag_report* report){
+	size_t extents = file_extents(file);
+	size_t count = 0;
+	for(size_t i = 0; i < file->nblocks; i++){
+		count += file->blocks[i] != HOLE_REF;
+	}
+	if(extents > 1 && max_blocks != 0 && report->blocks_moved > 0 && count > max_blocks - report->blocks_moved){
+		return 1;
+	}
+	report->files_checked++;
+	report->extents_before += extents;
+	if(extents <= 1){
+		report->extents_after += extents;
+		return 0;
+	}
+	int mapped = file->root->flags & ROOT_MAPPED;
+	pthread_mutex_lock(&ctx->fat_lock);
+	// the reservation is right after the old last block, it is of no use where the file goes
+	release_reservation(ctx, file);
+	file->last_growth = 0;
+	// blocks shared with clones stay where every file sharing them expects them
+	int shared = 0;
+	for(size_t i = 0; mapped && i < file->nblocks; i++){
+		shared |= file->blocks[i] != HOLE_REF && ctx->block_refs[file->blocks[i]] > 1;
+	}
+	size_t len = 0;
+	long start = -1;
+	if(!shared && (max_blocks == 0 || count <= max_blocks)){
+		size_t scanned = freemap_scanned(ctx->free_blocks);
+		start = freemap_find_run(ctx->free_blocks, 0, count, &len);
+		stats_add(STATS_ALLOC_SEARCHES, 1);
+		stats_add(STATS_ALLOC_SCANNED, freemap_scanned(ctx->free_blocks) - scanned);
+	}
+	if(start == -1 || len < count){
+		// no room in one piece, not within the budget, or shared
+		pthread_mutex_unlock(&ctx->fat_lock);
+		report->files_skipped++;
+		report->extents_after += extents;
+		return 0;
+	}
+	// keep writers off the run while the data is copied over
+	for(size_t i = 0; i < count; i++){
+		freemap_set_used(ctx->free_blocks, start + i);
+	}
+	pthread_mutex_unlock(&ctx->fat_lock);
+	int ret = copy_blocks(ctx, file, start);
+	pthread_mutex_lock(&ctx->fat_lock);
+	if(ret == -1){
+		for(size_t i = 0; i < count; i++){
+			freemap_set_free(ctx->free_blocks, start + i);
+		}
+		pthread_mutex_unlock(&ctx->fat_lock);
+		report->extents_after += extents;
+		return -1;
+	}
+	// chain the new run, then free the old blocks
+	uint16_t prev = FAT_E0C;
+	size_t next = start;
+	for(size_t i = 0; i < file->nblocks; i++){
+		if(file->blocks[i] == HOLE_REF){
+			continue;
+		}
+		fat_set(ctx, next, FAT_E0C);
+		if(mapped){
+			ctx->block_refs[next] = 1;
+			block_map_note(file, i);
+		}
+		else if(prev == FAT_E0C){
+			file->root->index = next;
+		}
+		else{
+			fat_set(ctx, prev, next);
+		}
+		prev = next;
+		block_release(ctx, file->blocks[i]);
+		file->blocks[i] = next++;
+	}
+	pthread_mutex_unlock(&ctx->fat_lock);
+	block_map_flush(ctx, file);
+	report->files_moved++;
+	report->blocks_moved += count;
+	report->extents_after++;
+	return 0;
+}
+
+/// @brief fs_defrag_ctx without the tracing
+int defrag_untraced(struct fs_ctx* ctx, const struct fs_defrag_budget* budget, struct fs_defrag_report* report){
+	if(report == NULL){
+		return -1;
+	}
+	memset(report, 0, sizeof(*report));
+	size_t max_blocks = budget ? budget->max_blocks : 0;
+	unsigned max_ms = budget ? budget->max_ms : 0;
+	uint64_t start = clock_ms();
+	pthread_mutex_lock(&ctx->table_lock);
+	// not mounted
+	if(ctx->first_block.Signature == 0){
+		pthread_mutex_unlock(&ctx->table_lock);
+		return -1;
+	}
+	int ret = 0;
+	while(ctx->defrag_next < FS_FILE_MAX_COUNT){
+		if((max_ms != 0 && clock_ms() - start >= max_ms) || (max_blocks != 0 && report->blocks_moved >= max_blocks)){
+			break;
+		}
+		struct root_nodes* root = &ctx->root_dir[ctx->defrag_next];
+		if(root->file_name[0] == '\0'){
+			ctx->defrag_next++;
+			continue;
+		}
+		// holding the open file keeps the entry from being deleted while it moves
+		struct open_file* file = open_file_get(ctx, root);
+		if(file == NULL){
+			// every open file slot is taken, try again next time
+			break;
+		}
+		ctx->defrag_next++;
+		pthread_mutex_unlock(&ctx->table_lock);
+		pthread_rwlock_wrlock(&file->lock);
+		size_t moved = report->blocks_moved;
+		ret = defrag_file(ctx, file, max_blocks, report);
+		pthread_rwlock_unlock(&file->lock);
+		pthread_mutex_lock(&ctx->table_lock);
+		open_file_put(ctx, file);
+		if(ret == 1){
+			// the next call starts with it
+			ctx->defrag_next--;
+			ret = 0;
+			break;
+		}
+		if(ret == -1){
+			break;
+		}
+		if(report->blocks_moved != moved){
+			journal_note_update(ctx);
+		}
+	}
+	if(ctx->defrag_next == FS_FILE_MAX_COUNT){
+		// the next call starts a new pass
+		ctx->defrag_next = 0;
+		report->pass_done = 1;
+	}
+	pthread_mutex_unlock(&ctx->table_lock);
+	return ret;
+}
+
+int fs_defrag_ctx(struct fs_ctx *ctx, const struct fs_defrag_budget *budget, struct fs_defrag_report *report){
+	if(ctx == NULL){
+		return -1;
+	}
+	uint64_t start = trace_begin();
+	int ret = defrag_untraced(ctx, budget, report);
+	trace_end(start, FS_TRACE_DEFRAG, ctx->trace_id, -1, budget ? budget->max_blocks : 0, ret, NULL);
+	return ret;
+}
+
+int fs_defrag(const struct fs_defrag_budget *budget, struct fs_defrag_report *report){
+	return fs_defrag_ctx(&default_ctx, budget, report);
+}
+
+// state of one fs_fsck pass over an image
+struct fsck_pass {
+	struct fs_ctx* ctx;
+	int flags;
+	struct fs_fsck_report* report;
+	// one bit per data block: fat entry not 0, block reached from the superblock or a root entry
+	uint64_t* used;
+	uint64_t* reached;
+	// one bit per data block listed by the block map of a mapped file, those may be shared
+	uint64_t* listed;
+	// something was repaired, the fat and root dir must be written back
+	int changed;
+	// a repaired hole map or block map could not be written
+	int write_failed;
+};
+
+/// @brief whether a bit of a block bitmap is set
+int fsck_test(const uint64_t* map, size_t block){
+	return (map[block / 64] >> (block % 64)) & 1;
+}
+
+void fsck_set(uint64_t* map, size_t block){
+	map[block / 64] |= (uint64_t)1 << (block % 64);
+}
+
+void fsck_clear(uint64_t* map, size_t block){
+	map[block / 64] &= ~((uint64_t)1 << (block % 64));
+}
+
+/// @brief count a problem, printing it with FS_FSCK_VERBOSE
+/// @param pass 
+/// @param counter field of the report to bump
+/// @param fmt printf format of the description
+void fsck_problem(struct fsck_pass* pass, size_t* counter, const char* fmt, ...){
+	(*counter)++;
+	if(pass->flags & FS_FSCK_VERBOSE){
+		va_list args;
+		va_start(args, fmt);
+		vprintf(fmt, args);
+		va_end(args);
+		printf("%s\n", pass->flags & FS_FSCK_REPAIR ? ", repaired" : "");
+	}
+}
+
+/// @brief read the superblock, fat and root dir of an image without mounting it
+/// @param ctx zeroed context to load into
+/// @param diskname 
+/// @param repair replay a pending journal rather than just noticing it
+/// @param report 
+/// @return -1 if the image cannot be read or its superblock does not describe it
+int fsck_load(struct fs_ctx* ctx, const char* diskname, int repair, struct fs_fsck_report* report){
+	ctx->disk = block_dev_open(diskname, BLOCK_DISK_FD, 0);
+	if(ctx->disk == NULL){
+		return -1;
+	}
+	struct superblock* sb = &ctx->first_block;
+	if(block_dev_read(ctx->disk, 0, sb) == -1 || memcmp(&sb->Signature, "ECS150FS", 8) != 0){
+		return -1;
+	}
+	// the layout has to add up, everything else is located from it
+	if(sb->Data_Blocks_Amount == 0
+	   || sb->Fat_Blocks != (sb->Data_Blocks_Amount * FATSIZE + BLOCK_SIZE - 1) / BLOCK_SIZE
+	   || sb->Root_Dir != 1 + sb->Fat_Blocks || sb->Data_Start != sb->Root_Dir + 1
+	   || sb->Block_Amounts != sb->Data_Start + sb->Data_Blocks_Amount
+	   || block_dev_count(ctx->disk) != sb->Block_Amounts){
+		return -1;
+	}
+	if(sb->Journal_Blocks != 0){
+		if(sb->Journal_Start == 0 || (size_t)sb->Journal_Start + sb->Journal_Blocks > sb->Data_Blocks_Amount){
+			return -1;
+		}
+		if(repair){
+			if(journal_replay(ctx) == -1){
+				return -1;
+			}
+		}
+		else{
+			struct journal_header header;
+			struct journal_descriptor desc;
+			if(block_dev_read(ctx->disk, journal_block(ctx, 0), &header) == -1 || memcmp(&header.Signature, "ECS150JR", 8) != 0){
+				return -1;
+			}
+			// the checksum is left to the replay, a transaction with the right sequence number is enough to tell
+			report->journal_pending = header.Start < sb->Journal_Blocks
+				&& block_dev_read(ctx->disk, journal_block(ctx, header.Start), &desc) == 0
+				&& memcmp(&desc.Signature, "ECS150TX", 8) == 0 && desc.Sequence == header.Sequence;
+		}
+	}
+	ctx->fat_representation = malloc(sb->Fat_Blocks * BLOCK_SIZE);
+	if(ctx->fat_representation == NULL){
+		return -1;
+	}
+	for(int i = 0; i < sb->Fat_Blocks; i++){
+		if(block_dev_read(ctx->disk, 1 + i, (char*)ctx->fat_representation + i * BLOCK_SIZE) == -1){
+			return -1;
+		}
+	}
+	return block_dev_read(ctx->disk, root_location(ctx), ctx->root_dir);
+}
+
+/// @brief go over the whole fat once, 64 entries at a time, building the bitmap of used entries
+/// @param pass 
+/// @return how many entries hold something else than 0, 0xFFFF or a block index
+size_t fsck_scan_fat(struct fsck_pass* pass){
+	const uint16_t* fat = pass->ctx->fat_representation;
+	size_t n = pass->ctx->first_block.Data_Blocks_Amount;
+	size_t bad = 0;
+	for(size_t word = 0; word * 64 < n; word++){
+		const uint16_t* entries = fat + word * 64;
+		size_t count = n - word * 64 < 64 ? n - word * 64 : 64;
+		uint64_t bits = 0;
+		// one bit per entry in use, and a count of the entries out of range
+		for(size_t i = 0; i < count; i++){
+			bits |= (uint64_t)(entries[i] != 0) << i;
+			bad += (entries[i] >= n) & (entries[i] != FAT_E0C);
+		}
+		pass->used[word] = bits;
+	}
+	// entry 0 only marks the reserved block
+	fsck_clear(pass->used, 0);
+	return bad;
+}
+
+/// @brief follow the chain of a root entry, marking its blocks reached and cutting it
+/// right before the first block it should not reach
+/// @param pass 
+/// @param root 
+/// @return number of blocks in the chain, as repaired
+size_t fsck_chain(struct fsck_pass* pass, struct root_nodes* root){
+	uint16_t* fat = pass->ctx->fat_representation;
+	size_t n = pass->ctx->first_block.Data_Blocks_Amount;
+	uint16_t prev = FAT_E0C;
+	uint16_t block = root->index;
+	size_t len = 0;
+	while(block != FAT_E0C){
+		if(block == 0 || block >= n){
+			fsck_problem(pass, &pass->report->bad_chains, "file '%.16s': chain leaves the data blocks after %zu blocks", root->file_name, len);
+		}
+		else if(fsck_test(pass->reached, block)){
+			fsck_problem(pass, &pass->report->cross_links, "file '%.16s': chain reaches block %u, already in use", root->file_name, block);
+		}
+		else if(fat[block] == 0){
+			fsck_problem(pass, &pass->report->bad_chains, "file '%.16s': chain runs into free block %u", root->file_name, block);
+		}
+		else{
+			fsck_set(pass->reached, block);
+			len++;
+			prev = block;
+			block = fat[block];
+			continue;
+		}
+		if(pass->flags & FS_FSCK_REPAIR){
+			if(prev == FAT_E0C){
+				root->index = FAT_E0C;
+			}
+			else{
+				fat[prev] = FAT_E0C;
+			}
+			pass->changed = 1;
+		}
+		break;
+	}
+	return len;
+}
+
+/// @brief free the blocks of a chain past its first ones, after fsck_chain walked it
+/// @param pass 
+/// @param root 
+/// @param keep blocks that stay
+void fsck_cut(struct fsck_pass* pass, struct root_nodes* root, size_t keep){
+	uint16_t* fat = pass->ctx->fat_representation;
+	uint16_t prev = FAT_E0C;
+	uint16_t block = root->index;
+	for(size_t i = 0; i < keep; i++){
+		prev = block;
+		block = fat[block];
+	}
+	if(prev == FAT_E0C){
+		root->index = FAT_E0C;
+	}
+	else{
+		fat[prev] = FAT_E0C;
+	}
+	while(block != FAT_E0C){
+		uint16_t next = fat[block];
+		fat[block] = 0;
+		fsck_clear(pass->reached, block);
+		fsck_clear(pass->used, block);
+		block = next;
+	}
+	pass->changed = 1;
+}
+
+/// @brief check the hole map of a file against its chain
+/// @param pass 
+/// @param root 
+/// @param map content of the hole map
+/// @param len blocks in the chain
+void fsck_hole_map(struct fsck_pass* pass, struct root_nodes* root, uint8_t* map, size_t len){
+	size_t bits = 0;
+	for(size_t i = 0; i < BLOCK_SIZE; i++){
+		bits += __builtin_popcount(map[i]);
+	}
+	if(bits == len){
+		return;
+	}
+	fsck_problem(pass, &pass->report->bad_hole_maps, "file '%.16s': hole map has %zu blocks, chain has %zu", root->file_name, bits, len);
+	if(!(pass->flags & FS_FSCK_REPAIR)){
+		return;
+	}
+	if(bits < len){
+		fsck_cut(pass, root, bits);
+		return;
+	}
+	// the chain is what holds the data, forget the blocks it does not have
+	size_t seen = 0;
+	for(size_t i = 0; i < FILE_BLOCKS_MAX; i++){
+		if(map[i / 8] & (1 << (i % 8)) && ++seen > len){
+			map[i / 8] &= ~(1 << (i % 8));
+		}
+	}
+	if(block_dev_write(pass->ctx->disk, pass->ctx->first_block.Data_Start + root->hole_map, map) == -1){
+		pass->write_failed = 1;
+	}
+}
+
+/// @brief check the entries of the on-disk block map of a mapped file, after fsck_chain walked it
+/// @param pass 
+/// @param root 
+/// @param len blocks in the chain of the map
+/// @return number of blocks the map lists
+size_t fsck_block_map(struct fsck_pass* pass, struct root_nodes* root, size_t len){
+	struct fs_ctx* ctx = pass->ctx;
+	uint16_t* fat = ctx->fat_representation;
+	size_t n = ctx->first_block.Data_Blocks_Amount;
+	uint16_t entries[MAP_ENTRIES];
+	size_t listed = 0;
+	uint16_t map = root->index;
+	for(size_t i = 0; i < len; i++, map = fat[map]){
+		if(block_dev_read(ctx->disk, ctx->first_block.Data_Start + map, entries) == -1){
+			fsck_problem(pass, &pass->report->bad_chains, "file '%.16s': block map block %u cannot be read", root->file_name, map);
+			continue;
+		}
+		int changed = 0;
+		for(size_t j = 0; j < MAP_ENTRIES; j++){
+			uint16_t block = entries[j];
+			if(block == HOLE_REF){
+				continue;
+			}
+			if(block >= n || fat[block] != FAT_E0C){
+				fsck_problem(pass, &pass->report->bad_chains, "file '%.16s': block map lists block %u, not in use", root->file_name, block);
+			}
+			else if(fsck_test(pass->reached, block) && !fsck_test(pass->listed, block)){
+				fsck_problem(pass, &pass->report->cross_links, "file '%.16s': block map lists block %u, already in a chain", root->file_name, block);
+			}
+			else{
+				// clones list the same blocks, that is what the block maps are for
+				fsck_set(pass->reached, block);
+				fsck_set(pass->listed, block);
+				listed++;
+				continue;
+			}
+			entries[j] = HOLE_REF;
+			changed = 1;
+		}
+		if(changed && (pass->flags & FS_FSCK_REPAIR)
+		   && block_dev_write(ctx->disk, ctx->first_block.Data_Start + map, entries) == -1){
+			pass->write_failed = 1;
+		}
+	}
+	return listed;
+}
+
+/// @brief check the packed index of a compressed file against its chain, after fsck_chain walked it
+/// @param pass 
+/// @param root 
+/// @param len blocks in the chain
+void fsck_packed(struct fsck_pass* pass, struct root_nodes* root, size_t len){
+	struct fs_ctx* ctx = pass->ctx;
+	uint32_t words[BLOCK_SIZE / sizeof(uint32_t)];
+	uint32_t* index = NULL;
+	uint16_t block = root->index;
+	size_t count = 0;
+	size_t index_blocks = 0;
+	if(len > 0 && block_dev_read(ctx->disk, ctx->first_block.Data_Start + block, words) == 0){
+		count = words[0];
+		index_blocks = packed_index_blocks(count);
+		if(index_blocks <= len){
+			index = malloc(index_blocks * BLOCK_SIZE);
+			if(index == NULL){
+				return;
+			}
+		}
+	}
+	for(size_t i = 0; index != NULL && i < index_blocks; i++, block = ctx->fat_representation[block]){
+		if(block_dev_read(ctx->disk, ctx->first_block.Data_Start + block, (char*)index + i * BLOCK_SIZE) == -1){
+			free(index);
+			index = NULL;
+		}
+	}
+	// the blocks before the first one the index gets wrong, none if it cannot be read
+	size_t blocks = 0;
+	if(index != NULL){
+		blocks = packed_check(index + 1, count, (len - index_blocks) * BLOCK_SIZE);
+		free(index);
+	}
+	if(root->file_size > blocks * BLOCK_SIZE){
+		fsck_problem(pass, &pass->report->bad_sizes, "file '%.16s': size %u needs more than the %zu blocks its packed index holds", root->file_name, root->file_size, blocks);
+		if(pass->flags & FS_FSCK_REPAIR){
+			root->file_size = blocks * BLOCK_SIZE;
+			pass->changed = 1;
+		}
+	}
+}
+
+/// @brief check one used root entry
+/// @param pass 
+/// @param slot index in the root dir
+void fsck_file(struct fsck_pass* pass, int slot){
+	struct fs_ctx* ctx = pass->ctx;
+	struct root_nodes* root = &ctx->root_dir[slot];
+	int repair = pass->flags & FS_FSCK_REPAIR;
+	if(memchr(root->file_name, '\0', NAME_SIZE) == NULL){
+		fsck_problem(pass, &pass->report->bad_names, "entry %d: filename '%.16s' is not terminated", slot, root->file_name);
+		if(repair){
+			root->file_name[NAME_SIZE - 1] = '\0';
+			pass->changed = 1;
+		}
+	}
+	for(int i = 0; i < slot; i++){
+		if(ctx->root_dir[i].file_name[0] != '\0' && strncmp(ctx->root_dir[i].file_name, root->file_name, NAME_SIZE) == 0){
+			fsck_problem(pass, &pass->report->bad_names, "entry %d: filename '%.16s' already used by entry %d", slot, root->file_name, i);
+			break;
+		}
+	}
+	int mapped = root->flags & ROOT_MAPPED;
+	// a mapped file reads as one whatever else its flags say
+	int compressed = (root->flags & ROOT_COMPRESSED) && !mapped;
+	if((mapped || compressed) && root->hole_map != 0){
+		fsck_problem(pass, &pass->report->bad_hole_maps, "file '%.16s': has both a %s and a hole map", root->file_name, mapped ? "block map" : "packed index");
+		if(repair){
+			// the block map has the holes, and packed blocks have none, the hole map block becomes an orphan
+			root->hole_map = 0;
+			pass->changed = 1;
+		}
+	}
+	uint8_t map[BLOCK_SIZE];
+	int have_map = 0;
+	if(root->hole_map != 0){
+		uint16_t block = root->hole_map;
+		if(block >= ctx->first_block.Data_Blocks_Amount || ctx->fat_representation[block] != FAT_E0C
+		   || fsck_test(pass->reached, block) || block_dev_read(ctx->disk, ctx->first_block.Data_Start + block, map) == -1){
+			fsck_problem(pass, &pass->report->bad_hole_maps, "file '%.16s': hole map block %u is not usable", root->file_name, block);
+			if(repair){
+				// read the chain as a file without holes
+				root->hole_map = 0;
+				pass->changed = 1;
+			}
+		}
+		else{
+			fsck_set(pass->reached, block);
+			have_map = 1;
+		}
+	}
+	size_t len = fsck_chain(pass, root);
+	if(mapped){
+		if(len > MAP_BLOCKS_MAX){
+			fsck_problem(pass, &pass->report->bad_chains, "file '%.16s': block map takes %zu blocks, more than %d", root->file_name, len, MAP_BLOCKS_MAX);
+			if(repair){
+				fsck_cut(pass, root, MAP_BLOCKS_MAX);
+				len = MAP_BLOCKS_MAX;
+			}
+		}
+		len = fsck_block_map(pass, root, len < MAP_BLOCKS_MAX ? len : MAP_BLOCKS_MAX);
+	}
+	if(compressed){
+		fsck_packed(pass, root, len);
+	}
+	else if(root->hole_map != 0 || mapped){
+		if(have_map && !mapped){
+			fsck_hole_map(pass, root, map, len < FILE_BLOCKS_MAX ? len : FILE_BLOCKS_MAX);
+		}
+		if(root->file_size > FS_FILE_SIZE_MAX){
+			fsck_problem(pass, &pass->report->bad_sizes, "file '%.16s': size %u is past the largest file with holes", root->file_name, root->file_size);
+			if(repair){
+				root->file_size = FS_FILE_SIZE_MAX;
+				pass->changed = 1;
+			}
+		}
+	}
+	else if(len < (root->file_size + (size_t)BLOCK_SIZE - 1) / BLOCK_SIZE){
+		// blocks past the size are fine, fs_fallocate puts them there
+		fsck_problem(pass, &pass->report->bad_sizes, "file '%.16s': size %u needs more than the %zu blocks of its chain", root->file_name, root->file_size, len);
+		if(repair){
+			root->file_size = len * BLOCK_SIZE;
+			pass->changed = 1;
+		}
+	}
+	pass->report->files++;
+	pass->report->file_blocks += len;
+}
+
+/// @brief mark the journal region reached, it must be chained in order
+/// @param pass 
+void fsck_journal(struct fsck_pass* pass){
+	struct superblock* sb = &pass->ctx->first_block;
+	uint16_t* fat = pass->ctx->fat_representation;
+	for(size_t i = 0; i < sb->Journal_Blocks; i++){
+		uint16_t block = sb->Journal_Start + i;
+		uint16_t next = i + 1 < sb->Journal_Blocks ? block + 1 : FAT_E0C;
+		if(fat[block] != next){
+			fsck_problem(pass, &pass->report->bad_chains, "journal: block %u is not chained to %u", block, next);
+			if(pass->flags & FS_FSCK_REPAIR){
+				fat[block] = next;
+				fsck_set(pass->used, block);
+				pass->changed = 1;
+			}
+		}
+		fsck_set(pass->reached, block);
+	}
+}
+
+/// @brief check a loaded image
+/// @param pass 
+/// @return -1 if repairs cannot be written
+int fsck_run(struct fsck_pass* pass){
+	struct fs_ctx* ctx = pass->ctx;
+	struct fs_fsck_report* report = pass->report;
+	uint16_t* fat = ctx->fat_representation;
+	size_t n = ctx->first_block.Data_Blocks_Amount;
+	int repair = pass->flags & FS_FSCK_REPAIR;
+	report->bad_entries = fsck_scan_fat(pass);
+	if(report->bad_entries > 0 && (pass->flags & FS_FSCK_VERBOSE)){
+		for(size_t i = 0; i < n; i++){
+			if(fat[i] >= n && fat[i] != FAT_E0C){
+				printf("fat: entry %zu holds %u\n", i, fat[i]);
+			}
+		}
+	}
+	if(fat[0] != FAT_E0C){
+		fsck_problem(pass, &report->bad_entries, "fat: entry 0 holds %u instead of %u", fat[0], FAT_E0C);
+		if(repair){
+			fat[0] = FAT_E0C;
+			pass->changed = 1;
+		}
+	}
+	fsck_set(pass->reached, 0);
+	fsck_journal(pass);
+	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
+		if(ctx->root_dir[i].file_name[0] != '\0'){
+			fsck_file(pass, i);
+		}
+	}
+	// what is used but unreached belongs to nobody, compared a word at a time
+	size_t words = (n + 63) / 64;
+	for(size_t word = 0; word < words; word++){
+		uint64_t orphans = pass->used[word] & ~pass->reached[word];
+		if(orphans == 0){
+			continue;
+		}
+		report->orphans += __builtin_popcountll(orphans);
+		if(repair){
+			for(size_t bit = 0; bit < 64; bit++){
+				if(orphans & ((uint64_t)1 << bit)){
+					fat[word * 64 + bit] = 0;
+				}
+			}
+			pass->changed = 1;
+		}
+	}
+	if(report->orphans > 0 && (pass->flags & FS_FSCK_VERBOSE)){
+		printf("fat: %zu used blocks reached from no chain%s\n", report->orphans, repair ? ", freed" : "");
+	}
+	for(size_t i = 1; i < n; i++){
+		report->free_blocks += fat[i] == 0;
+	}
+	if(pass->changed){
+		for(int i = 0; i < ctx->first_block.Fat_Blocks; i++){
+			if(block_dev_write(ctx->disk, 1 + i, (char*)fat + i * BLOCK_SIZE) == -1){
+				return -1;
+			}
+		}
+		if(block_dev_write(ctx->disk, root_location(ctx), ctx->root_dir) == -1){
+			return -1;
+		}
+	}
+	// the hole maps and block maps were written as they were repaired
+	return pass->write_failed ? -1 : 0;
+}
+
+/// @brief total of the problem counters of a report
+size_t fsck_problems(const struct fs_fsck_report* report){
+	return report->bad_entries + report->bad_chains + report->cross_links + report->bad_sizes
+		+ report->bad_hole_maps + report->orphans + report->bad_names;
+}
+
+int fs_fsck(const char *diskname, int flags, struct fs_fsck_report *report){
+	if(report == NULL){
+		return -1;
+	}
+	memset(report, 0, sizeof(*report));
+	struct fs_ctx* ctx = calloc(1, sizeof(struct fs_ctx));
+	if(ctx == NULL){
+		return -1;
+	}
+	int ret = -1;
+	if(fsck_load(ctx, diskname, flags & FS_FSCK_REPAIR, report) == 0){
+		size_t words = (ctx->first_block.Data_Blocks_Amount + 63) / 64;
+		struct fsck_pass pass = {
+			.ctx = ctx,
+			.flags = flags,
+			.report = report,
+			.used = calloc(words, sizeof(uint64_t)),
+			.reached = calloc(words, sizeof(uint64_t)),
+			.listed = calloc(words, sizeof(uint64_t)),
+		};
+		if(pass.used != NULL && pass.reached != NULL && pass.listed != NULL && fsck_run(&pass) == 0){
+			ret = fsck_problems(report);
+			if(ret > 0 && (flags & FS_FSCK_REPAIR)){
+				// whatever the repairs missed shows up on a second pass over the repaired tables,
+				// that pass only reads and cannot fail once the repairs are written
+				struct fs_fsck_report after;
+				memset(&after, 0, sizeof(after));
+				memset(pass.used, 0, words * sizeof(uint64_t));
+				memset(pass.reached, 0, words * sizeof(uint64_t));
+				memset(pass.listed, 0, words * sizeof(uint64_t));
+				pass.flags = 0;
+				pass.report = &after;
+				pass.changed = 0;
+				fsck_run(&pass);
+				ret = fsck_problems(&after);
+			}
+		}
+		free(pass.used);
+		free(pass.reached);
+		free(pass.listed);
+	}
+	free(ctx->fat_representation);
+	if(ctx->disk != NULL){
+		block_dev_close(ctx->disk);
+	}
+	free(ctx);
+	return ret;
+}
@@ -2,6 +2,7 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for the trace file format */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -12,6 +13,203 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Largest offset fs_lseek() accepts (a file with holes spans 32768 blocks) */
+#define FS_FILE_SIZE_MAX (32768 * 4096)
+
+/** Number of blocks cached by fs_mount() */
+#define FS_CACHE_DEFAULT_BLOCKS 64
+
+/** Multi-block transfers kept in flight when no queue depth is given */
+#define FS_QUEUE_DEPTH_DEFAULT 32
+
+/** Largest readahead window of fs_mount(), in blocks */
+#define FS_READAHEAD_DEFAULT_BLOCKS 32
+
+/** Suggested size of a metadata journal, see fs_mount_opts() */
+#define FS_JOURNAL_DEFAULT_BLOCKS 64
+
+/** Ways of accessing the virtual disk file */
+enum fs_backend {
+	/* read()/write() system calls */
+	FS_BACKEND_FD,
+	/* Memory copies from a mapping of the whole virtual disk file */
+	FS_BACKEND_MMAP,
+	/* Asynchronous batches submitted through io_uring */
+	FS_BACKEND_URING,
+};
+
+/** Mount options, see fs_mount_opts() */
+struct fs_options {
+	/* Number of data blocks kept in the block cache (0 disables it) */
+	size_t cache_blocks;
+	/* How the virtual disk file is accessed */
+	enum fs_backend backend;
+	/* Multi-block transfers kept in flight (0 for the default) */
+	unsigned queue_depth;
+	/* Size of the journal to add to a file system without one (0 for none) */
+	size_t journal_blocks;
+	/* Largest readahead window of a sequential reader (0 disables it) */
+	size_t readahead_blocks;
+	/* Fingerprints kept by the dedup index (0 disables dedup) */
+	size_t dedup_entries;
+};
+
+/** Block cache counters, see fs_cache_stats() */
+struct fs_cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t writebacks;
+};
+
+/** Library activity counters, see fs_stats() */
+struct fs_stats {
+	/* Blocks read from and written to the virtual disk */
+	size_t block_reads;
+	size_t block_writes;
+	/* FAT entries followed while walking chains */
+	size_t fat_hops;
+	/* Searches for free blocks, and free-map words they examined */
+	size_t alloc_searches;
+	size_t alloc_scanned;
+	/* Partially written blocks whose old content had to be read first */
+	size_t rmw_cycles;
+	/* Calls to fs_read() and fs_write(), and the bytes they moved */
+	size_t read_ops;
+	size_t read_bytes;
+	size_t write_ops;
+	size_t write_bytes;
+	/* Blocks shared with a clone that got a copy of their own when written */
+	size_t cow_blocks;
+	/*
+	 * Whole blocks fs_write() did not write, because an identical block
+	 * was shared instead or they held only zeros and became holes
+	 */
+	size_t dedup_blocks;
+	/* Blocks of compressed files decompressed, by fs_read() or to expand them */
+	size_t unpacked_blocks;
+};
+
+/** Limits of one fs_defrag() call, 0 for no limit */
+struct fs_defrag_budget {
+	/* Blocks that may be moved */
+	size_t max_blocks;
+	/* Milliseconds after which no other file is started */
+	unsigned int max_ms;
+};
+
+/** What one fs_defrag() call did */
+struct fs_defrag_report {
+	/* Files looked at, moved into a single run, and left in pieces */
+	size_t files_checked;
+	size_t files_moved;
+	size_t files_skipped;
+	/* Blocks copied to their new place */
+	size_t blocks_moved;
+	/* Runs of back to back blocks of the files looked at, before and after */
+	size_t extents_before;
+	size_t extents_after;
+	/* Every file has been looked at since the pass started */
+	int pass_done;
+};
+
+/** fs_fsck() flags: fix what can be fixed, print every problem found */
+#define FS_FSCK_REPAIR 1
+#define FS_FSCK_VERBOSE 2
+
+/** What fs_fsck() found, every field but the first four counts problems */
+struct fs_fsck_report {
+	/* Files in the root directory, and the blocks their chains hold */
+	size_t files;
+	size_t file_blocks;
+	/* Free data blocks */
+	size_t free_blocks;
+	/* The journal holds transactions that mounting would replay first */
+	int journal_pending;
+	/* FAT entries holding neither 0, 0xFFFF (end of chain) nor a block index */
+	size_t bad_entries;
+	/* Chains that run into a free block or off the data blocks */
+	size_t bad_chains;
+	/* Chains that run into a block already reached from another chain */
+	size_t cross_links;
+	/* Files whose size needs more blocks than their chain holds */
+	size_t bad_sizes;
+	/* Hole maps that are not allocated, or disagree with their chain */
+	size_t bad_hole_maps;
+	/* Used blocks no chain reaches */
+	size_t orphans;
+	/* Root directory entries with an unterminated or duplicate filename */
+	size_t bad_names;
+};
+
+/** Calls recorded in a trace, see fs_trace_start() */
+enum fs_trace_op {
+	FS_TRACE_MOUNT,
+	FS_TRACE_UMOUNT,
+	FS_TRACE_SYNC,
+	FS_TRACE_INFO,
+	FS_TRACE_LS,
+	FS_TRACE_CREATE,
+	FS_TRACE_DELETE,
+	FS_TRACE_OPEN,
+	FS_TRACE_CLOSE,
+	FS_TRACE_STAT,
+	FS_TRACE_LSEEK,
+	FS_TRACE_WRITE,
+	FS_TRACE_READ,
+	FS_TRACE_TRUNCATE,
+	FS_TRACE_FALLOCATE,
+	FS_TRACE_DEFRAG,
+	FS_TRACE_CLONE,
+	FS_TRACE_COMPRESS,
+	FS_TRACE_OPS,
+};
+
+/** Trace file signature and format version */
+#define FS_TRACE_SIGNATURE "ECS150TR"
+#define FS_TRACE_VERSION 1
+
+/** Start of a trace file, followed by the records */
+struct fs_trace_header {
+	/* %FS_TRACE_SIGNATURE, without the NULL character */
+	char signature[8];
+	/* %FS_TRACE_VERSION */
+	uint32_t version;
+	/* Size of a struct fs_trace_record */
+	uint32_t record_size;
+} __attribute__((packed));
+
+/** One recorded call, followed by @name_len bytes of its name argument */
+struct fs_trace_record {
+	/* When the call started, in nanoseconds since the trace started */
+	uint64_t start;
+	/* How long the call took, in nanoseconds */
+	uint32_t duration;
+	/* Kind of call, an enum fs_trace_op */
+	uint8_t op;
+	/*
+	 * Length of the filename, or diskname, argument (0 for none). The two
+	 * filenames of fs_clone() are recorded separated by a NULL character
+	 */
+	uint8_t name_len;
+	/* Calling thread, numbered from 1 in order of first recorded call */
+	uint16_t thread;
+	/* File system context, 0 for the default one, see fs_mount_ctx() */
+	uint16_t ctx;
+	/* File descriptor argument (-1 for none) */
+	int32_t fd;
+	/* Return value */
+	int32_t ret;
+	/*
+	 * Byte count of fs_read() and fs_write(), offset of fs_lseek(), size of
+	 * fs_truncate() and fs_fallocate(), block budget of fs_defrag()
+	 */
+	uint64_t arg;
+} __attribute__((packed));
+
+/** Opaque mounted file system, see fs_mount_ctx() */
+struct fs_ctx;
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -25,17 +223,153 @@
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_cache - Mount a file system with a block cache of a given size
+ * @diskname: Name of the virtual disk file
+ * @cache_blocks: Number of data blocks to keep in the cache
+ *
+ * Same as fs_mount(), which uses %FS_CACHE_DEFAULT_BLOCKS, but with a
+ * write-back cache of @cache_blocks blocks. Data blocks written by fs_write()
+ * stay in the cache until they are evicted (least recently used first), or
+ * until fs_sync() or fs_umount() is called. A @cache_blocks of 0 disables
+ * caching.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid file
+ * system can be located, or if the cache cannot be allocated. 0 otherwise.
+ */
+int fs_mount_cache(const char *diskname, size_t cache_blocks);
+
+/**
+ * fs_mount_opts - Mount a file system with explicit options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options
+ *
+ * Same as fs_mount(), with the block cache and disk access described by @opts.
+ * With %FS_BACKEND_MMAP, the whole virtual disk file is mapped in memory and
+ * fs_read() copies file content straight from the mapping into the caller's
+ * buffer. The mapping then plays the role of the block cache, so
+ * @opts->cache_blocks is ignored. With %FS_BACKEND_URING, fs_read() and
+ * fs_write() hand the runs of consecutive blocks of a transfer to the kernel
+ * in batches of up to @opts->queue_depth requests (%FS_QUEUE_DEPTH_DEFAULT if
+ * 0, at most 64) that complete concurrently.
+ *
+ * A file descriptor that reads a file sequentially prefetches the blocks that
+ * follow into a buffer of its own, so that small reads do not each wait on the
+ * disk. The window starts small and doubles on every refill, up to
+ * @opts->readahead_blocks blocks. A read that does not start where the
+ * previous one ended turns readahead off until the reader is sequential
+ * again. fs_mount() and fs_mount_cache() use %FS_READAHEAD_DEFAULT_BLOCKS;
+ * there is no readahead with %FS_BACKEND_MMAP.
+ *
+ * A file system can hold a journal of its metadata. Changes to the FAT and the
+ * root directory are then logged as transactions, each written sequentially
+ * in one go, by fs_sync() and automatically once enough updates have
+ * accumulated. Mounting replays whatever the journal holds, so a crash never
+ * leaves the FAT and the root directory out of step with each other. A journal
+ * of @opts->journal_blocks blocks (%FS_JOURNAL_DEFAULT_BLOCKS is a sensible
+ * size) is carved out of the free data blocks if the file system has none
+ * yet; it then stays for good.
+ *
+ * With @opts->dedup_entries set, fs_write() deduplicates whole blocks. Each
+ * whole block it is about to write is fingerprinted, and looked up in an
+ * in-memory index of the blocks written so far; a block with the same content
+ * is shared instead of written, as fs_clone() shares blocks, and a block of
+ * zeros becomes a hole. The index holds up to @opts->dedup_entries
+ * fingerprints (rounded down to a power of two, 16 bytes each, plus 4 bytes
+ * per data block of the disk), a newer fingerprint taking the place of an
+ * older one that falls in the same entry. It starts out empty at every mount.
+ * Files written this way keep the list of their blocks in blocks of their
+ * own, see fs_clone().
+ *
+ * Return: -1 if @opts is NULL, if virtual disk file @diskname cannot be opened
+ * or mapped, if io_uring is not available, if no valid file system can be
+ * located, if its journal cannot be replayed or created, or if the cache or
+ * the dedup index cannot be allocated. 0 otherwise.
+ */
+int fs_mount_opts(const char *diskname, const struct fs_options *opts);
+
 /**
  * fs_umount - Unmount file system
  *
  * Unmount the currently mounted file system and close the underlying virtual
- * disk file.
+ * disk file. Pending changes are written out as by fs_sync(), so unmounting a
+ * file system that was only read from writes nothing.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
  * closed, or if there are still open file descriptors. 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Flush file system to disk
+ *
+ * Write back every dirty cached block, then the FAT blocks and the root
+ * directory that changed since they were last written, so that the virtual
+ * disk file reflects the current state of the file system. Nothing is written
+ * when nothing changed, which makes periodic checkpoints cheap. With a journal,
+ * the changed metadata blocks are logged in a single transaction instead, and
+ * only written to their home location when the journal fills up or when the
+ * file system is unmounted.
+ *
+ * Return: -1 if no FS is currently mounted, or if writing to the virtual disk
+ * fails. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_cache_stats - Get block cache counters
+ * @stats: Filled with the counters of the currently mounted file system
+ *
+ * Return: -1 if no FS is currently mounted, or if @stats is NULL. 0 otherwise.
+ */
+int fs_cache_stats(struct fs_cache_stats *stats);
+
+/**
+ * fs_stats - Get library activity counters
+ * @stats: Filled with the counters
+ *
+ * Every thread counts events in counters of its own, which this call adds up,
+ * so counting never makes threads contend. The counters cover the whole
+ * process, across mounts, since it started or since the last
+ * fs_stats_reset().
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
+/**
+ * fs_stats_reset - Reset library activity counters
+ *
+ * Start the counters reported by fs_stats() from zero again.
+ */
+void fs_stats_reset(void);
+
+/**
+ * fs_trace_start - Start recording calls into a trace file
+ * @path: Name of the trace file, created or truncated
+ *
+ * Record every subsequent call to the functions of this API that work on a
+ * file system, from any thread and on any context, until fs_trace_stop() is
+ * called. A trace is a struct fs_trace_header followed by one struct
+ * fs_trace_record per call, with its arguments, return value, start time and
+ * duration; the data that is read or written is not recorded. Records are
+ * buffered in memory and written out in large chunks, in the order in which
+ * the calls returned. A trace can be replayed against a file system image
+ * with fs_replay.x.
+ *
+ * Return: -1 if a trace is already being recorded, or if @path cannot be
+ * created. 0 otherwise.
+ */
+int fs_trace_start(const char *path);
+
+/**
+ * fs_trace_stop - Stop recording calls
+ *
+ * Return: -1 if no trace is being recorded, or if part of the trace could not
+ * be written. 0 otherwise.
+ */
+int fs_trace_stop(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -94,6 +428,12 @@ int fs_ls(void);
  * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
  * simultaneously.
  *
+ * Every function of this API can be called from several threads at once.
+ * Reads of the same file run in parallel, and so do reads and writes of
+ * different files, while a write excludes every other access to its file. A
+ * file descriptor carries its own offset, so each thread should open its own
+ * descriptor: the same one must not be used by two threads at the same time.
+ *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * there is no file named @filename to open, or if there are already
  * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
@@ -133,9 +473,13 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * @offset can lie past the end of the file. A later fs_write() then leaves a
+ * hole between the old end of the file and @offset: the blocks of the hole are
+ * not allocated and read back as zeros.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * than %FS_FILE_SIZE_MAX. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -155,6 +499,10 @@ int fs_lseek(int fd, size_t offset);
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
+ * Writing past the end of the file, after fs_lseek() moved the offset there,
+ * only allocates the blocks that receive data. Writing inside a hole allocates
+ * the blocks of the hole that are written to.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually written.
@@ -176,10 +524,217 @@ int fs_write(int fd, void *buf, size_t count);
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
  *
+ * Holes (see fs_lseek()) read as zeros, without any disk access.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_truncate - Shrink a file
+ * @fd: File descriptor
+ * @size: New file size
+ *
+ * Cut the file referenced by file descriptor @fd down to @size bytes. The
+ * blocks past the new end of the file, including those set aside by
+ * fs_fallocate(), go back to the free blocks. File offsets past the new end
+ * are left as they are.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), if @size is larger than
+ * the current file size, or if the new last block is shared with a clone
+ * (see fs_clone()) and there is no free block left to copy it to. 0
+ * otherwise.
+ */
+int fs_truncate(int fd, size_t size);
+
+/**
+ * fs_fallocate - Allocate the blocks of a file ahead of writing it
+ * @fd: File descriptor
+ * @size: Number of bytes to allocate blocks for
+ *
+ * Make sure that the file referenced by file descriptor @fd has a block for
+ * every byte up to @size. The blocks missing past the end of the file are
+ * taken as one contiguous run of free blocks if the disk has one, and linked
+ * into the file right away: fs_write() then fills them without allocating
+ * anything. Holes (see fs_lseek()) before @size are allocated too. The file
+ * size does not change; use fs_truncate() to give back blocks allocated past
+ * the end of the file.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), if @size is larger than
+ * %FS_FILE_SIZE_MAX, or if there are not enough free blocks (the file is then
+ * left with the blocks it had). 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t size);
+
+/**
+ * fs_clone - Create a copy of a file that shares its blocks
+ * @src: Name of the file to copy
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst with the size and content of file @src, without
+ * copying any data: both files point at the same data blocks, and every data
+ * block keeps a count of the files pointing at it. Writing to either file
+ * later gives it a block of its own in place of each shared block it modifies
+ * (copy-on-write), and the other files keep the old content. A shared block is
+ * freed when the last file pointing at it lets go of it. @src may be open,
+ * even being written to, meanwhile.
+ *
+ * Files that share blocks keep the list of their blocks in blocks of their own
+ * (one for every 2048 data blocks) instead of a FAT chain. @src moves to such
+ * a list first if it does not have one already. Like files with holes, these
+ * files span at most %FS_FILE_SIZE_MAX bytes.
+ *
+ * Return: -1 if no FS is currently mounted, if @src or @dst is invalid, if
+ * there is no file named @src, if a file named @dst already exists, if the
+ * root directory is full, if @src spans more than %FS_FILE_SIZE_MAX bytes, or
+ * if there are not enough free blocks for the block lists, or to expand @src
+ * back if it is compressed (see fs_compress()). 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_compress - Compress a file
+ * @filename: File name
+ *
+ * Compress the blocks of file @filename one by one with a fast LZ codec
+ * built into the library, and pack the results back to back into as few data
+ * blocks as they fit in. An index in the first blocks of the file tells where
+ * each block starts in the packed blocks; blocks of zeros take no room, and
+ * blocks that do not get smaller are packed as they are. The old blocks of the
+ * file, including those preallocated by fs_fallocate(), are then freed. A file
+ * whose packed blocks and index would take as many blocks as it has now is
+ * left as it is.
+ *
+ * fs_read() decompresses a compressed file on the fly, reading each packed
+ * block once for all the blocks it holds, so a file that compresses well
+ * reads with proportionally fewer disk accesses. Writing to a compressed
+ * file, truncating it, preallocating it or cloning it first expands it back
+ * into a block of its own per block, its blocks of zeros becoming holes (see
+ * fs_lseek()); that fails if there are not enough free blocks for it, and the
+ * file then stays compressed. Compressing a file again once it has been
+ * written to packs it anew. @filename may be open meanwhile.
+ *
+ * Return: -1 if no FS is currently mounted, if @filename is invalid, if there
+ * is no file named @filename, if its blocks cannot be read or written, or if
+ * there are not enough free blocks for the packed blocks (the file is then
+ * left as it was). 0 otherwise, including when the file was already
+ * compressed or was left as it is.
+ */
+int fs_compress(const char *filename);
+
+/**
+ * fs_defrag - Move files into contiguous runs of blocks
+ * @budget: Limits of this call, or NULL for none
+ * @report: Filled with what was done
+ *
+ * Go over the files of the root directory and copy the blocks of every file
+ * that is split into several runs to a single run of free blocks, in order,
+ * then relink its chain there and free the old blocks. A file without a free
+ * run long enough for all of its blocks stays as it is, and so does a file
+ * sharing blocks with a clone (see fs_clone()). The file system stays
+ * usable meanwhile: each file is held for writing only while it is moved, and
+ * cannot be deleted until then.
+ *
+ * A pass over the files can be spread over several calls: each call picks up
+ * with the file after the last one the previous call looked at, and stops
+ * before starting another file once @budget->max_ms milliseconds have passed
+ * or @budget->max_blocks blocks have been moved. Files with more blocks than
+ * the budget has left are skipped. @report->pass_done tells when the pass
+ * reached the last file; the next call then starts over from the first one.
+ *
+ * Return: -1 if no FS is currently mounted, if @report is NULL, or if blocks
+ * cannot be copied (the file being moved is then left where it was). 0
+ * otherwise.
+ */
+int fs_defrag(const struct fs_defrag_budget *budget,
+	      struct fs_defrag_report *report);
+
+/**
+ * fs_fsck - Check the consistency of a file system
+ * @diskname: Name of the virtual disk file, which must not be mounted
+ * @flags: %FS_FSCK_REPAIR and %FS_FSCK_VERBOSE, or 0
+ * @report: Filled with what was found
+ *
+ * Check the file system of @diskname in a single pass over its FAT and root
+ * directory. Every chain is followed from its root directory entry and must
+ * end in 0xFFFF without running into a free block, leaving the data blocks,
+ * or reaching a block that another chain already reached. A file must have
+ * enough blocks for its size, and a file with holes as many blocks as its hole
+ * map says. The block list of a file made by fs_clone() is chained the same
+ * way, and each of the blocks it lists must be in use and reached by no chain.
+ * The packed index of a compressed file (see fs_compress()) must cover its
+ * size with blocks that lie within its chain. The journal region, the hole
+ * maps and the listed blocks count as reached, and every used block nothing
+ * reaches is an orphan.
+ *
+ * With %FS_FSCK_REPAIR, a pending journal is replayed first, like mounting
+ * would. Then chains are cut right before where they go wrong (the file met
+ * first keeps a cross-linked block), sizes are lowered to what the chains and
+ * packed indexes hold, unusable hole maps are dropped, bad entries of block
+ * lists become holes, and orphans are freed. The repaired image is then
+ * checked again within the same call, without reopening it: @report keeps what
+ * was found before the repairs, and the return value counts what the second
+ * check still finds. Duplicate filenames are never repaired. With
+ * %FS_FSCK_VERBOSE, every problem is printed as it is found.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if its superblock
+ * is not valid, if @report is NULL, or if a repair cannot be written, in which
+ * case the image may be partly repaired. Otherwise the number of problems
+ * left, 0 for a consistent file system.
+ */
+int fs_fsck(const char *diskname, int flags, struct fs_fsck_report *report);
+
+/**
+ * fs_mount_ctx - Mount a file system in a context of its own
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options
+ *
+ * Same as fs_mount_opts(), except that the file system is not the one used by
+ * the functions above and below, which all work on a single default file
+ * system. Any number of file systems can be mounted this way at once, each
+ * with its own block cache, file descriptors and locks, and accessed with the
+ * fs_*_ctx() variants of these functions. File descriptors are only valid in
+ * the context that returned them.
+ *
+ * Return: NULL if @opts is NULL, or in any of the cases where fs_mount_opts()
+ * fails. The context of the mounted file system otherwise.
+ */
+struct fs_ctx *fs_mount_ctx(const char *diskname, const struct fs_options *opts);
+
+/**
+ * fs_umount_ctx - Unmount a file system mounted with fs_mount_ctx()
+ * @ctx: File system context, released on success
+ *
+ * Return: -1 if @ctx is NULL, or in any of the cases where fs_umount() fails.
+ * 0 otherwise.
+ */
+int fs_umount_ctx(struct fs_ctx *ctx);
+
+/*
+ * Variants of the functions above working on the file system of @ctx, with
+ * the same behaviour and return values. They also return -1 if @ctx is NULL.
+ */
+int fs_sync_ctx(struct fs_ctx *ctx);
+int fs_cache_stats_ctx(struct fs_ctx *ctx, struct fs_cache_stats *stats);
+int fs_info_ctx(struct fs_ctx *ctx);
+int fs_create_ctx(struct fs_ctx *ctx, const char *filename);
+int fs_delete_ctx(struct fs_ctx *ctx, const char *filename);
+int fs_ls_ctx(struct fs_ctx *ctx);
+int fs_open_ctx(struct fs_ctx *ctx, const char *filename);
+int fs_close_ctx(struct fs_ctx *ctx, int fd);
+int fs_stat_ctx(struct fs_ctx *ctx, int fd);
+int fs_lseek_ctx(struct fs_ctx *ctx, int fd, size_t offset);
+int fs_write_ctx(struct fs_ctx *ctx, int fd, void *buf, size_t count);
+int fs_read_ctx(struct fs_ctx *ctx, int fd, void *buf, size_t count);
+int fs_truncate_ctx(struct fs_ctx *ctx, int fd, size_t size);
+int fs_fallocate_ctx(struct fs_ctx *ctx, int fd, size_t size);
+int fs_defrag_ctx(struct fs_ctx *ctx, const struct fs_defrag_budget *budget,
+		  struct fs_defrag_report *report);
+int fs_clone_ctx(struct fs_ctx *ctx, const char *src, const char *dst);
+int fs_compress_ctx(struct fs_ctx *ctx, const char *filename);
+
 #endif /* _FS_H */
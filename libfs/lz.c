@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Bits of the match finder table, 8KB on the stack */
+#define LZ_HASH_BITS 12
+
+/* Largest length that fits in a token nibble, longer ones are extended */
+#define LZ_NIBBLE_MAX 15
+
+/* Longest offset of a back reference, and so longest input */
+#define LZ_OFFSET_MAX 65535
+
+/* Misses in a row before the match finder starts skipping ahead */
+#define LZ_SKIP_SHIFT 5
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static size_t hash32(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Emits the extension bytes of a length that did not fit in its nibble */
+static uint8_t *put_length(uint8_t *op, const uint8_t *oend, size_t n)
+{
+	for (; n >= 255; n -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = n;
+	return op;
+}
+
+/*
+ * Emits one sequence: @nlit literals from @lit, then a back reference of
+ * @mlen bytes @off bytes back, or none if @mlen is 0
+ */
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *oend,
+			     const uint8_t *lit, size_t nlit,
+			     size_t off, size_t mlen)
+{
+	size_t ml = mlen ? mlen - LZ_MATCH_MIN : 0;
+	uint8_t *token = op++;
+
+	if (token >= oend)
+		return NULL;
+	*token = (nlit < LZ_NIBBLE_MAX ? nlit : LZ_NIBBLE_MAX) << 4;
+	*token |= ml < LZ_NIBBLE_MAX ? ml : LZ_NIBBLE_MAX;
+	if (nlit >= LZ_NIBBLE_MAX) {
+		op = put_length(op, oend, nlit - LZ_NIBBLE_MAX);
+		if (!op)
+			return NULL;
+	}
+	if ((size_t)(oend - op) < nlit)
+		return NULL;
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (!mlen)
+		return op;
+	if (oend - op < 2)
+		return NULL;
+	*op++ = off & 0xff;
+	*op++ = off >> 8;
+	if (ml >= LZ_NIBBLE_MAX)
+		op = put_length(op, oend, ml - LZ_NIBBLE_MAX);
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	/* Position plus one of the last occurrence of each hash, 0 for none */
+	uint16_t table[1 << LZ_HASH_BITS] = { 0 };
+	const uint8_t *in = src;
+	uint8_t *op = dst;
+	const uint8_t *oend = op + cap;
+	size_t anchor = 0, i = 0, misses = 0;
+
+	if (!len || len > LZ_OFFSET_MAX)
+		return 0;
+	while (i + LZ_MATCH_MIN <= len) {
+		uint32_t v = read32(in + i);
+		size_t h = hash32(v);
+		size_t cand = table[h];
+		size_t mlen = LZ_MATCH_MIN;
+
+		table[h] = i + 1;
+		if (!cand || read32(in + cand - 1) != v) {
+			/* incompressible data is crossed in growing strides */
+			i += 1 + (misses++ >> LZ_SKIP_SHIFT);
+			continue;
+		}
+		cand--;
+		while (i + mlen < len && in[cand + mlen] == in[i + mlen])
+			mlen++;
+		op = put_sequence(op, oend, in + anchor, i - anchor,
+				  i - cand, mlen);
+		if (!op)
+			return 0;
+		i += mlen;
+		anchor = i;
+		misses = 0;
+	}
+	if (anchor < len) {
+		op = put_sequence(op, oend, in + anchor, len - anchor, 0, 0);
+		if (!op)
+			return 0;
+	}
+	return op - (uint8_t *)dst;
+}
+
+/* Adds the extension bytes of a length to @n */
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *n)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+	return 0;
+}
+
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + len;
+	uint8_t *ostart = dst;
+	uint8_t *op = ostart;
+	uint8_t *oend = op + cap;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t nlit = token >> 4;
+		size_t mlen = token & LZ_NIBBLE_MAX;
+		size_t off;
+		const uint8_t *m;
+
+		if (nlit == LZ_NIBBLE_MAX && get_length(&ip, iend, &nlit))
+			return -1;
+		if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit)
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		/* the last sequence has no back reference */
+		if (ip == iend)
+			break;
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (mlen == LZ_NIBBLE_MAX && get_length(&ip, iend, &mlen))
+			return -1;
+		mlen += LZ_MATCH_MIN;
+		if (!off || off > (size_t)(op - ostart) ||
+		    (size_t)(oend - op) < mlen)
+			return -1;
+		m = op - off;
+		if (off >= mlen) {
+			memcpy(op, m, mlen);
+			op += mlen;
+		} else {
+			/* overlapping reference, repeats the last @off bytes */
+			while (mlen--)
+				*op++ = *m++;
+		}
+	}
+	return op - ostart;
+}
@@ -0,0 +1,44 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+
+/*
+ * Byte-oriented LZ77 codec, in the spirit of LZ4: a stream is a sequence of
+ * token bytes, each followed by the literals it announces and, except for the
+ * last one, a back reference of at least LZ_MATCH_MIN bytes. It favours speed
+ * over ratio and needs no state beyond a small table on the stack.
+ */
+
+/** Shortest back reference the codec encodes */
+#define LZ_MATCH_MIN 4
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Size of @src, at most 65535 bytes
+ * @dst: Buffer for the compressed data
+ * @cap: Size of @dst
+ *
+ * Return: 0 if @len is out of range or the compressed data does not fit in
+ * @cap bytes, the caller then keeps the data as is. The size of the
+ * compressed data otherwise.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Compressed data, from lz_compress()
+ * @len: Size of @src
+ * @dst: Buffer for the decompressed data
+ * @cap: Size of @dst
+ *
+ * Every length and back reference is checked, so malformed input never reads
+ * or writes out of bounds.
+ *
+ * Return: -1 if @src is malformed or decompresses to more than @cap bytes.
+ * The size of the decompressed data otherwise.
+ */
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* _LZ_H */
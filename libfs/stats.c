@@ -0,0 +1,107 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+/* Counters of one thread */
+struct stats_thread {
+	size_t counters[STATS_COUNTERS];
+	struct stats_thread *next;
+};
+
+/* Protects everything below */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Counters of the live threads */
+static struct stats_thread *threads;
+/* Everything counted by threads that exited */
+static size_t retired[STATS_COUNTERS];
+/* Raw totals at the last reset */
+static size_t baseline[STATS_COUNTERS];
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_thread *self;
+
+/* Fold the counters of an exiting thread into the retired totals */
+static void stats_thread_exit(void *arg)
+{
+	struct stats_thread *t = arg, **link;
+	int i;
+
+	pthread_mutex_lock(&stats_lock);
+	for (i = 0; i < STATS_COUNTERS; i++)
+		retired[i] += t->counters[i];
+	for (link = &threads; *link != t; link = &(*link)->next)
+		;
+	*link = t->next;
+	pthread_mutex_unlock(&stats_lock);
+	free(t);
+}
+
+static void stats_init(void)
+{
+	pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+static struct stats_thread *stats_register(void)
+{
+	struct stats_thread *t;
+
+	pthread_once(&stats_once, stats_init);
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	pthread_mutex_lock(&stats_lock);
+	t->next = threads;
+	threads = t;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_setspecific(stats_key, t);
+	self = t;
+	return t;
+}
+
+void stats_add(enum stats_counter counter, size_t n)
+{
+	struct stats_thread *t = self;
+
+	if (!t) {
+		t = stats_register();
+		if (!t)
+			return;
+	}
+	/* Only this thread writes, readers merely need untorn values */
+	__atomic_store_n(&t->counters[counter], t->counters[counter] + n,
+			 __ATOMIC_RELAXED);
+}
+
+/* Totals since the process started. Called with the lock held */
+static void stats_raw(size_t totals[STATS_COUNTERS])
+{
+	struct stats_thread *t;
+	int i;
+
+	memcpy(totals, retired, sizeof(retired));
+	for (t = threads; t; t = t->next)
+		for (i = 0; i < STATS_COUNTERS; i++)
+			totals[i] += __atomic_load_n(&t->counters[i],
+						     __ATOMIC_RELAXED);
+}
+
+void stats_sum(size_t totals[STATS_COUNTERS])
+{
+	int i;
+
+	pthread_mutex_lock(&stats_lock);
+	stats_raw(totals);
+	for (i = 0; i < STATS_COUNTERS; i++)
+		totals[i] -= baseline[i];
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_reset(void)
+{
+	pthread_mutex_lock(&stats_lock);
+	stats_raw(baseline);
+	pthread_mutex_unlock(&stats_lock);
+}
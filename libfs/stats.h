@@ -0,0 +1,55 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Events counted by the library */
+enum stats_counter {
+	/* Blocks transferred from and to the disk */
+	STATS_BLOCK_READS,
+	STATS_BLOCK_WRITES,
+	/* FAT entries followed while walking chains */
+	STATS_FAT_HOPS,
+	/* Searches for free blocks, and free-map words they examined */
+	STATS_ALLOC_SEARCHES,
+	STATS_ALLOC_SCANNED,
+	/* Partial blocks read back before being overwritten */
+	STATS_RMW_CYCLES,
+	/* Calls to fs_read() and fs_write(), and bytes they moved */
+	STATS_READ_OPS,
+	STATS_READ_BYTES,
+	STATS_WRITE_OPS,
+	STATS_WRITE_BYTES,
+	/* Shared blocks replaced by a copy of their own before being written */
+	STATS_COW_BLOCKS,
+	/* Whole blocks left unwritten because an identical block, or a hole, stands in */
+	STATS_DEDUP_BLOCKS,
+	/* Blocks of compressed files decompressed, by fs_read() or to expand them */
+	STATS_UNPACKED_BLOCKS,
+	STATS_COUNTERS,
+};
+
+/**
+ * stats_add - Count events
+ * @counter: Kind of event
+ * @n: Number of events
+ *
+ * Each thread counts in a block of its own, so that hot paths never share a
+ * cache line or take a lock. The block is registered on the first call.
+ */
+void stats_add(enum stats_counter counter, size_t n);
+
+/**
+ * stats_sum - Merge the counters of every thread
+ * @totals: Filled with %STATS_COUNTERS totals since the last stats_reset()
+ *
+ * Threads that exited still count.
+ */
+void stats_sum(size_t totals[STATS_COUNTERS]);
+
+/**
+ * stats_reset - Start counting from zero again
+ */
+void stats_reset(void);
+
+#endif /* _STATS_H */
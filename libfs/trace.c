@@ -0,0 +1,195 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define trace_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Records are written out once this many bytes are buffered */
+#define TRACE_BUF_SIZE 65536
+
+/* Longest filename or diskname kept in a record */
+#define TRACE_NAME_MAX 255
+
+/* Protects everything below */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Trace file, -1 when not recording */
+static int trace_fd = -1;
+/* When the trace started */
+static uint64_t trace_epoch;
+/* Set when a record could not be written */
+static int trace_failed;
+static char trace_buf[TRACE_BUF_SIZE];
+static size_t trace_len;
+
+/* Read without the lock by trace_begin() */
+static int tracing;
+
+/* Number given to the next thread that records a call */
+static uint16_t next_thread = 1;
+static __thread uint16_t self;
+
+static uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Write out the buffered records. Called with the lock held */
+static void trace_flush(void)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < trace_len) {
+		ret = write(trace_fd, trace_buf + done, trace_len - done);
+		if (ret < 0) {
+			perror("write");
+			trace_failed = 1;
+			break;
+		}
+		done += ret;
+	}
+	trace_len = 0;
+}
+
+int trace_start(const char *path)
+{
+	struct fs_trace_header header;
+	int fd;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd >= 0) {
+		pthread_mutex_unlock(&trace_lock);
+		trace_error("already recording a trace");
+		return -1;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		pthread_mutex_unlock(&trace_lock);
+		perror("open");
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.signature, FS_TRACE_SIGNATURE, sizeof(header.signature));
+	header.version = FS_TRACE_VERSION;
+	header.record_size = sizeof(struct fs_trace_record);
+	memcpy(trace_buf, &header, sizeof(header));
+	trace_len = sizeof(header);
+
+	trace_fd = fd;
+	trace_failed = 0;
+	trace_epoch = trace_now();
+	__atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+	return 0;
+}
+
+int trace_stop(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd < 0) {
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+	__atomic_store_n(&tracing, 0, __ATOMIC_RELAXED);
+	trace_flush();
+	ret = trace_failed ? -1 : 0;
+	if (close(trace_fd)) {
+		perror("close");
+		ret = -1;
+	}
+	trace_fd = -1;
+	pthread_mutex_unlock(&trace_lock);
+	return ret;
+}
+
+uint64_t trace_begin(void)
+{
+	if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+		return 0;
+	return trace_now();
+}
+
+/* Record a call whose name argument is @name_len bytes at @name */
+static void trace_record(uint64_t start, enum fs_trace_op op, unsigned ctx,
+			 int fd, uint64_t arg, int ret, const char *name,
+			 size_t name_len)
+{
+	struct fs_trace_record rec;
+	uint64_t end, duration;
+
+	end = trace_now();
+	duration = end - start;
+	if (!self)
+		self = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.duration = duration > UINT32_MAX ? UINT32_MAX : duration;
+	rec.op = op;
+	rec.name_len = name_len;
+	rec.thread = self;
+	rec.ctx = ctx;
+	rec.fd = fd;
+	rec.ret = ret;
+	rec.arg = arg;
+
+	pthread_mutex_lock(&trace_lock);
+	/* Calls that began before the current trace started are left out */
+	if (trace_fd < 0 || start < trace_epoch) {
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+	rec.start = start - trace_epoch;
+	if (trace_len + sizeof(rec) + name_len > TRACE_BUF_SIZE)
+		trace_flush();
+	memcpy(trace_buf + trace_len, &rec, sizeof(rec));
+	if (name_len)
+		memcpy(trace_buf + trace_len + sizeof(rec), name, name_len);
+	trace_len += sizeof(rec) + name_len;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_end(uint64_t start, enum fs_trace_op op, unsigned ctx, int fd,
+	       uint64_t arg, int ret, const char *name)
+{
+	size_t name_len = 0;
+
+	if (!start)
+		return;
+	if (name) {
+		name_len = strlen(name);
+		if (name_len > TRACE_NAME_MAX)
+			name_len = TRACE_NAME_MAX;
+	}
+	trace_record(start, op, ctx, fd, arg, ret, name, name_len);
+}
+
+void trace_end_names(uint64_t start, enum fs_trace_op op, unsigned ctx,
+		     int ret, const char *name, const char *name2)
+{
+	char names[TRACE_NAME_MAX];
+	size_t len, len2;
+
+	if (!start)
+		return;
+	len = name ? strnlen(name, TRACE_NAME_MAX / 2) : 0;
+	len2 = name2 ? strnlen(name2, TRACE_NAME_MAX / 2) : 0;
+	if (len)
+		memcpy(names, name, len);
+	names[len] = '\0';
+	if (len2)
+		memcpy(names + len + 1, name2, len2);
+	trace_record(start, op, ctx, -1, 0, ret, names, len + 1 + len2);
+}
@@ -0,0 +1,66 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+#include "fs.h"
+
+/**
+ * trace_start - Start recording calls
+ * @path: Trace file, created or truncated
+ *
+ * Return: -1 if a trace is already being recorded, or if @path cannot be
+ * created. 0 otherwise.
+ */
+int trace_start(const char *path);
+
+/**
+ * trace_stop - Stop recording calls
+ *
+ * Write out the records still buffered and close the trace file.
+ *
+ * Return: -1 if no trace is being recorded, or if any record could not be
+ * written. 0 otherwise.
+ */
+int trace_stop(void);
+
+/**
+ * trace_begin - Timestamp the start of a call
+ *
+ * Return: 0 when no trace is being recorded, so that untraced calls only pay
+ * for one load. The current time in nanoseconds otherwise.
+ */
+uint64_t trace_begin(void);
+
+/**
+ * trace_end - Record a call
+ * @start: What trace_begin() returned when the call started
+ * @op: Kind of call
+ * @ctx: Identifier of the file system context the call worked on
+ * @fd: File descriptor argument, -1 for none
+ * @arg: Byte count or offset argument, 0 for none
+ * @ret: Return value
+ * @name: Filename or diskname argument, NULL for none
+ *
+ * Nothing is recorded if @start is 0 or if the trace stopped, or restarted,
+ * since. Records are buffered and written out in large chunks.
+ */
+void trace_end(uint64_t start, enum fs_trace_op op, unsigned ctx, int fd,
+	       uint64_t arg, int ret, const char *name);
+
+/**
+ * trace_end_names - Record a call taking two filenames
+ * @start: What trace_begin() returned when the call started
+ * @op: Kind of call
+ * @ctx: Identifier of the file system context the call worked on
+ * @ret: Return value
+ * @name: First filename argument
+ * @name2: Second filename argument
+ *
+ * Same as trace_end() with no file descriptor and no byte count, the name of
+ * the record being @name and @name2 separated by a NULL character.
+ */
+void trace_end_names(uint64_t start, enum fs_trace_op op, unsigned ctx,
+		     int ret, const char *name, const char *name2);
+
+#endif /* _TRACE_H */
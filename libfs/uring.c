@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+struct uring {
+	int fd;
+	/* Submission queue ring */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned sq_entries;
+	/* Entries queued by uring_prep_rw() and not submitted yet */
+	unsigned to_submit;
+	/* Completion queue ring (may share the mapping of the submission one) */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+			      unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+struct uring *uring_create(unsigned entries)
+{
+	struct io_uring_params p;
+	struct uring *r;
+	char *sq, *cq;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = sys_io_uring_setup(entries, &p);
+	if (r->fd < 0) {
+		free(r);
+		return NULL;
+	}
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = 0;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto err_fd;
+	if (r->cq_ring_size) {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, r->fd,
+				  IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto err_sq;
+	} else {
+		r->cq_ring = r->sq_ring;
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err_cq;
+
+	sq = r->sq_ring;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->sq_entries = p.sq_entries;
+
+	cq = r->cq_ring;
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return r;
+
+err_cq:
+	if (r->cq_ring_size)
+		munmap(r->cq_ring, r->cq_ring_size);
+err_sq:
+	munmap(r->sq_ring, r->sq_ring_size);
+err_fd:
+	close(r->fd);
+	free(r);
+	return NULL;
+}
+
+void uring_destroy(struct uring *r)
+{
+	if (!r)
+		return;
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring_size)
+		munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	free(r);
+}
+
+int uring_prep_rw(struct uring *r, int write, int fd, const struct iovec *iov,
+		  unsigned iovcnt, off_t off, uint64_t user_data)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *r->sq_tail;
+	unsigned idx;
+	struct io_uring_sqe *sqe;
+
+	if (tail - head >= r->sq_entries)
+		return -1;
+
+	idx = tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = iovcnt;
+	sqe->off = off;
+	sqe->user_data = user_data;
+	r->sq_array[idx] = idx;
+
+	/* Publish the entry before the new tail */
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->to_submit++;
+	return 0;
+}
+
+int uring_submit(struct uring *r, unsigned wait_nr)
+{
+	int ret;
+
+	do {
+		ret = sys_io_uring_enter(r->fd, r->to_submit, wait_nr,
+					 wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
+	r->to_submit -= ret;
+	return 0;
+}
+
+int uring_reap(struct uring *r, uint64_t *user_data, int *res)
+{
+	unsigned head = *r->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	cqe = &r->cqes[head & *r->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+
+	/* Hand the entry back to the kernel once it has been consumed */
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
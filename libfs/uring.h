@@ -0,0 +1,65 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/** Opaque io_uring instance */
+struct uring;
+
+/**
+ * uring_create - Set up an io_uring instance
+ * @entries: Number of submission queue entries
+ *
+ * Talks to the kernel directly through the io_uring system calls, so no
+ * external library is needed.
+ *
+ * Return: NULL if the kernel refuses to create the ring or memory cannot be
+ * allocated. The new ring otherwise.
+ */
+struct uring *uring_create(unsigned entries);
+
+/**
+ * uring_destroy - Tear down an io_uring instance
+ * @r: Ring to tear down, with no request in flight
+ */
+void uring_destroy(struct uring *r);
+
+/**
+ * uring_prep_rw - Queue a vectored read or write
+ * @r: Ring
+ * @write: Non-zero for a write, zero for a read
+ * @fd: File descriptor
+ * @iov: I/O vectors, which must stay valid until the request completes
+ * @iovcnt: Number of I/O vectors
+ * @off: File offset
+ * @user_data: Value handed back by uring_reap() for this request
+ *
+ * The request is only handed to the kernel by the next uring_submit().
+ *
+ * Return: -1 if the submission queue is full. 0 otherwise.
+ */
+int uring_prep_rw(struct uring *r, int write, int fd, const struct iovec *iov,
+		  unsigned iovcnt, off_t off, uint64_t user_data);
+
+/**
+ * uring_submit - Submit queued requests
+ * @r: Ring
+ * @wait_nr: Number of completions to wait for
+ *
+ * Return: -1 if io_uring_enter() fails. 0 otherwise.
+ */
+int uring_submit(struct uring *r, unsigned wait_nr);
+
+/**
+ * uring_reap - Take one completion
+ * @r: Ring
+ * @user_data: Filled with the value given to uring_prep_rw()
+ * @res: Filled with the request result (bytes transferred or -errno)
+ *
+ * Return: 0 if no completion is available. 1 otherwise.
+ */
+int uring_reap(struct uring *r, uint64_t *user_data, int *res);
+
+#endif /* _URING_H */